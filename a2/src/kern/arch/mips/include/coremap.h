@@ -50,13 +50,17 @@ struct lpage;
 void mmu_setas(struct addrspace *as);
 void mmu_unmap(struct addrspace *as, vaddr_t va);
 void mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable);
+bool mmu_premap(struct addrspace *as, vaddr_t va, paddr_t pa, int writable);
+void mmu_unmap_page(paddr_t pa);
 
 /* physical page allocation */
 paddr_t coremap_allocuser(struct lpage *lp);
+paddr_t coremap_allocuser_zero(struct lpage *lp);
 void coremap_free(paddr_t page, bool iskern);
 
 /* physical page pinning */
 void coremap_pin(paddr_t paddr);
+bool coremap_trypin(paddr_t paddr);
 int coremap_pageispinned(paddr_t paddr);
 void coremap_unpin(paddr_t paddr);
 
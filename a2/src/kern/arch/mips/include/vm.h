@@ -30,6 +30,7 @@
 #ifndef _MIPS_VM_H_
 #define _MIPS_VM_H_
 
+#include <platform/maxcpus.h>	/* for MAXCPUS */
 
 /*
  * Machine-dependent VM system definitions.
@@ -112,32 +113,61 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
  * Machine-dependent per-CPU data
  */
 
+/* size of the per-CPU cache of free kernel pages */
+#define CVM_KPAGES	8
+
 struct cpu_vm_machdep {
 	/* last address space loaded into MMU */
 	struct addrspace *cvm_lastas;
 
+	/* ASID of cvm_lastas (0 if none) */
+	uint32_t cvm_curasid;
+	/* next ASID to hand out; NUM_ASID means they've run out */
+	uint32_t cvm_nextasid;
+	/* current ASID generation, in the bits above the ASID */
+	uint32_t cvm_asidgen;
+
 	/* if < NUM_TLB, next TLB entry to use (when TLB not yet full) */
 	uint32_t cvm_nexttlb;
 	/* for OPT_SEQTLB, next TLB entry to use (after TLB full) */
 	uint32_t cvm_tlbseqslot;
+
+	/* cache of free kernel pages (coremap indexes); see coremap.c */
+	uint32_t cvm_kpages[CVM_KPAGES];
+	/* number of pages in cvm_kpages */
+	unsigned cvm_nkpages;
+	/* cached pages handed out, less pages put back, not yet counted */
+	int cvm_kpagedelta;
 };
 
 void cpu_vm_machdep_init(struct cpu_vm_machdep *cvm);
 void cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm);
 
+/*
+ * Machine-dependent per-address-space data: the TLB address space ID
+ * the address space has on each CPU. Each entry holds the ASID in its
+ * low bits and the CPU's ASID generation it was handed out in above
+ * them; it's only good while that is still the CPU's generation.
+ * 0 means none.
+ */
+
+struct as_machdep {
+	uint32_t am_asids[MAXCPUS];
+};
+
+void as_machdep_init(struct as_machdep *am);
+
 /*
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  *
- * Note that because IPI delivery isn't instantaneous, we may
- * sometimes end up flushing out a translation other than the one
- * someone wanted gone, unless we check that the coremap index
- * matches.
+ * A shootdown names a physical page by its coremap index, and the CPU
+ * getting it removes every TLB entry it has for that page. (A page
+ * can be mapped more than once; see the coremap.)
  */
 
 struct tlbshootdown {
-	int ts_tlbix;
 	unsigned ts_coremapindex;
 };
 
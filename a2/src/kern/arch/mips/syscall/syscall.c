@@ -31,12 +31,15 @@
 #include <kern/errno.h>
 #include <kern/syscall.h>
 #include <lib.h>
+#include <copyinout.h>
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
 #include <kern/wait.h> /* New include of wait macros for _exit */
 
+#include "opt-dumbvm.h"
+
 /*
  * System call dispatcher.
  *
@@ -112,6 +115,15 @@ syscall(struct trapframe *tf)
             /* ASST2: These implementations of read and write only work for
              * console I/O (stdin, stdout and stderr file descriptors)
              */
+            case SYS_open:
+                err = sys_open((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+                               &retval);
+                break;
+
+            case SYS_close:
+                err = sys_close(tf->tf_a0);
+                break;
+
             case SYS_read:
                 err = sys_read(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
                                &retval);
@@ -134,6 +146,43 @@ syscall(struct trapframe *tf)
 		    err = sys_fork(tf, &retval);
 		    break;
 
+#if !OPT_DUMBVM
+	    /* memory management */
+
+	    case SYS_sbrk:
+		    err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		    break;
+
+	    case SYS_mmap:
+	    {
+		    /* fd and offset are past a0-a3, on the user stack */
+		    int fd;
+		    off_t offset;
+
+		    err = copyin((userptr_t)tf->tf_sp + 16, &fd, sizeof(fd));
+		    if (err) {
+			    break;
+		    }
+		    err = copyin((userptr_t)tf->tf_sp + 24, &offset,
+				 sizeof(offset));
+		    if (err) {
+			    break;
+		    }
+		    err = sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				   tf->tf_a3, fd, offset, &retval);
+		    break;
+	    }
+
+	    case SYS_munmap:
+		    err = sys_munmap((userptr_t)tf->tf_a0, tf->tf_a1);
+		    break;
+
+	    case SYS_msync:
+		    err = sys_msync((userptr_t)tf->tf_a0, tf->tf_a1,
+				    tf->tf_a2);
+		    break;
+#endif
+
             /* ASST2 - You need to fill in the code for each of these cases */
             case SYS_getpid:
             case SYS_waitpid:
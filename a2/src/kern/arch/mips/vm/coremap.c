@@ -33,6 +33,7 @@
 #include <kern/unistd.h>
 #include <lib.h>
 #include <uio.h>
+#include <spl.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <cpu.h>
@@ -48,8 +49,13 @@
 #include <vnode.h>
 
 #include "opt-randpage.h"
+#include "opt-clockpage.h"
 #include "opt-randtlb.h"
 
+#if OPT_RANDPAGE && OPT_CLOCKPAGE
+#error "randpage and clockpage are mutually exclusive"
+#endif
+
 
 /*
  * MIPS coremap/MMU-control implementation.
@@ -80,16 +86,29 @@ struct coremap_entry {
 	struct lpage *cm_lpage;	/* logical page we hold, or NULL */
 
 	volatile
-	int cm_tlbix:7;		/* tlb index number, or -1 */
-	unsigned cm_cpunum:5;	/* cpu number for cm_tlbix */
+	uint32_t cm_cpumask;	/* cpus whose TLB may map the page */
+	volatile
+	unsigned cm_tlbcount:12; /* number of TLB entries mapping it */
 
 	unsigned cm_kernel:1,	/* true if kernel page */
 		cm_notlast:1,	/* true not last in sequence of kernel pages */
-		cm_allocated:1;	/* true if page in use (user or kernel) */
+		cm_allocated:1,	/* true if page in use (user or kernel) */
+		cm_referenced:1, /* true if used since the clock hand passed */
+		cm_zeroed:1;	/* true if free and in the pre-zeroed pool */
 	volatile 
 	unsigned cm_pinned:1;	/* true if page is busy */
 };
 
+/*
+ * A page can be in the TLB more than once: read-only text shared
+ * between processes is mapped by each of them, on one CPU or several.
+ * cm_tlbcount counts all the entries, everywhere. cm_cpumask has a
+ * bit for every CPU that has one of them, and maybe for some that
+ * have since dropped theirs; it's cleared when the count gets to 0.
+ * (MAXCPUS is 32, and there are 64 TLB entries per CPU, so 32 bits of
+ * mask and 12 of count do.)
+ */
+
 #define COREMAP_TO_PADDR(i)	(((paddr_t)PAGE_SIZE)*((i)+base_coremap_page))
 #define PADDR_TO_COREMAP(page)	(((page)/PAGE_SIZE) - base_coremap_page)
 
@@ -110,16 +129,84 @@ static struct wchan *coremap_pinchan;
 static struct wchan *coremap_shootchan;
 
 static uint32_t last_core_map_evicted; //keep track of the last page evicted
+static uint32_t clock_hand;		/* next page the clock looks at */
 static uint32_t num_coremap_entries;
 static uint32_t num_coremap_kernel;	/* pages allocated to the kernel */
 static uint32_t num_coremap_user;	/* pages allocated to user progs */
 static uint32_t num_coremap_free;	/* pages not allocated at all */
+static uint32_t num_coremap_cached;	/* pages in per-CPU kernel caches */
 static uint32_t base_coremap_page;
 static struct coremap_entry *coremap;
 
 static volatile uint32_t ct_shootdowns_sent;
 static volatile uint32_t ct_shootdowns_done;
 static volatile uint32_t ct_shootdown_interrupts;
+static volatile uint32_t ct_clock_cleanvictims;
+static volatile uint32_t ct_clock_dirtyvictims;
+static volatile uint32_t ct_pageout_wakeups;
+static volatile uint32_t ct_pageout_evictions;
+static volatile uint32_t ct_asid_rollovers;
+
+/*
+ * Pageout thread state. The thread wakes up when the number of free
+ * pages drops below pageout_lowater and evicts pages until there are
+ * pageout_hiwater free. The marks are set at boot as fractions of
+ * memory (but at least CM_MIN_SLACK pages).
+ */
+#define PAGEOUT_LOWATER_DIV	32	/* lowater is 1/32 of the pages */
+#define PAGEOUT_HIWATER_DIV	16	/* hiwater is 1/16 of the pages */
+
+static uint32_t pageout_lowater;
+static uint32_t pageout_hiwater;
+static struct wchan *pageout_wchan;	/* NULL until thread starts */
+
+/*
+ * Pre-zeroed page pool. Idle CPUs zero free pages (see vm_idle) so
+ * zerofill faults can take one that's ready instead of clearing it
+ * then and there. The pool is a stack of coremap indexes; its pages
+ * are free, not pinned, and have cm_zeroed set. Ordinary allocations
+ * avoid them while there are other free pages.
+ *
+ * The pool is kept to 1/PREZERO_DIV of the pages, but no more than
+ * PREZERO_MAX (the size of the stack).
+ */
+#define PREZERO_DIV		16
+#define PREZERO_MAX		256
+
+static uint32_t prezero_pool[PREZERO_MAX];
+static uint32_t prezero_num;		/* pages in the pool */
+static uint32_t prezero_busy;		/* pages being zeroed for it */
+static uint32_t prezero_target;		/* 0 until coremap_bootstrap */
+
+static volatile uint32_t ct_prezero_zeroed;
+static volatile uint32_t ct_prezero_hits;
+static volatile uint32_t ct_prezero_misses;
+
+/*
+ * Free page bitmap. Bit i is set iff page i is free, not pinned, and
+ * not in the pre-zeroed pool; that is, iff it's a page
+ * coremap_find_free can hand out. Finding one then means finding a
+ * nonzero word instead of looking at every coremap entry in turn.
+ * The bitmap is stolen along with the coremap at boot.
+ *
+ * Single pages are taken from the top of memory, so freemap_hint
+ * remembers the highest word that might have bits set.
+ */
+static uint32_t *freemap;
+static uint32_t freemap_hint;
+
+/*
+ * Per-CPU kernel page caches; see "Kernel page caches" below. They
+ * are filled and emptied kpage_batch pages at a time, and hold at most
+ * twice that. kpage_batch is set at boot from the amount of memory;
+ * 0 turns the caches off.
+ */
+#define KPAGE_BATCH_DIV		128	/* batch is 1/128 of the pages */
+
+static unsigned kpage_batch;
+
+static volatile uint32_t ct_kpage_fills;
+static volatile uint32_t ct_kpage_drains;
 
 ////////////////////////////////////////////////////////////
 //
@@ -129,15 +216,33 @@ void
 cpu_vm_machdep_init(struct cpu_vm_machdep *cvm)
 {
 	cvm->cvm_lastas = NULL;
+	cvm->cvm_curasid = 0;
+	cvm->cvm_nextasid = 1;
+	cvm->cvm_asidgen = NUM_ASID;
 	cvm->cvm_nexttlb = 0;
 	cvm->cvm_tlbseqslot = 0;
+	cvm->cvm_nkpages = 0;
+	cvm->cvm_kpagedelta = 0;
 }
 
 void
 cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm)
 {
-	(void)cvm;
-	/* nothing */
+	KASSERT(cvm->cvm_nkpages == 0);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-address-space data
+
+void
+as_machdep_init(struct as_machdep *am)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		am->am_asids[i] = 0;
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -147,22 +252,70 @@ cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm)
 void
 vm_printmdstats(void)
 {
-	uint32_t ss, sd, si;
+	uint32_t ss, sd, si, cc, cd, pw, pe, ar, pz, ph, pm, kf, kd;
 
 	spinlock_acquire(&coremap_spinlock);
 	ss = ct_shootdowns_sent;
 	sd = ct_shootdowns_done;
 	si = ct_shootdown_interrupts;
+	cc = ct_clock_cleanvictims;
+	cd = ct_clock_dirtyvictims;
+	pw = ct_pageout_wakeups;
+	pe = ct_pageout_evictions;
+	ar = ct_asid_rollovers;
+	pz = ct_prezero_zeroed;
+	ph = ct_prezero_hits;
+	pm = ct_prezero_misses;
+	kf = ct_kpage_fills;
+	kd = ct_kpage_drains;
 	spinlock_release(&coremap_spinlock);
 
 	kprintf("vm: shootdowns: %lu sent, %lu done (%lu interrupts)\n",
 		(unsigned long) ss, (unsigned long) sd, (unsigned long) si);
+	kprintf("vm: pageout thread: %lu wakeups, %lu evictions\n",
+		(unsigned long) pw, (unsigned long) pe);
+	kprintf("vm: %lu ASID rollovers\n", (unsigned long) ar);
+	kprintf("vm: %lu pages zeroed while idle; zerofills: %lu "
+		"pre-zeroed, %lu zeroed on demand\n", (unsigned long) pz,
+		(unsigned long) ph, (unsigned long) pm);
+	kprintf("vm: kernel page caches: %lu fills, %lu drains\n",
+		(unsigned long) kf, (unsigned long) kd);
+#if OPT_CLOCKPAGE
+	kprintf("vm: clock victims: %lu clean, %lu dirty\n",
+		(unsigned long) cc, (unsigned long) cd);
+#else
+	(void)cc;
+	(void)cd;
+#endif
 }
 
 ////////////////////////////////////////////////////////////
 //
 // TLB handling
 
+/*
+ * TLB entries are tagged with address space IDs, so the TLB doesn't
+ * have to be flushed when switching address spaces. Each CPU hands
+ * out its own ASIDs to address spaces as they're run on it (see
+ * mmu_setas). ASID 0 is never handed out; it's loaded when there's
+ * no address space, and no valid entry is ever written with it.
+ *
+ * Because every TLB operation also loads ENTRYHI, and with it the
+ * current ASID, everything written or probed for has to carry the
+ * current ASID in it. CURPID gives it in the place it goes.
+ *
+ * Entries belonging to address spaces that aren't running stay in
+ * the TLB, on any CPU, and are tracked in the coremap like any
+ * other; whenever a page is freed, evicted, or remapped writable,
+ * its entries are shot down wherever they are. So the only way a
+ * stale entry could be matched is through its ASID being reused, and
+ * that only happens after a full flush (see asid_alloc).
+ */
+#define CURPID() (curcpu->c_vm.cvm_curasid << TLBHI_PIDSHIFT)
+
+/* This CPU's bit in cm_cpumask. */
+#define CPUMASK() ((uint32_t)1 << curcpu->c_number)
+
 /*
  * tlb_replace - TLB replacement algorithm. Returns index of TLB entry
  * to replace.
@@ -206,15 +359,17 @@ tlb_invalidate(int tlbix)
 		pa = elo & TLBLO_PPAGE;
 		cmix = PADDR_TO_COREMAP(pa);
 		KASSERT(cmix < num_coremap_entries);
-		KASSERT(coremap[cmix].cm_tlbix == tlbix);
-		KASSERT(coremap[cmix].cm_cpunum == curcpu->c_number);
-		coremap[cmix].cm_tlbix = -1;
-		coremap[cmix].cm_cpunum = 0;
+		KASSERT(coremap[cmix].cm_tlbcount > 0);
+		KASSERT(coremap[cmix].cm_cpumask & CPUMASK());
+		coremap[cmix].cm_tlbcount--;
+		if (coremap[cmix].cm_tlbcount == 0) {
+			coremap[cmix].cm_cpumask = 0;
+		}
 		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
 			(unsigned long) COREMAP_TO_PADDR(cmix));
 	}
 
-	tlb_write(TLBHI_INVALID(tlbix), TLBLO_INVALID(), tlbix);
+	tlb_write(TLBHI_INVALID(tlbix) | CURPID(), TLBLO_INVALID(), tlbix);
 	DEBUG(DB_TLB, "... pa ------- <-- tlb %d\n", tlbix);
 }
 
@@ -236,6 +391,32 @@ tlb_clear(void)
 	curcpu->c_vm.cvm_nexttlb = 0;
 }
 
+/*
+ * tlb_flushlocal: remove this CPU's TLB entries (if any) for the
+ * physical page with coremap index WHERE, under whatever ASID.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+tlb_flushlocal(unsigned where)
+{
+	uint32_t elo, ehi;
+	paddr_t pa;
+	int i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	pa = COREMAP_TO_PADDR(where);
+	for (i=0; i<NUM_TLB && coremap[where].cm_tlbcount > 0; i++) {
+		tlb_read(&ehi, &elo, i);
+		if ((elo & TLBLO_VALID) && (elo & TLBLO_PPAGE) == pa) {
+			tlb_invalidate(i);
+		}
+	}
+	coremap[where].cm_cpumask &= ~CPUMASK();
+}
+
 /*
  * Do one TLB shootdown.
  */
@@ -243,17 +424,14 @@ void
 vm_tlbshootdown(const struct tlbshootdown *ts, int num)
 {
 	int i;
-	int tlbix;
 	unsigned where;
 
 	spinlock_acquire(&coremap_spinlock);
 	ct_shootdown_interrupts++;
 	for (i=0; i<num; i++) {
-		tlbix = ts[i].ts_tlbix;
 		where = ts[i].ts_coremapindex;
-		if (coremap[where].cm_tlbix == tlbix &&
-		    coremap[where].cm_cpunum == curcpu->c_number) {
-			tlb_invalidate(tlbix);
+		if (coremap[where].cm_cpumask & CPUMASK()) {
+			tlb_flushlocal(where);
 			ct_shootdowns_done++;
 		}
 	}
@@ -288,6 +466,53 @@ tlb_shootwait(void)
 	spinlock_acquire(&coremap_spinlock);
 }
 
+/*
+ * tlb_flushpage: remove all TLB mappings of the physical page with
+ * coremap index WHERE, on whatever CPUs they live. Other CPUs that
+ * may have one get a shootdown, and we wait for all of them.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. May release it
+ * and block, so the page should be pinned.
+ */
+static
+void
+tlb_flushpage(unsigned where)
+{
+	struct tlbshootdown ts;
+	uint32_t others;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[where].cm_pinned);
+
+	if (coremap[where].cm_tlbcount == 0) {
+		return;
+	}
+
+	if (coremap[where].cm_cpumask & CPUMASK()) {
+		tlb_flushlocal(where);
+	}
+
+	others = coremap[where].cm_cpumask;
+	if (others != 0) {
+		/* yay, TLB shootdown */
+		ts.ts_coremapindex = where;
+		for (i=0; i<MAXCPUS; i++) {
+			if (others & ((uint32_t)1 << i)) {
+				ct_shootdowns_sent++;
+				ipi_tlbshootdown(i, &ts);
+			}
+		}
+		while (coremap[where].cm_tlbcount > 0) {
+			tlb_shootwait();
+		}
+	}
+	KASSERT(coremap[where].cm_tlbcount == 0);
+	KASSERT(coremap[where].cm_cpumask == 0);
+	DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
+	      (unsigned long) COREMAP_TO_PADDR(where));
+}
+
 /*
  * tlb_unmap: Searches the TLB for a vaddr translation and invalidates
  * it if it exists.
@@ -305,7 +530,7 @@ tlb_unmap(vaddr_t va)
 
 	KASSERT(va < MIPS_KSEG0);
 
-	i = tlb_probe(va & PAGE_FRAME,0);
+	i = tlb_probe((va & PAGE_FRAME) | CURPID(), 0);
 	if (i < 0) {
 		return;
 	}
@@ -339,6 +564,73 @@ mipstlb_getslot(void)
 	return i;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Free page bitmap
+//
+
+/*
+ * freemap_set: mark the page at coremap index WHERE available.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+freemap_set(uint32_t where)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT((freemap[where/32] & (1U << (where%32))) == 0);
+
+	freemap[where/32] |= 1U << (where%32);
+	if (where/32 > freemap_hint) {
+		freemap_hint = where/32;
+	}
+}
+
+/*
+ * freemap_clear: mark the page at coremap index WHERE unavailable.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+freemap_clear(uint32_t where)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT((freemap[where/32] & (1U << (where%32))) != 0);
+
+	freemap[where/32] &= ~(1U << (where%32));
+}
+
+/*
+ * freemap_find: return the coremap index of the highest available
+ * page, or -1 if there are none. Doesn't mark it.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+int
+freemap_find(void)
+{
+	uint32_t w, bits;
+	int b;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (w = freemap_hint + 1; w-- > 0; ) {
+		bits = freemap[w];
+		if (bits != 0) {
+			freemap_hint = w;
+			for (b = 31; (bits & (1U << b)) == 0; b--) {
+				/* nothing */
+			}
+			return w*32 + b;
+		}
+	}
+	freemap_hint = 0;
+	return -1;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Page replacement code
@@ -367,7 +659,7 @@ page_replace(void)
 	/* Generate random index until an unpinned, unkernel is found. */
 	uint32_t index = random() % num_coremap_entries;
 	int i = 0;
-	while (coremap[where].cm_kernel || coremap[index].cm_pinned) {
+	while (coremap[index].cm_kernel || coremap[index].cm_pinned) {
 		index = random() % num_coremap_entries;
 		i++;
 		if (i > 20000)
@@ -376,7 +668,100 @@ page_replace(void)
 	return index;
 }
 
-#else /* not OPT_RANDPAGE */
+#elif OPT_CLOCKPAGE
+
+/*
+ * Clock (second-chance) page replacement.
+ *
+ * The MIPS has no hardware reference bits, so we make our own:
+ * mmu_map sets cm_referenced whenever it enters a page into the TLB.
+ * When the clock hand passes a referenced page, it clears the bit and
+ * also invalidates the page's TLB entry, so that if the page is used
+ * again it refaults and gets marked referenced again. Pages mapped on
+ * other CPUs are skipped rather than shot down, as that would mean
+ * blocking here; they are in use anyway. (If nothing else can be
+ * found, one of them is taken and do_evict shoots it down.)
+ *
+ * Among unreferenced pages we prefer clean ones, since evicting them
+ * costs no I/O. The first unreferenced dirty page seen is remembered
+ * and taken if a full turn of the clock finds no clean one. Whether a
+ * page is dirty is peeked at without locking the lpage (we can't lock
+ * it here); that's only used as a hint, so it doesn't matter if it's
+ * stale.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+
+static
+uint32_t
+page_replace(void)
+{
+	uint32_t i, n, dirtyvictim, busyvictim;
+	struct lpage *lp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	/* num_coremap_entries means none found */
+	dirtyvictim = busyvictim = num_coremap_entries;
+
+	for (n = 0; n < 2*num_coremap_entries; n++) {
+		if (dirtyvictim < num_coremap_entries &&
+		    n >= num_coremap_entries) {
+			break;
+		}
+
+		i = clock_hand;
+		clock_hand = (clock_hand + 1) % num_coremap_entries;
+
+		if (coremap[i].cm_kernel || coremap[i].cm_pinned) {
+			continue;
+		}
+		if (!coremap[i].cm_allocated) {
+			return i;
+		}
+
+		if (coremap[i].cm_cpumask & ~CPUMASK()) {
+			/* in use on another cpu */
+			if (busyvictim == num_coremap_entries) {
+				busyvictim = i;
+			}
+			continue;
+		}
+
+		if (coremap[i].cm_referenced) {
+			/* second chance */
+			coremap[i].cm_referenced = 0;
+			if (coremap[i].cm_cpumask & CPUMASK()) {
+				tlb_flushlocal(i);
+			}
+			continue;
+		}
+
+		lp = coremap[i].cm_lpage;
+		KASSERT(lp != NULL);
+		if (!LP_ISDIRTY(lp)) {
+			ct_clock_cleanvictims++;
+			return i;
+		}
+		if (dirtyvictim == num_coremap_entries) {
+			dirtyvictim = i;
+		}
+	}
+
+	i = dirtyvictim < num_coremap_entries ? dirtyvictim : busyvictim;
+	if (i == num_coremap_entries) {
+		panic("page_replace: Can't find unpinned or non-kernel page.\n");
+	}
+	if (LP_ISDIRTY(coremap[i].cm_lpage)) {
+		ct_clock_dirtyvictims++;
+	}
+	else {
+		ct_clock_cleanvictims++;
+	}
+	return i;
+}
+
+#else /* not OPT_RANDPAGE, not OPT_CLOCKPAGE */
 
 /*
  * Sequential page replacement.
@@ -400,7 +785,7 @@ page_replace(void)
 	return last_core_map_evicted;
 }
 
-#endif /* OPT_RANDPAGE */
+#endif /* OPT_RANDPAGE, OPT_CLOCKPAGE */
 
 
 ////////////////////////////////////////////////////////////
@@ -430,7 +815,7 @@ coremap_bootstrap(void)
 {
 	uint32_t i;
 	paddr_t first, last;
-	uint32_t npages, coremapsize;
+	uint32_t npages, coremapsize, freemapsize, stolensize;
 
 	ram_getsize(&first, &last);
 
@@ -455,16 +840,21 @@ coremap_bootstrap(void)
 	 * more than two. So for simplicity (and robustness) we'll
 	 * avoid the relaxation computations necessary to optimize the
 	 * coremap size.
+	 *
+	 * The free page bitmap goes right after the coremap, in the
+	 * same pages.
 	 */
 	coremapsize = npages * sizeof(struct coremap_entry);
-	coremapsize = ROUNDUP(coremapsize, PAGE_SIZE);
-	KASSERT((coremapsize & PAGE_FRAME) == coremapsize);
+	freemapsize = DIVROUNDUP(npages, 32) * sizeof(uint32_t);
+	stolensize = ROUNDUP(coremapsize + freemapsize, PAGE_SIZE);
+	KASSERT((stolensize & PAGE_FRAME) == stolensize);
 
 	/*
 	 * Steal pages for the coremap.
 	 */
 	coremap = (struct coremap_entry *) PADDR_TO_KVADDR(first);
-	first += coremapsize;
+	freemap = (uint32_t *) PADDR_TO_KVADDR(first + coremapsize);
+	first += stolensize;
 
 	if (first >= last) {
 		/* This cannot happen unless coremap_entry gets really huge */
@@ -481,8 +871,9 @@ coremap_bootstrap(void)
 	num_coremap_kernel = 0;
 	num_coremap_user = 0;
 	num_coremap_free = num_coremap_entries;
+	num_coremap_cached = 0;
 
-	KASSERT(num_coremap_entries + (coremapsize/PAGE_SIZE) == npages);
+	KASSERT(num_coremap_entries + (stolensize/PAGE_SIZE) == npages);
 
 	/*
 	 * Initialize the coremap entries.
@@ -491,12 +882,44 @@ coremap_bootstrap(void)
 		coremap[i].cm_kernel = 0;
 		coremap[i].cm_notlast = 0;
 		coremap[i].cm_allocated = 0;
+		coremap[i].cm_referenced = 0;
+		coremap[i].cm_zeroed = 0;
 		coremap[i].cm_pinned = 0;
-		coremap[i].cm_tlbix = -1;
-		coremap[i].cm_cpunum = 0;
+		coremap[i].cm_cpumask = 0;
+		coremap[i].cm_tlbcount = 0;
 		coremap[i].cm_lpage = NULL;
 	}
 
+	/*
+	 * Everything starts out free.
+	 */
+	bzero(freemap, freemapsize);
+	for (i=0; i < num_coremap_entries; i++) {
+		freemap[i/32] |= 1U << (i%32);
+	}
+	freemap_hint = (num_coremap_entries - 1) / 32;
+
+	pageout_lowater = num_coremap_entries / PAGEOUT_LOWATER_DIV;
+	if (pageout_lowater < CM_MIN_SLACK) {
+		pageout_lowater = CM_MIN_SLACK;
+	}
+	pageout_hiwater = num_coremap_entries / PAGEOUT_HIWATER_DIV;
+	if (pageout_hiwater <= pageout_lowater) {
+		pageout_hiwater = pageout_lowater + CM_MIN_SLACK;
+	}
+
+	prezero_num = 0;
+	prezero_busy = 0;
+	prezero_target = num_coremap_entries / PREZERO_DIV;
+	if (prezero_target > PREZERO_MAX) {
+		prezero_target = PREZERO_MAX;
+	}
+
+	kpage_batch = num_coremap_entries / KPAGE_BATCH_DIV;
+	if (kpage_batch > CVM_KPAGES / 2) {
+		kpage_batch = CVM_KPAGES / 2;
+	}
+
 	coremap_pinchan = wchan_create("vmpin");
 	coremap_shootchan = wchan_create("tlbshoot");
 	if (coremap_pinchan == NULL || coremap_shootchan == NULL) {
@@ -517,13 +940,29 @@ piggish_kernel(int proposed_kernel_pages)
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
-	nkp = num_coremap_kernel + proposed_kernel_pages ;
+	/* count cached pages as kernel pages; they may well be soon */
+	nkp = num_coremap_kernel + num_coremap_cached + proposed_kernel_pages;
 	if (nkp >= num_coremap_entries - CM_MIN_SLACK) {
 		return 1;
 	}
 	return 0;
 }
 
+/*
+ * do_evict: evict the page at coremap index WHERE, writing it to swap
+ * if it's dirty.
+ *
+ * The page stays pinned, and the lpage keeps pointing at it, until
+ * the write is done; being pinned is what marks a page as in transit.
+ * Anyone else who wants the page meanwhile (a fault on it, or
+ * lpage_destroy) waits for the pin in lpage_lock_and_pin and then
+ * finds the page gone. So there's no need to serialize paging
+ * globally, and several evictions and pageins can be in progress at
+ * once.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Releases it
+ * during the I/O.
+ */
 static
 void
 do_evict(int where)
@@ -532,7 +971,6 @@ do_evict(int where)
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
-	KASSERT(lock_do_i_hold(global_paging_lock));
 
 	KASSERT(coremap[where].cm_pinned==0);
 	KASSERT(coremap[where].cm_allocated);
@@ -547,29 +985,8 @@ do_evict(int where)
 	 */
 	coremap[where].cm_pinned = 1;
 
-	if (coremap[where].cm_tlbix >= 0) {
-		if (coremap[where].cm_cpunum != curcpu->c_number) {
-			/* yay, TLB shootdown */
-			struct tlbshootdown ts;
-			ts.ts_tlbix = coremap[where].cm_tlbix;
-			ts.ts_coremapindex = where;
-			ct_shootdowns_sent++;
-			ipi_tlbshootdown(coremap[where].cm_cpunum, &ts);
-			while (coremap[where].cm_tlbix != -1) {
-				tlb_shootwait();
-			}
-			KASSERT(coremap[where].cm_tlbix == -1);
-			KASSERT(coremap[where].cm_cpunum == 0);
-			KASSERT(coremap[where].cm_lpage == lp);
-		}
-		else {
-			tlb_invalidate(coremap[where].cm_tlbix);
-			coremap[where].cm_tlbix = -1;
-			coremap[where].cm_cpunum = 0;
-		}
-		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-		      (unsigned long) COREMAP_TO_PADDR(where));
-	}
+	tlb_flushpage(where);
+	KASSERT(coremap[where].cm_lpage == lp);
 
 	/* properly we ought to lock the lpage to test this */
 	KASSERT(COREMAP_TO_PADDR(where) == (lp->lp_paddr & PAGE_FRAME));
@@ -589,11 +1006,12 @@ do_evict(int where)
 	coremap[where].cm_allocated = 0;
 	coremap[where].cm_lpage = NULL;
 	coremap[where].cm_pinned = 0;
+	freemap_set(where);
 
 	num_coremap_user--;
 	num_coremap_free++;
 	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
-	       == num_coremap_entries);
+	       +num_coremap_cached == num_coremap_entries);
 
 	wchan_wakeall(coremap_pinchan);
 }
@@ -605,7 +1023,6 @@ do_page_replace(void)
 	int where;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
-	KASSERT(lock_do_i_hold(global_paging_lock));
 
 	where = page_replace();
 
@@ -621,6 +1038,49 @@ do_page_replace(void)
 	return where;
 }
 
+/*
+ * pageout_poke: wake the pageout thread if we're getting short of
+ * free pages.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+pageout_poke(void)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	if (pageout_wchan != NULL && num_coremap_free < pageout_lowater) {
+		wchan_wakeone(pageout_wchan);
+	}
+}
+
+/*
+ * prezero_remove: take the page at coremap index WHERE out of the
+ * pre-zeroed pool, because it's being allocated for something else.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+prezero_remove(uint32_t where)
+{
+	uint32_t i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[where].cm_zeroed);
+
+	/* it's usually the one on top */
+	for (i=prezero_num; i-- > 0; ) {
+		if (prezero_pool[i] == where) {
+			prezero_pool[i] = prezero_pool[--prezero_num];
+			coremap[where].cm_zeroed = 0;
+			return;
+		}
+	}
+	panic("prezero_remove: page %u not in pool\n", where);
+}
+
 static
 void
 mark_pages_allocated(int start, int npages, int dopin, int iskern)
@@ -633,13 +1093,20 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
 		KASSERT(coremap[i].cm_allocated==0);
 		KASSERT(coremap[i].cm_kernel==0);
 		KASSERT(coremap[i].cm_lpage==NULL);
-		KASSERT(coremap[i].cm_tlbix<0);
-		KASSERT(coremap[i].cm_cpunum == 0);
+		KASSERT(coremap[i].cm_tlbcount == 0);
+		KASSERT(coremap[i].cm_cpumask == 0);
 
+		if (coremap[i].cm_zeroed) {
+			prezero_remove(i);
+		}
+		else {
+			freemap_clear(i);
+		}
 		if (dopin) {
 			coremap[i].cm_pinned = 1;
 		}
 		coremap[i].cm_allocated = 1;
+		coremap[i].cm_referenced = 1;
 		if (iskern) {
 			coremap[i].cm_kernel = 1;
 		}
@@ -656,7 +1123,37 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
 	}
 	num_coremap_free -= npages;
 	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
-	       == num_coremap_entries);
+	       +num_coremap_cached == num_coremap_entries);
+}
+
+/*
+ * coremap_find_free: find a free page, starting from the top end of
+ * memory, using the free page bitmap. Returns -1 if there isn't one.
+ * Pages in the pre-zeroed pool are only used if there's nothing else.
+ *
+ * For single-page allocations, start at the top end of memory. We
+ * will do multi-page allocations at the bottom end in the hope of
+ * reducing long-term fragmentation. But it probably won't help
+ * much if the system gets busy.
+ */
+static
+int
+coremap_find_free(void)
+{
+	int i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	i = freemap_find();
+	if (i >= 0) {
+		KASSERT(!coremap[i].cm_pinned);
+		KASSERT(!coremap[i].cm_allocated);
+		KASSERT(!coremap[i].cm_zeroed);
+		KASSERT(coremap[i].cm_kernel==0);
+		KASSERT(coremap[i].cm_lpage==NULL);
+		return i;
+	}
+	return prezero_num > 0 ? (int)prezero_pool[0] : -1;
 }
 
 /*
@@ -665,23 +1162,21 @@ mark_pages_allocated(int start, int npages, int dopin, int iskern)
  * Allocate one page of memory, mark it pinned if requested, and
  * return its paddr. The page is marked a kernel page iff the lp
  * argument is NULL.
+ *
+ * If there's no free page, we evict one ourselves. Other threads
+ * may be evicting or paging in at the same time; see do_evict.
  */
 static
 paddr_t
 coremap_alloc_one_page(struct lpage *lp, int dopin)
 {
-	int candidate, i, iskern;
+	int candidate, iskern;
+	bool canevict;
 
 	iskern = (lp == NULL);
 
-	/*
-	 * Hold this while allocating to reduce starvation of multipage
-	 * allocations. (But we can't if we're in an interrupt, or if
-	 * we're still very early in boot.)
-	 */
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_acquire(global_paging_lock);
-	}
+	/* We can't evict in an interrupt, or if we're very early in boot. */
+	canevict = curthread != NULL && !curthread->t_in_interrupt;
 
 	spinlock_acquire(&coremap_spinlock);
 
@@ -691,44 +1186,18 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 	if (iskern && piggish_kernel(1)) {
 		coremap_print_short();
 		spinlock_release(&coremap_spinlock);
-		if (curthread != NULL && !curthread->t_in_interrupt) {
-			lock_release(global_paging_lock);
-		}
 		kprintf("alloc_kpages: kernel heap full getting 1 page\n");
 		return INVALID_PADDR;
 	}
 
-	/*
-	 * For single-page allocations, start at the top end of memory. We
-	 * will do multi-page allocations at the bottom end in the hope of
-	 * reducing long-term fragmentation. But it probably won't help
-	 * much if the system gets busy.
-	 */
-
-	candidate = -1;
-
-	if (num_coremap_free > 0) {
-		/* There's a free page. Find it. */
-
-		for (i = num_coremap_entries-1; i>=0; i--) {
-			if (coremap[i].cm_pinned || coremap[i].cm_allocated) {
-				continue;
-			}
-			KASSERT(coremap[i].cm_kernel==0);
-			KASSERT(coremap[i].cm_lpage==NULL);
-			candidate = i;
-			break;
-		}
-	}
+	candidate = coremap_find_free();
 
-	if (candidate < 0 && curthread != NULL && !curthread->t_in_interrupt) {
-		KASSERT(num_coremap_free==0);
+	if (candidate < 0 && canevict) {
 		candidate = do_page_replace();
 	}
 
 	if (candidate < 0) {
 		spinlock_release(&coremap_spinlock);
-		/* we don't hold global_paging_lock; don't unlock it */
 		return INVALID_PADDR;
 	}
 
@@ -737,13 +1206,12 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 	coremap[candidate].cm_lpage = lp;
 
 	// free pages should not be in the TLB
-	KASSERT(coremap[candidate].cm_tlbix < 0);
-	KASSERT(coremap[candidate].cm_cpunum == 0);
+	KASSERT(coremap[candidate].cm_tlbcount == 0);
+	KASSERT(coremap[candidate].cm_cpumask == 0);
+
+	pageout_poke();
 
 	spinlock_release(&coremap_spinlock);
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_release(global_paging_lock);
-	}
 
 	return COREMAP_TO_PADDR(candidate);
 }
@@ -759,24 +1227,11 @@ coremap_alloc_multipages(unsigned npages)
 
 	KASSERT(npages>1);
 
-	/*
-	 * Get this early and hold it during the allocation so nobody else
-	 * can start paging while we're trying to page out the victims in
-	 * the allocation range.
-	 */
-
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_acquire(global_paging_lock);
-	}
-
 	spinlock_acquire(&coremap_spinlock);
 
 	if (piggish_kernel(npages)) {
 		coremap_print_short();
 		spinlock_release(&coremap_spinlock);
-		if (curthread != NULL && !curthread->t_in_interrupt) {
-			lock_release(global_paging_lock);
-		}
 		kprintf("alloc_kpages: kernel heap full getting %u pages\n",
 			npages);
 		return INVALID_PADDR;
@@ -834,20 +1289,16 @@ coremap_alloc_multipages(unsigned npages)
 		if (bestbase < 0) {
 			/* no good */
 			spinlock_release(&coremap_spinlock);
-			if (curthread != NULL && !curthread->t_in_interrupt) {
-				lock_release(global_paging_lock);
-			}
 			return INVALID_PADDR;
 		}
 
 		/*
 		 * If any pages need evicting, evict them and try the
-		 * whole schmear again. Because we are holding
-		 * global_paging_lock, nobody else *ought* to allocate
-		 * or pin these pages until we're done. But the
-		 * contract with global_paging_lock is that it's
-		 * advisory -- so tolerate and retry if/in case
-		 * something changes while we're paging.
+		 * whole schmear again. Other threads can allocate or
+		 * pin pages in the range while we're paging (single
+		 * page allocations start from the other end of memory,
+		 * so hopefully they mostly won't) -- so tolerate and
+		 * retry if something changes.
 		 */
 
 		evicted = 0;
@@ -862,7 +1313,6 @@ coremap_alloc_multipages(unsigned npages)
 				    curthread->t_in_interrupt) {
 					/* Can't evict here */
 					spinlock_release(&coremap_spinlock);
-					/* don't need to unlock */
 					return INVALID_PADDR;
 				}
 				do_evict(i);
@@ -874,14 +1324,96 @@ coremap_alloc_multipages(unsigned npages)
 	mark_pages_allocated(bestbase, npages, 
 			     0 /* dopin -- not needed for kernel pages */,
 			     1 /* kernel */);
+	pageout_poke();
 				     
 	spinlock_release(&coremap_spinlock);
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_release(global_paging_lock);
-	}
 	return COREMAP_TO_PADDR(bestbase);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Pageout thread
+//
+
+/*
+ * pageout_thread: evict pages in the background, so page faults can
+ * usually just take a free page instead of evicting one (and perhaps
+ * writing it to swap) themselves.
+ *
+ * The thread sleeps until an allocation leaves fewer than
+ * pageout_lowater free pages, and then evicts pages until there are
+ * pageout_hiwater free.
+ *
+ * Synchronization: sleeps on pageout_wchan. Uses coremap_spinlock
+ * like any other evicting thread.
+ */
+static
+void
+pageout_thread(void *data1, unsigned long data2)
+{
+	uint32_t tries;
+	int where;
+
+	(void)data1;
+	(void)data2;
+
+	spinlock_acquire(&coremap_spinlock);
+	while (1) {
+		while (num_coremap_free >= pageout_lowater) {
+			wchan_lock(pageout_wchan);
+			spinlock_release(&coremap_spinlock);
+			wchan_sleep(pageout_wchan);
+			spinlock_acquire(&coremap_spinlock);
+		}
+		ct_pageout_wakeups++;
+
+		/*
+		 * page_replace may pick a page that's already free, so
+		 * don't loop forever if we aren't getting anywhere.
+		 */
+		for (tries = 0; num_coremap_free < pageout_hiwater &&
+			     num_coremap_user > 0 &&
+			     tries < num_coremap_entries; tries++) {
+			where = page_replace();
+			KASSERT(coremap[where].cm_pinned==0);
+			KASSERT(coremap[where].cm_kernel==0);
+			if (coremap[where].cm_allocated) {
+				do_evict(where);
+				ct_pageout_evictions++;
+			}
+		}
+	}
+}
+
+/*
+ * pageout_bootstrap: start the pageout thread. Has to wait until
+ * swap and process IDs are set up.
+ */
+void
+pageout_bootstrap(void)
+{
+	struct wchan *wc;
+	int result;
+
+	wc = wchan_create("pageout");
+	if (wc == NULL) {
+		panic("Failed allocating pageout wchan\n");
+	}
+
+	spinlock_acquire(&coremap_spinlock);
+	pageout_wchan = wc;
+	spinlock_release(&coremap_spinlock);
+
+	result = thread_fork("pageout", pageout_thread, NULL, 0, NULL);
+	if (result) {
+		panic("pageout: thread_fork failed: %s\n", strerror(result));
+	}
+
+	kprintf("vm: pageout thread: low water %lu pages, high water %lu\n",
+		(unsigned long) pageout_lowater,
+		(unsigned long) pageout_hiwater);
+}
+
 /*
  * coremap_allocuser
  *
@@ -898,6 +1430,109 @@ coremap_allocuser(struct lpage *lp)
 	return coremap_alloc_one_page(lp, 1 /* dopin */);
 }
 
+/*
+ * coremap_allocuser_zero
+ *
+ * Like coremap_allocuser, but the page comes back full of zeros:
+ * from the pre-zeroed pool if there's anything in it, and otherwise
+ * cleared here.
+ *
+ * Synchronization: takes coremap_spinlock.
+ * May block to swap pages out.
+ */
+paddr_t
+coremap_allocuser_zero(struct lpage *lp)
+{
+	uint32_t where;
+	paddr_t pa;
+
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(lp != NULL);
+
+	spinlock_acquire(&coremap_spinlock);
+	if (prezero_num > 0) {
+		where = prezero_pool[prezero_num-1];
+		KASSERT(coremap[where].cm_zeroed);
+		KASSERT(!coremap[where].cm_pinned);
+		mark_pages_allocated(where, 1, 1 /* dopin */, 0 /* user */);
+		coremap[where].cm_lpage = lp;
+		ct_prezero_hits++;
+		pageout_poke();
+		spinlock_release(&coremap_spinlock);
+		return COREMAP_TO_PADDR(where);
+	}
+	ct_prezero_misses++;
+	spinlock_release(&coremap_spinlock);
+
+	pa = coremap_alloc_one_page(lp, 1 /* dopin */);
+	if (pa != INVALID_PADDR) {
+		coremap_zero_page(pa);
+	}
+	return pa;
+}
+
+/*
+ * vm_idle: zero a free page for the pre-zeroed pool, if it needs
+ * filling. Called by the idle loop in thread_switch; returns true if
+ * it did anything, in which case the caller should check for work
+ * before calling us again.
+ *
+ * The page is pinned while it's being cleared so it doesn't get
+ * allocated out from under us.
+ *
+ * Synchronization: takes coremap_spinlock, but not while zeroing.
+ * Does not block.
+ */
+bool
+vm_idle(void)
+{
+	int i;
+
+	if (prezero_target == 0) {
+		/* too early in boot */
+		return false;
+	}
+
+	spinlock_acquire(&coremap_spinlock);
+	if (prezero_num + prezero_busy >= prezero_target ||
+	    prezero_num + prezero_busy >= num_coremap_free) {
+		spinlock_release(&coremap_spinlock);
+		return false;
+	}
+
+	i = freemap_find();
+	if (i < 0) {
+		/* the free pages are all pinned or zeroed already */
+		spinlock_release(&coremap_spinlock);
+		return false;
+	}
+	freemap_clear(i);
+	coremap[i].cm_pinned = 1;
+	prezero_busy++;
+	spinlock_release(&coremap_spinlock);
+
+	bzero((char *)PADDR_TO_KVADDR(COREMAP_TO_PADDR(i)), PAGE_SIZE);
+
+	spinlock_acquire(&coremap_spinlock);
+	KASSERT(coremap[i].cm_pinned);
+	KASSERT(!coremap[i].cm_allocated);
+	KASSERT(prezero_num < PREZERO_MAX);
+	prezero_busy--;
+	coremap[i].cm_pinned = 0;
+	coremap[i].cm_zeroed = 1;
+	prezero_pool[prezero_num++] = i;
+	ct_prezero_zeroed++;
+	/*
+	 * Not coremap_unpin: the page goes in the pool, not back in
+	 * the freemap. But anyone waiting on the pin still needs
+	 * waking.
+	 */
+	wchan_wakeall(coremap_pinchan);
+	spinlock_release(&coremap_spinlock);
+
+	return true;
+}
+
 /*
  * coremap_free 
  *
@@ -905,7 +1540,8 @@ coremap_allocuser(struct lpage *lp)
  * the same block. Cross-checks the iskern flag against the flags
  * maintained in the coremap entry.
  *
- * Synchronization: takes coremap_spinlock. Does not block.
+ * Synchronization: takes coremap_spinlock. Does not block for kernel
+ * pages; for user pages, may block waiting for TLB shootdown.
  */
 void
 coremap_free(paddr_t page, bool iskern)
@@ -931,17 +1567,13 @@ coremap_free(paddr_t page, bool iskern)
 		 */
 		KASSERT(iskern || coremap[i].cm_pinned);
 
-		/* flush any live mapping */
-		if (coremap[i].cm_tlbix >= 0) {
-			/* should only release one's own pages */
-			KASSERT(coremap[i].cm_cpunum == curcpu->c_number);
-
-			tlb_invalidate(coremap[i].cm_tlbix);
-			coremap[i].cm_tlbix = -1;
-			coremap[i].cm_cpunum = 0;
-
-			DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-				(unsigned long) COREMAP_TO_PADDR(i));
+		/*
+		 * Flush any live mapping. It may be on another CPU
+		 * where the process ran before.
+		 */
+		if (coremap[i].cm_tlbcount > 0) {
+			KASSERT(!iskern);
+			tlb_flushpage(i);
 		}
 
 		DEBUG(DB_VM,"coremap_free: freeing pa 0x%x\n",
@@ -965,6 +1597,11 @@ coremap_free(paddr_t page, bool iskern)
 
 		coremap[i].cm_lpage = NULL;
 
+		/* user pages become available when they're unpinned */
+		if (!coremap[i].cm_pinned) {
+			freemap_set(i);
+		}
+
 		if (!coremap[i].cm_notlast) {
 			break;
 		}
@@ -975,13 +1612,228 @@ coremap_free(paddr_t page, bool iskern)
 	spinlock_release(&coremap_spinlock);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Kernel page caches
+//
+
+/*
+ * kmalloc gets and gives back single pages all the time, and on a
+ * multiprocessor taking coremap_spinlock for each one makes it the
+ * most contended lock in the system. So each CPU keeps a few free
+ * pages of its own (cvm_kpages) that alloc_kpages and free_kpages use
+ * without taking it. A CPU's cache is filled kpage_batch pages at a
+ * time when it runs dry, and half emptied when it fills up.
+ *
+ * Cached pages are marked in the coremap as allocated kernel pages,
+ * so everything else leaves them alone, and handing one out or taking
+ * one back doesn't touch its coremap entry at all. They're counted in
+ * num_coremap_cached instead of num_coremap_kernel. Pages handed out
+ * from a cache (less pages put back into it) are tallied per CPU in
+ * cvm_kpagedelta and moved from the one count to the other the next
+ * time the CPU takes coremap_spinlock. A page can be allocated on one
+ * CPU and freed on another, so a CPU's tally can go negative.
+ *
+ * Only single kernel pages go through the caches. User pages need
+ * their coremap entries set up under coremap_spinlock anyway.
+ *
+ * Synchronization: each CPU only touches its own cache, with
+ * interrupts off so the thread can't move to another CPU. Filling and
+ * emptying take coremap_spinlock.
+ */
+
+/*
+ * kpage_cache_count: bring the page counts up to date with the
+ * CPU's tally.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+kpage_cache_count(struct cpu_vm_machdep *cvm)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	num_coremap_kernel += cvm->cvm_kpagedelta;
+	num_coremap_cached -= cvm->cvm_kpagedelta;
+	cvm->cvm_kpagedelta = 0;
+}
+
+/*
+ * kpage_cache_fill: move up to kpage_batch free pages into the
+ * cache. Only takes pages that are free already; if there aren't
+ * any, the caller falls back on coremap_alloc_one_page, which can
+ * evict.
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+static
+void
+kpage_cache_fill(struct cpu_vm_machdep *cvm)
+{
+	unsigned n;
+	int where;
+
+	spinlock_acquire(&coremap_spinlock);
+	kpage_cache_count(cvm);
+
+	for (n=0; n<kpage_batch; n++) {
+		if (piggish_kernel(1)) {
+			break;
+		}
+		where = freemap_find();
+		if (where < 0) {
+			break;
+		}
+		KASSERT(!coremap[where].cm_allocated);
+		KASSERT(coremap[where].cm_lpage == NULL);
+		KASSERT(coremap[where].cm_tlbcount == 0);
+
+		freemap_clear(where);
+		coremap[where].cm_allocated = 1;
+		coremap[where].cm_kernel = 1;
+		coremap[where].cm_referenced = 1;
+		cvm->cvm_kpages[cvm->cvm_nkpages++] = where;
+		num_coremap_free--;
+		num_coremap_cached++;
+	}
+	ct_kpage_fills++;
+	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
+	       +num_coremap_cached == num_coremap_entries);
+
+	pageout_poke();
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * kpage_cache_drain: give the NPAGES least recently cached pages
+ * back to the coremap.
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+static
+void
+kpage_cache_drain(struct cpu_vm_machdep *cvm, unsigned npages)
+{
+	unsigned i;
+	uint32_t where;
+
+	KASSERT(npages <= cvm->cvm_nkpages);
+
+	spinlock_acquire(&coremap_spinlock);
+	kpage_cache_count(cvm);
+
+	for (i=0; i<npages; i++) {
+		where = cvm->cvm_kpages[i];
+		KASSERT(coremap[where].cm_allocated);
+		KASSERT(coremap[where].cm_kernel);
+		KASSERT(!coremap[where].cm_notlast);
+		KASSERT(coremap[where].cm_lpage == NULL);
+
+		coremap[where].cm_allocated = 0;
+		coremap[where].cm_kernel = 0;
+		/* if someone has it pinned, coremap_unpin does this */
+		if (!coremap[where].cm_pinned) {
+			freemap_set(where);
+		}
+		num_coremap_cached--;
+		num_coremap_free++;
+	}
+	ct_kpage_drains++;
+	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
+	       +num_coremap_cached == num_coremap_entries);
+
+	spinlock_release(&coremap_spinlock);
+
+	cvm->cvm_nkpages -= npages;
+	for (i=0; i<cvm->cvm_nkpages; i++) {
+		cvm->cvm_kpages[i] = cvm->cvm_kpages[i + npages];
+	}
+}
+
+/*
+ * kpage_cache_alloc: get a kernel page from this CPU's cache,
+ * filling it first if it's empty. Returns INVALID_PADDR if that
+ * didn't work out.
+ */
+static
+paddr_t
+kpage_cache_alloc(void)
+{
+	struct cpu_vm_machdep *cvm;
+	uint32_t where;
+	int spl;
+
+	if (kpage_batch == 0 || !CURCPU_EXISTS()) {
+		return INVALID_PADDR;
+	}
+
+	spl = splhigh();
+	cvm = &curcpu->c_vm;
+	if (cvm->cvm_nkpages == 0) {
+		kpage_cache_fill(cvm);
+		if (cvm->cvm_nkpages == 0) {
+			splx(spl);
+			return INVALID_PADDR;
+		}
+	}
+	where = cvm->cvm_kpages[--cvm->cvm_nkpages];
+	cvm->cvm_kpagedelta++;
+	splx(spl);
+
+	return COREMAP_TO_PADDR(where);
+}
+
+/*
+ * kpage_cache_free: put a kernel page into this CPU's cache, making
+ * room first if it's full. Returns false if the page isn't a single
+ * page or there's no cache to put it in.
+ */
+static
+bool
+kpage_cache_free(paddr_t pa)
+{
+	struct cpu_vm_machdep *cvm;
+	uint32_t where;
+	int spl;
+
+	if (kpage_batch == 0 || !CURCPU_EXISTS()) {
+		return false;
+	}
+
+	where = PADDR_TO_COREMAP(pa);
+	KASSERT(where < num_coremap_entries);
+
+	/*
+	 * The page is ours, so nobody else should be changing these
+	 * (except for cm_pinned), and we can look without locking.
+	 */
+	KASSERT(coremap[where].cm_allocated);
+	KASSERT(coremap[where].cm_kernel);
+	if (coremap[where].cm_notlast) {
+		return false;
+	}
+
+	spl = splhigh();
+	cvm = &curcpu->c_vm;
+	if (cvm->cvm_nkpages == 2*kpage_batch) {
+		kpage_cache_drain(cvm, kpage_batch);
+	}
+	cvm->cvm_kpages[cvm->cvm_nkpages++] = where;
+	cvm->cvm_kpagedelta--;
+	splx(spl);
+
+	return true;
+}
+
 /*
  * alloc_kpages
  *
  * Allocate some kernel-space virtual pages.
  * This is the interface kmalloc uses to get pages for its use.
  *
- * Synchronization: takes coremap_spinlock.
+ * Synchronization: single pages come from the per-CPU cache when
+ * possible; otherwise takes coremap_spinlock.
  * May block to swap pages out.
  */
 vaddr_t 
@@ -992,7 +1844,10 @@ alloc_kpages(int npages)
 		pa = coremap_alloc_multipages(npages);
 	}
 	else {
-		pa = coremap_alloc_one_page(NULL, 0 /* dopin */);
+		pa = kpage_cache_alloc();
+		if (pa == INVALID_PADDR) {
+			pa = coremap_alloc_one_page(NULL, 0 /* dopin */);
+		}
 	}
 	if (pa==INVALID_PADDR) {
 		return 0;
@@ -1004,12 +1859,18 @@ alloc_kpages(int npages)
  * free_kpages
  *
  * Free pages allocated with alloc_kpages.
- * Synchronization: takes coremap_spinlock. Does not block.
+ * Synchronization: single pages go to the per-CPU cache; otherwise
+ * takes coremap_spinlock. Does not block.
  */
 void 
 free_kpages(vaddr_t addr)
 {
-	coremap_free(KVADDR_TO_PADDR(addr), true /* iskern */);
+	paddr_t pa;
+
+	pa = KVADDR_TO_PADDR(addr);
+	if (!kpage_cache_free(pa)) {
+		coremap_free(pa, true /* iskern */);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1028,9 +1889,10 @@ coremap_print_short(void)
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 		
-	kprintf("Coremap: %u entries, %uk/%uu/%uf\n",
+	kprintf("Coremap: %u entries, %uk/%uu/%uf/%uc\n",
 		num_coremap_entries,
-		num_coremap_kernel, num_coremap_user, num_coremap_free);
+		num_coremap_kernel, num_coremap_user, num_coremap_free,
+		num_coremap_cached);
 
 	for (i=0; i<num_coremap_entries; i++) {
 		if (atbol) {
@@ -1094,9 +1956,48 @@ coremap_pin(paddr_t paddr)
 		coremap_pinwait();
 	}
 	coremap[ix].cm_pinned = 1;
+	if (!coremap[ix].cm_allocated) {
+		/*
+		 * The page was freed under our caller, who will find
+		 * that out and unpin it. Meanwhile it can't be handed
+		 * out.
+		 */
+		if (coremap[ix].cm_zeroed) {
+			prezero_remove(ix);
+		}
+		else {
+			freemap_clear(ix);
+		}
+	}
 	spinlock_release(&coremap_spinlock);
 }
 
+/*
+ * coremap_trypin: like coremap_pin, but gives up instead of waiting
+ * if the page is already pinned. Returns true if it got the pin. For
+ * allocated pages only.
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+bool
+coremap_trypin(paddr_t paddr)
+{
+	unsigned ix;
+	bool ret;
+
+	ix = PADDR_TO_COREMAP(paddr);
+	KASSERT(ix<num_coremap_entries);
+
+	spinlock_acquire(&coremap_spinlock);
+	KASSERT(coremap[ix].cm_allocated);
+	ret = !coremap[ix].cm_pinned;
+	if (ret) {
+		coremap[ix].cm_pinned = 1;
+	}
+	spinlock_release(&coremap_spinlock);
+	return ret;
+}
+
 /*
  * coremap_pageispinned: checks if page is marked pinned.
  *
@@ -1136,6 +2037,10 @@ coremap_unpin(paddr_t paddr)
 	spinlock_acquire(&coremap_spinlock);
 	KASSERT(coremap[ix].cm_pinned);
 	coremap[ix].cm_pinned = 0;
+	if (!coremap[ix].cm_allocated) {
+		/* freed while pinned */
+		freemap_set(ix);
+	}
 	wchan_wakeall(coremap_pinchan);
 	spinlock_release(&coremap_spinlock);
 }
@@ -1185,24 +2090,72 @@ coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr)
  */
 
 /*
- * mmu_setas: Set current address space in MMU.
+ * asid_alloc: hand out a new ASID on this CPU, and return it tagged
+ * with the current generation. When they run out, the TLB is flushed
+ * and a new generation starts; that makes every ASID handed out
+ * before stale, so address spaces holding one get a new one the next
+ * time they're run here.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+uint32_t
+asid_alloc(void)
+{
+	struct cpu_vm_machdep *cvm = &curcpu->c_vm;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	if (cvm->cvm_nextasid == NUM_ASID) {
+		tlb_clear();
+		cvm->cvm_asidgen += NUM_ASID;
+		if (cvm->cvm_asidgen == 0) {
+			/* 0 means no ASID; skip it */
+			cvm->cvm_asidgen = NUM_ASID;
+		}
+		cvm->cvm_nextasid = 1;
+		ct_asid_rollovers++;
+	}
+	return cvm->cvm_asidgen | cvm->cvm_nextasid++;
+}
+
+/*
+ * mmu_setas: Set current address space in MMU. This loads the
+ * address space's ASID for this CPU, allocating one if it doesn't
+ * have one from the current generation. The TLB is not flushed.
  *
  * Synchronization: takes coremap_spinlock. Does not block.
  */
 void
 mmu_setas(struct addrspace *as)
 {
+	struct cpu_vm_machdep *cvm;
+	uint32_t *asidp;
+
 	spinlock_acquire(&coremap_spinlock);
-	if (as != curcpu->c_vm.cvm_lastas) {
-		curcpu->c_vm.cvm_lastas = as;
-		tlb_clear();
+	cvm = &curcpu->c_vm;
+	cvm->cvm_lastas = as;
+	if (as == NULL) {
+		cvm->cvm_curasid = 0;
 	}
+	else {
+		asidp = &as->as_machdep.am_asids[curcpu->c_number];
+		if ((*asidp & ~(NUM_ASID-1)) != cvm->cvm_asidgen) {
+			*asidp = asid_alloc();
+		}
+		cvm->cvm_curasid = *asidp & (NUM_ASID-1);
+	}
+	tlb_setpid(CURPID());
 	spinlock_release(&coremap_spinlock);
 }
 
 /*
  * mmu_unmap: Remove a translation from the MMU.
  *
+ * This only looks in the current CPU's TLB, under the current ASID.
+ * Entries the address space left on other CPUs are found through
+ * the coremap when the page is freed or unshared.
+ *
  * Synchronization: takes coremap_spinlock. Does not block.
  */
 void
@@ -1215,11 +2168,39 @@ mmu_unmap(struct addrspace *as, vaddr_t va)
 	spinlock_release(&coremap_spinlock);
 }
 
+/*
+ * mmu_unmap_page: Remove whatever translation refers to a physical
+ * page, on any CPU. Used when a page becomes shared copy-on-write, so
+ * any writable mapping of it goes away, and when one of the sharers
+ * lets go of it.
+ *
+ * Synchronization: takes coremap_spinlock. The page must be pinned.
+ * May block waiting for TLB shootdown.
+ */
+void
+mmu_unmap_page(paddr_t pa)
+{
+	unsigned cmix;
+
+	cmix = PADDR_TO_COREMAP(pa);
+	KASSERT(cmix < num_coremap_entries);
+
+	spinlock_acquire(&coremap_spinlock);
+	tlb_flushpage(cmix);
+	spinlock_release(&coremap_spinlock);
+}
+
 /*
  * mmu_map: Enter a translation into the MMU. (This is the end result
  * of fault handling.)
  *
- * Synchronization: Takes coremap_spinlock. Does not block.
+ * A page mapped read-only can stay mapped by any number of other
+ * processes (shared text), on any CPUs, so no shootdown is needed.
+ * A page being mapped writable is taken away from everyone else
+ * first.
+ *
+ * Synchronization: Takes coremap_spinlock. May block waiting for TLB
+ * shootdown, so the caller must not hold any spinlocks.
  */
 void
 mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
@@ -1233,38 +2214,45 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 	
 	spinlock_acquire(&coremap_spinlock);
 
-	KASSERT(as == curcpu->c_vm.cvm_lastas);
-
 	cmix = PADDR_TO_COREMAP(pa);
 	KASSERT(cmix < num_coremap_entries);
 
 	/* Page must be pinned. */
 	KASSERT(coremap[cmix].cm_pinned);
 
-	tlbix = tlb_probe(va, 0);
+	if (writable && coremap[cmix].cm_tlbcount > 0) {
+		/*
+		 * Mapped somewhere already: by another process (shared
+		 * page), by this one on another CPU, or read-only
+		 * here. Get rid of all of it.
+		 */
+		tlb_flushpage(cmix);
+	}
+
+	KASSERT(as == curcpu->c_vm.cvm_lastas);
+
+	/* If VA is already in the TLB (read-only, say), reuse the slot. */
+	tlbix = tlb_probe((va & TLBHI_VPAGE) | CURPID(), 0);
 	if (tlbix < 0) {
-		KASSERT(coremap[cmix].cm_tlbix == -1);
-		KASSERT(coremap[cmix].cm_cpunum == 0);
 		tlbix = mipstlb_getslot();
-		KASSERT(tlbix>=0 && tlbix<NUM_TLB);
-		coremap[cmix].cm_tlbix = tlbix;
-		coremap[cmix].cm_cpunum = curcpu->c_number;
-		DEBUG(DB_TLB, "... pa 0x%05lx <-> tlb %d\n", 
-			(unsigned long) COREMAP_TO_PADDR(cmix), tlbix);
 	}
 	else {
-		KASSERT(tlbix>=0 && tlbix<NUM_TLB);
-		KASSERT(coremap[cmix].cm_tlbix == tlbix);
-		KASSERT(coremap[cmix].cm_cpunum == curcpu->c_number);
+		tlb_invalidate(tlbix);
 	}
+	KASSERT(tlbix>=0 && tlbix<NUM_TLB);
+	coremap[cmix].cm_tlbcount++;
+	coremap[cmix].cm_cpumask |= CPUMASK();
+	DEBUG(DB_TLB, "... pa 0x%05lx <-> tlb %d\n", 
+		(unsigned long) COREMAP_TO_PADDR(cmix), tlbix);
 
-	ehi = va & TLBHI_VPAGE;
+	ehi = (va & TLBHI_VPAGE) | CURPID();
 	elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
 	if (writable) {
 		elo |= TLBLO_DIRTY;
 	}
 
 	tlb_write(ehi, elo, tlbix);
+	coremap[cmix].cm_referenced = 1;
 
 	/* Unpin the page. */
 	coremap[cmix].cm_pinned = 0;
@@ -1272,3 +2260,57 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 
 	spinlock_release(&coremap_spinlock);
 }
+
+/*
+ * mmu_premap: Enter a translation for a page nobody faulted on yet,
+ * for fault-around. Unlike mmu_map this never takes a page away from
+ * another mapping: if VA is already in our TLB, or the page would be
+ * writable and is in a TLB anywhere, it does nothing. Returns true if
+ * it mapped the page.
+ * Either way the page is unpinned.
+ *
+ * The page is not marked referenced; only a real fault does that.
+ *
+ * Synchronization: Takes coremap_spinlock. Does not block.
+ */
+bool
+mmu_premap(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
+{
+	int tlbix;
+	uint32_t ehi, elo;
+	unsigned cmix;
+	bool mapped = false;
+
+	cmix = PADDR_TO_COREMAP(pa);
+	KASSERT(cmix < num_coremap_entries);
+
+	spinlock_acquire(&coremap_spinlock);
+
+	KASSERT(coremap[cmix].cm_pinned);
+	KASSERT(coremap[cmix].cm_allocated);
+
+	ehi = (va & TLBHI_VPAGE) | CURPID();
+	if (as == curcpu->c_vm.cvm_lastas &&
+	    (!writable || coremap[cmix].cm_tlbcount == 0) &&
+	    tlb_probe(ehi, 0) < 0) {
+		tlbix = mipstlb_getslot();
+		KASSERT(tlbix>=0 && tlbix<NUM_TLB);
+		coremap[cmix].cm_tlbcount++;
+		coremap[cmix].cm_cpumask |= CPUMASK();
+
+		elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
+		if (writable) {
+			elo |= TLBLO_DIRTY;
+		}
+		tlb_write(ehi, elo, tlbix);
+		DEBUG(DB_TLB, "... pa 0x%05lx <-> tlb %d (premap)\n",
+			(unsigned long) pa, tlbix);
+		mapped = true;
+	}
+
+	coremap[cmix].cm_pinned = 0;
+	wchan_wakeall(coremap_pinchan);
+
+	spinlock_release(&coremap_spinlock);
+	return mapped;
+}
@@ -93,6 +93,13 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+bool
+vm_idle(void)
+{
+	/* Nothing to do in the background. */
+	return false;
+}
+
 void
 vm_tlbshootdown_all(void)
 {
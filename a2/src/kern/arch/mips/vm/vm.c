@@ -40,6 +40,7 @@
 #include <mainbus.h>
 
 #include "opt-randpage.h"
+#include "opt-clockpage.h"
 #include "opt-randtlb.h"
 
 
@@ -62,6 +63,8 @@ vm_bootstrap(void)
 
 #if OPT_RANDPAGE
 	kprintf("vm: Page replacement: random\n");
+#elif OPT_CLOCKPAGE
+	kprintf("vm: Page replacement: clock\n");
 #else
 	kprintf("vm: Page replacement: sequential\n");
 #endif
@@ -73,8 +76,7 @@ vm_bootstrap(void)
 #endif
 
 	coremap_bootstrap();
-
-	global_paging_lock = lock_create("global_paging_lock");
+	lpage_bootstrap();
 }
 
 /*
@@ -842,8 +842,9 @@ static
 int
 emufs_mmap(struct vnode *v)
 {
+	/* Plain files; the VM system reads and writes them as needed. */
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 //////////////////////////////
@@ -35,7 +35,9 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <clock.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -95,15 +97,151 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the hardware on the next sector of the active request.
+ * For a write, the sector's data goes into the on-card buffer first.
+ *
+ * Synchronization: assumes we hold lh_lock.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct lhd_request *req = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req != NULL);
+	KASSERT(req->lr_nsect > 0);
+
+	if (req->lr_iswrite) {
+		memcpy(lh->lh_buf, req->lr_buf, LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->lr_sector);
+	lh->lh_headpos = req->lr_sector + 1;
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Add a request to the queue, keeping it sorted by sector.
+ *
+ * Synchronization: assumes we hold lh_lock.
+ */
+static
+void
+lhd_enqueue(struct lhd_softc *lh, struct lhd_request *req)
+{
+	struct lhd_request **pp;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		if ((*pp)->lr_sector > req->lr_sector) {
+			break;
+		}
+	}
+	req->lr_next = *pp;
+	*pp = req;
+
+	lh->lh_depth++;
+	if (lh->lh_depth > lh->lh_maxdepth) {
+		lh->lh_maxdepth = lh->lh_depth;
+	}
+}
+
+/*
+ * If the disk is idle, take the next request off the queue (C-LOOK:
+ * the first at or after the head position, or failing that the
+ * lowest) and start it.
+ *
+ * Synchronization: assumes we hold lh_lock.
+ */
+static
+void
+lhd_startnext(struct lhd_softc *lh)
+{
+	struct lhd_request **pp;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		if ((*pp)->lr_sector >= lh->lh_headpos) {
+			break;
+		}
+	}
+	if (*pp == NULL) {
+		/* Nothing ahead of the head; go back to the start. */
+		pp = &lh->lh_queue;
+	}
+
+	lh->lh_active = *pp;
+	*pp = lh->lh_active->lr_next;
+	lh->lh_active->lr_next = NULL;
+
+	if (lh->lh_active->lr_sector == lh->lh_headpos) {
+		lh->lh_nseqs++;
+	}
+	lhd_startsector(lh);
+}
+
+/*
+ * Record that a sector has completed. If it was a read, fetch the
+ * data from the on-card buffer. Then either start the request's next
+ * sector, or, if the request is finished (or failed), report
+ * completion and start the next request.
+ *
+ * Synchronization: assumes we hold lh_lock.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_request *req = lh->lh_active;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (req == NULL) {
+		kprintf("lhd%d: Spurious completion\n", lh->lh_unit);
+		return;
+	}
+
+	if (err == 0) {
+		if (!req->lr_iswrite) {
+			memcpy(req->lr_buf, lh->lh_buf, LHD_SECTSIZE);
+		}
+		req->lr_buf += LHD_SECTSIZE;
+		req->lr_bufleft -= LHD_SECTSIZE;
+		req->lr_sector++;
+		req->lr_nsect--;
+		lh->lh_nsects++;
+		if (req->lr_nsect > 0) {
+			if (req->lr_bufleft == 0) {
+				/* On to the next buffer. */
+				req->lr_iov++;
+				req->lr_buf = req->lr_iov->iov_kbase;
+				req->lr_bufleft = req->lr_iov->iov_len;
+			}
+			lhd_startsector(lh);
+			return;
+		}
+	}
+
+	req->lr_result = err;
+	req->lr_done = true;
+	lh->lh_active = NULL;
+	lh->lh_depth--;
+	lh->lh_nreqs++;
+	wchan_wakeall(lh->lh_wchan);
+
+	lhd_startnext(lh);
 }
 
 /*
@@ -117,6 +255,8 @@ lhd_irq(void *vlh)
 	struct lhd_softc *lh = vlh;
 	uint32_t val;
 	
+	spinlock_acquire(&lh->lh_lock);
+
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
@@ -130,6 +270,69 @@ lhd_irq(void *vlh)
 		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
 	}
+
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Do a transfer of NSECT contiguous sectors starting at SECTOR, to or
+ * from the kernel buffers in IOV (which must be a whole number of
+ * sectors each, and cover NSECT sectors): queue the request, and wait
+ * for the interrupt handler to finish it. Returns the number of
+ * sectors actually transferred in *DONE (which is less than NSECT
+ * only on error).
+ */
+static
+int
+lhd_transfer(struct lhd_softc *lh, uint32_t sector, uint32_t nsect,
+	     struct iovec *iov, bool iswrite, uint32_t *done)
+{
+	struct lhd_request req;
+	time_t secs1, secs2, wsecs;
+	uint32_t nsecs1, nsecs2, wnsecs, wait;
+
+	KASSERT(nsect > 0);
+
+	req.lr_next = NULL;
+	req.lr_sector = sector;
+	req.lr_nsect = nsect;
+	req.lr_iov = iov;
+	req.lr_buf = iov->iov_kbase;
+	req.lr_bufleft = iov->iov_len;
+	req.lr_iswrite = iswrite;
+	req.lr_done = false;
+	req.lr_result = 0;
+
+	gettime(&secs1, &nsecs1);
+
+	spinlock_acquire(&lh->lh_lock);
+
+	lhd_enqueue(lh, &req);
+	lhd_startnext(lh);
+
+	while (!req.lr_done) {
+		wchan_lock(lh->lh_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep(lh->lh_wchan);
+		spinlock_acquire(&lh->lh_lock);
+	}
+
+	spinlock_release(&lh->lh_lock);
+
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &wsecs, &wnsecs);
+	/* anything 4s or over doesn't fit in 32 bits of ns; saturate */
+	wait = wsecs >= 4 ? 0xffffffff : wsecs * 1000000000 + wnsecs;
+
+	spinlock_acquire(&lh->lh_lock);
+	lh->lh_totwait += wait;
+	if (wait > lh->lh_maxwait) {
+		lh->lh_maxwait = wait;
+	}
+	spinlock_release(&lh->lh_lock);
+
+	*done = nsect - req.lr_nsect;
+	return req.lr_result;
 }
 
 /*
@@ -193,8 +396,63 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Check if a uio can be handed straight to the interrupt handler: it
+ * must be in kernel space, and its buffers must be whole sectors.
+ */
+static
+bool
+lhd_uio_isdirect(struct uio *uio)
+{
+	size_t total = 0;
+	unsigned i;
+
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return false;
+	}
+	for (i=0; i<uio->uio_iovcnt && total < uio->uio_resid; i++) {
+		if (uio->uio_iov[i].iov_len == 0 ||
+		    uio->uio_iov[i].iov_len % LHD_SECTSIZE != 0) {
+			return false;
+		}
+		total += uio->uio_iov[i].iov_len;
+	}
+	return total == uio->uio_resid;
+}
+
+/*
+ * Advance a uio past LEN bytes the hardware has transferred, the way
+ * uiomove would have.
+ */
+static
+void
+lhd_uio_advance(struct uio *uio, size_t len)
+{
+	size_t amt;
+
+	uio->uio_offset += len;
+	uio->uio_resid -= len;
+	while (len > 0) {
+		KASSERT(uio->uio_iovcnt > 0);
+		amt = len < uio->uio_iov->iov_len ? len : uio->uio_iov->iov_len;
+		uio->uio_iov->iov_kbase = (char *)uio->uio_iov->iov_kbase + amt;
+		uio->uio_iov->iov_len -= amt;
+		len -= amt;
+		if (uio->uio_iov->iov_len == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+		}
+	}
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * If the uio is made of kernel buffers, as it is for swap and the
+ * file system, the whole thing goes to the disk as one request; swap
+ * uses this to read or write several pages at once. Otherwise (e.g.
+ * user I/O on the raw device) we bounce through a kernel buffer a
+ * sector at a time.
  */
 static
 int
@@ -206,8 +464,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool iswrite = (uio->uio_rw == UIO_WRITE);
+	struct iovec bounceiov;
+	uint32_t i, done;
+	char *bounce;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,59 +480,81 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	if (lhd_uio_isdirect(uio)) {
+		result = lhd_transfer(lh, sector, len, uio->uio_iov,
+				      iswrite, &done);
+		lhd_uio_advance(uio, done*LHD_SECTSIZE);
+		return result;
+	}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	bounce = kmalloc(LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	bounceiov.iov_kbase = bounce;
+	bounceiov.iov_len = LHD_SECTSIZE;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+	/* Loop over all the sectors we were asked to do. */
+	for (i=0; i<len; i++) {
+		if (iswrite) {
+			result = uiomove(bounce, LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		result = lhd_transfer(lh, sector+i, 1, &bounceiov, iswrite,
+				      &done);
+		if (result) {
+			break;
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+		if (!iswrite) {
+			result = uiomove(bounce, LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
+}
+
+/*
+ * Print request queue statistics. Called through d_printstats.
+ */
+static
+void
+lhd_printstats(struct device *d)
+{
+	struct lhd_softc *lh = d->d_data;
+	uint32_t nreqs, nsects, nseqs, maxwait;
+	unsigned depth, maxdepth;
+	uint64_t totwait;
+
+	spinlock_acquire(&lh->lh_lock);
+	nreqs = lh->lh_nreqs;
+	nsects = lh->lh_nsects;
+	nseqs = lh->lh_nseqs;
+	depth = lh->lh_depth;
+	maxdepth = lh->lh_maxdepth;
+	totwait = lh->lh_totwait;
+	maxwait = lh->lh_maxwait;
+	spinlock_release(&lh->lh_lock);
+
+	kprintf("lhd%d: %lu requests, %lu sectors, %lu without seek\n",
+		lh->lh_unit, (unsigned long) nreqs, (unsigned long) nsects,
+		(unsigned long) nseqs);
+	kprintf("lhd%d: queue depth %u (max %u)\n",
+		lh->lh_unit, depth, maxdepth);
+	kprintf("lhd%d: latency %lu us average, %lu us max\n", lh->lh_unit,
+		(unsigned long) (nreqs ? totwait / nreqs / 1000 : 0),
+		(unsigned long) (maxwait / 1000));
 }
 
 /*
@@ -282,6 +564,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	int result;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -289,28 +572,47 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_active = NULL;
+	lh->lh_queue = NULL;
+	lh->lh_headpos = 0;
+	/* wchan_create keeps the name, so it can't be on our stack. */
+	lh->lh_wchanname = kstrdup(name);
+	if (lh->lh_wchanname == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	lh->lh_wchan = wchan_create(lh->lh_wchanname);
+	if (lh->lh_wchan == NULL) {
+		kfree(lh->lh_wchanname);
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
 
+	lh->lh_depth = lh->lh_maxdepth = 0;
+	lh->lh_nreqs = lh->lh_nsects = lh->lh_nseqs = 0;
+	lh->lh_totwait = 0;
+	lh->lh_maxwait = 0;
+
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
 	lh->lh_dev.d_close = lhd_close;
 	lh->lh_dev.d_io = lhd_io;
 	lh->lh_dev.d_ioctl = lhd_ioctl;
+	lh->lh_dev.d_printstats = lhd_printstats;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
 	lh->lh_dev.d_data = lh;
 
 	/* Add the VFS device structure to the VFS device list. */
-	return vfs_adddev(name, &lh->lh_dev, 1);
+	result = vfs_adddev(name, &lh->lh_dev, 1);
+	if (result) {
+		wchan_destroy(lh->lh_wchan);
+		kfree(lh->lh_wchanname);
+		spinlock_cleanup(&lh->lh_lock);
+		return result;
+	}
+	return 0;
 }
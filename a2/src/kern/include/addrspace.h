@@ -50,7 +50,10 @@ DECLARRAY_BYTYPE(vm_object_array, struct vm_object);
  *
  * In the solution set VM, the address space contains an array of
  * vm_objects. Normally there will be one each for text, data/bss,
- * stack, and heap. More can be added if needed.
+ * stack, and heap, plus any made by mmap. The array is kept sorted
+ * by base address so lookups can binary search it, and the index of
+ * the last object found is remembered, since faults tend to come in
+ * runs on the same object.
  */
 
 struct addrspace {
@@ -64,7 +67,11 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Add additional address space objects here as necessary. */
-        struct vm_object_array *as_objects;
+        struct vm_object_array *as_objects;	/* sorted by base */
+        unsigned as_lasthit;		/* index of last object found */
+        struct vm_object *as_heap;	/* heap (also in as_objects) */
+        vaddr_t as_heapend;		/* current break */
+        struct as_machdep as_machdep;	/* MMU state (TLB ASIDs) */
 #endif
 };
 
@@ -94,8 +101,13 @@ struct addrspace {
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
+ *    as_map_segment - map part of an executable file into a region,
+ *                to be paged in from the file on demand. Read-only
+ *                segments share their pages among processes.
+ *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. Sets up the (empty) heap above the
+ *                highest segment.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
@@ -114,6 +126,9 @@ int               as_define_region(struct addrspace *as,
                                    int writeable,
                                    int executable);
 int               as_prepare_load(struct addrspace *as);
+int               as_map_segment(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t filesize, int writeable);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
@@ -123,6 +138,18 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
  * as_sbrk - adjust the heap, like the sbrk() system call.
  */
 int as_fault(struct addrspace *as, int faulttype, vaddr_t va);
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *ret);
+
+/*
+ * Memory mapping (see addrspace.c):
+ *    as_mmap - make a new anonymous or file mapping, as for mmap().
+ *    as_munmap - remove a mapping made by as_mmap.
+ *    as_msync - write changes to shared file mappings back to the file.
+ */
+int as_mmap(struct addrspace *as, vaddr_t addr, size_t len, int prot,
+	    int flags, struct vnode *v, off_t offset, vaddr_t *ret);
+int as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+int as_msync(struct addrspace *as, vaddr_t addr, size_t len, int flags);
 
 /*
  * Functions in loadelf.c
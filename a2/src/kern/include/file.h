@@ -0,0 +1,68 @@
+/*
+ * Open files and per-process file tables.
+ */
+
+#ifndef _FILE_H_
+#define _FILE_H_
+
+#include <kern/limits.h>
+
+struct lock;
+struct vnode;
+
+/*
+ * An open file: what a file descriptor refers to. After fork the
+ * parent's and the child's descriptors refer to the same openfile,
+ * so they share the seek position, as in Unix.
+ *
+ * of_lock protects of_offset and of_refcount. It's held across the
+ * I/O so reads and writes on the same open file don't tangle their
+ * offsets.
+ */
+struct openfile {
+	struct vnode *of_vnode;
+	int of_accmode;			/* O_RDONLY, O_WRONLY, or O_RDWR */
+	struct lock *of_lock;
+	off_t of_offset;		/* seek position */
+	unsigned of_refcount;		/* number of descriptors */
+};
+
+/*
+ * A file table: the open files of a process, indexed by file
+ * descriptor. Only the thread that owns it uses it, so it needs no
+ * lock of its own.
+ */
+struct filetable {
+	struct openfile *ft_openfiles[__OPEN_MAX];
+};
+
+/*
+ * Functions in file.c:
+ *
+ * filetable_create:  makes a file table with the console open on
+ *                    descriptors 0, 1, and 2 (stdin, stdout, stderr).
+ *
+ * filetable_copy:    makes a copy of a file table for fork, sharing
+ *                    the open files.
+ *
+ * filetable_destroy: closes everything in a file table and frees it.
+ *
+ * file_open:         opens a file (PATH must be a kernel string, and
+ *                    may be modified) in curthread's file table.
+ *
+ * file_close:        closes a descriptor in curthread's file table.
+ *
+ * file_get:          gets the open file for a descriptor in
+ *                    curthread's file table. No reference is taken;
+ *                    only curthread can close it, so it stays valid
+ *                    until curthread does so.
+ */
+int filetable_create(struct filetable **ret);
+int filetable_copy(struct filetable *ft, struct filetable **ret);
+void filetable_destroy(struct filetable *ft);
+
+int file_open(char *path, int flags, mode_t mode, int *retfd);
+int file_close(int fd);
+int file_get(int fd, struct openfile **ret);
+
+#endif /* _FILE_H_ */
@@ -145,6 +145,23 @@ void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
+/*
+ * Object caches, for fixed-size objects that come and go often.
+ * Faster than kmalloc, and mostly lock-free thanks to per-CPU caching
+ * of free objects. The constructor (may be NULL) runs once per object
+ * when its memory is first set up, not on every kmem_cache_alloc;
+ * objects must be freed in the same state. kmem_cache_alloc returns
+ * NULL if out of memory.
+ */
+struct kmem_cache;  /* Opaque. */
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_printstats(void);
+
 /*
  * C string functions. 
  *
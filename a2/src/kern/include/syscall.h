@@ -66,10 +66,14 @@ int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_read(int fd, userptr_t buf, size_t size, int *retval);
 int sys_write(int fd, userptr_t buf, size_t size, int *retval);
+int sys_open(userptr_t path, int flags, mode_t mode, int *retval);
+int sys_close(int fd);
 
-/*
- * ASST2 - Prototypes for new bootstrap/shutdown functions needed by syscalls
- */
-void dumb_consoleIO_bootstrap(void);
+/* memory management */
+int sys_sbrk(intptr_t amount, int32_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, int32_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_msync(userptr_t addr, size_t len, int flags);
 
 #endif /* _SYSCALL_H_ */
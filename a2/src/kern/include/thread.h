@@ -42,6 +42,7 @@
 struct addrspace;
 struct cpu;
 struct vnode;
+struct filetable;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -113,6 +114,7 @@ struct thread {
 
 	/* VFS */
 	struct vnode *t_cwd;		/* current working directory */
+	struct filetable *t_filetable;	/* open files */
 
 	/* add more here as needed */
 };
@@ -48,12 +48,18 @@ void vm_bootstrap(void);
 /* Initialization for swapfile */
 void swap_bootstrap(void);
 
+/* Start the pageout thread; call after swap_bootstrap. */
+void pageout_bootstrap(void);
+
 /* Shutdown function for swapfile; closes swap vnode. */
 void swap_shutdown(void);
 
 /* Print VM counters */
 void vm_printstats(void);
 
+/* Background work for an idle CPU; returns true if there was any */
+bool vm_idle(void);
+
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
@@ -44,6 +44,9 @@
 #include <array.h>
 #include <spinlock.h>
 struct addrspace;
+struct vm_object;
+struct vnode;
+struct textcache;
 
 #include "opt-dumbvm.h"
 #if !OPT_DUMBVM
@@ -74,18 +77,42 @@ struct addrspace;
  * to hold flags.
  *
  *     LPF_DIRTY    is set if the page has been modified.
- *     LPF_PINNED   is set if the page is in transit to/from disk.
+ *
+ * A page in transit to or from disk is pinned in the coremap. During
+ * pageout lp_paddr still points at it until the write is finished, so
+ * other threads looking for the page wait on the pin rather than
+ * trying to read a half-written page back from swap.
  *
  * A vm_object contains an array of lpages, each of which corresponds
  * to a virtual page in the address space of a process.
  *
- * It is assumed in the solution set VM that lpages are never shared
- * between processes.
+ * After fork, lpages are shared copy-on-write between the parent and
+ * child vm_objects. lp_refcount counts the vm_objects referring to the
+ * page. While it is more than 1 the page is only ever mapped read-only,
+ * and a write fault gives the faulting vm_object its own copy (see
+ * lpage_unshare).
+ *
+ * Swap accounting for shared pages: an lpage with refcount N holds one
+ * allocated swap page plus N-1 reserved ones, one for each extra
+ * reference, so that every sharer can eventually get its own copy.
+ *
+ * File pages: in a vm_object backed by a file (see below), an lpage
+ * with no swap is a clean copy of the file's contents. It is read from
+ * the file when faulted in and simply dropped when evicted. It still
+ * holds a swap reservation, and swap is allocated out of that on the
+ * first write, after which it's an ordinary anonymous page. Outside
+ * file-backed vm_objects every existing lpage has swap.
+ *
+ * In a shared file mapping (VMO_SHARED; see below), having swap means
+ * the page was changed since it was last written to the file. Writing
+ * it back (lpage_writeback) turns it into a clean file page again and
+ * gives up the swap.
  */
 
 struct lpage {
 	volatile paddr_t lp_paddr;
 	off_t lp_swapaddr;
+	unsigned lp_refcount;
 	struct spinlock lp_spinlock;
 };
 
@@ -101,26 +128,48 @@ struct lpage {
 /*
  * Functions in lpage.c
  *
+ *    lpage_bootstrap - set up lpage storage at boot.
  *    lpage_create - create a blank, non-materialized lpage structure.
- *    lpage_destroy - destroy an lpage
+ *    lpage_destroy - drop a reference to an lpage; destroy it if last
  *    lpage_lock/unlock - for exclusive access to an lpage
  *    lpage_lock_and_pin - also pin physical page (see lpage.c for details)
  *
  *    lpage_copy - clone an lpage, including the contents
+ *    lpage_share - add a copy-on-write reference to an lpage
+ *    lpage_unshare - get a private copy of an lpage before writing it
  *    lpage_zerofill - materialize an lpage and zero-fill it
  *    lpage_fault - handle a fault on an lpage
+ *    lpage_readahead - page in a run of lpages that are together in swap
+ *    lpage_premap - map an lpage that's in memory, if nobody's using it
+ *    lpage_writeback - write a changed page of a shared mapping to its file
+ *    lpage_unmap - remove any TLB mapping of an lpage
  *    lpage_evict - evict an lpage
+ *
+ * The functions that create lpages take a swap address hint, which
+ * is passed to swap_alloc.
  */
+void              lpage_bootstrap(void);
 struct lpage     *lpage_create(void);
 void              lpage_destroy(struct lpage *lp);
 void              lpage_lock(struct lpage *lp);
 void              lpage_unlock(struct lpage *lp);
 void              lpage_lock_and_pin(struct lpage *lp);
 
-int	              lpage_copy(struct lpage *from, struct lpage **toret);
-int               lpage_zerofill(struct lpage **lpret);
+int	              lpage_copy(struct lpage *from, off_t swaphint,
+			                 struct lpage **toret);
+void              lpage_share(struct lpage *lp);
+int               lpage_unshare(struct lpage *lp, off_t swaphint,
+			                    struct lpage **toret);
+int               lpage_zerofill(off_t swaphint, struct lpage **lpret);
 int               lpage_fault(struct lpage *lp, struct addrspace *,
+			                  struct vm_object *vmo, unsigned index,
 			                  int faulttype, vaddr_t va);
+void              lpage_readahead(struct lpage **lps, unsigned npages);
+bool              lpage_premap(struct lpage *lp, struct addrspace *as,
+			                   vaddr_t va, bool canwrite);
+int               lpage_writeback(struct lpage *lp, struct vm_object *vmo,
+			                      unsigned index);
+void              lpage_unmap(struct lpage *lp);
 void              lpage_evict(struct lpage *victim);
 
 ////////////////////////////////////////////////////////////
@@ -138,21 +187,65 @@ DECLARRAY_BYTYPE(lpage_array, struct lpage);
  * also allows a redzone on the lower end in which other vm_objects are
  * not allowed to fall. This is used to implement a guard band under the
  * stack.
+ *
+ * A vm_object may also be backed by part of a file (vmo_vnode): the
+ * vmo_filesize bytes at vmo_fileoffset in the file are the initial
+ * contents of memory starting at vmo_filebase, and the rest of the
+ * object starts out zero. Pages covering that range start out as file
+ * pages and are read on demand. This is used for program text and
+ * data. If the segment is read-only, vmo_textcache points to the text
+ * cache entry through which its file pages are shared with the other
+ * processes running the same program (see textcache.c).
+ *
+ * vm_objects made by mmap are marked VMO_MAPPED, and only those can be
+ * unmapped. VMO_READONLY objects refuse write faults. A VMO_SHARED
+ * object (MAP_SHARED) is not copied at fork: the child's address space
+ * refers to the same vm_object, vmo_refcount counts the address spaces
+ * using it, and vmo_lock serializes their faults on it. Changes to the
+ * file pages of a shared object are written back to the file.
  */
 struct vm_object {
 	struct lpage_array *vmo_lpages;
 	vaddr_t vmo_base;
 	size_t vmo_lower_redzone;
+
+	struct vnode *vmo_vnode;	/* backing file, or NULL */
+	vaddr_t vmo_filebase;		/* address of file data */
+	off_t vmo_fileoffset;		/* where it is in the file */
+	size_t vmo_filesize;		/* how much there is */
+	struct textcache *vmo_textcache; /* shared text pages, or NULL */
+
+	unsigned vmo_flags;		/* VMO_* flags */
+	unsigned vmo_refcount;		/* address spaces using it */
+	struct lock *vmo_lock;		/* for VMO_SHARED objects */
 };
 
+/* vm_object flags */
+#define VMO_MAPPED		0x1	// made by mmap
+#define VMO_SHARED		0x2	// shared with children, not copied
+#define VMO_READONLY		0x4	// no writing allowed
+
 /*
  * vm_object operations in vmobj.c:
  * 
  * vm_object_create:  allocates a blank vm_object with the requested
  *                    number of struct lpage's set for zero-fill.
- * vm_object_copy:    clone a vm_object, as at fork time.
+ * vm_object_copy:    clone a vm_object, as at fork time. The pages are
+ *                    shared copy-on-write, not copied.
  * vm_object_setsize: adjust the size of a vm_object (either up or down).
  * vm_object_destroy: frees all the mapping entries and swap space.
+ * vm_object_swaphint: pick a swap address for a new page that's next
+ *                    to its neighbours' swap pages.
+ * vm_object_readahead: page in the run of pages starting at an index
+ *                    that are together in swap, in one I/O.
+ * vm_object_setfile: back a vm_object with a range of a file.
+ * vm_object_isfilepage: true if a page not yet created comes from
+ *                    the backing file rather than being zero-filled.
+ * vm_object_readpage: read a page's initial contents from the file.
+ * vm_object_writepage: write the file's part of a page back to it.
+ * vm_object_makeshared: make a vm_object VMO_SHARED.
+ * vm_object_writeback: write the changed file pages in a range of
+ *                    indexes of a shared vm_object back to the file.
  *
  */
 struct vm_object 	*vm_object_create(size_t npages);
@@ -164,6 +257,46 @@ int                 vm_object_setsize(struct addrspace *as,
 					                  unsigned newnpages);
 void 			 vm_object_destroy(struct addrspace *as, 
 					               struct vm_object *vmo);
+off_t               vm_object_swaphint(struct vm_object *vmo, unsigned index);
+void                vm_object_readahead(struct vm_object *vmo,
+                                        unsigned index);
+void                vm_object_setfile(struct vm_object *vmo,
+                                      struct vnode *v, vaddr_t vaddr,
+                                      off_t offset, size_t filesize);
+bool                vm_object_isfilepage(struct vm_object *vmo,
+                                         unsigned index);
+int                 vm_object_readpage(struct vm_object *vmo,
+                                       unsigned index, paddr_t pa);
+int                 vm_object_writepage(struct vm_object *vmo,
+                                        unsigned index, paddr_t pa);
+int                 vm_object_makeshared(struct vm_object *vmo);
+int                 vm_object_writeback(struct vm_object *vmo,
+                                        unsigned start, unsigned end);
+
+////////////////////////////////////////////////////////////
+//
+// text cache
+//
+
+/*
+ * Text cache operations in textcache.c:
+ *
+ * textcache_bootstrap: set up the text cache. Called from
+ *                    swap_bootstrap.
+ * textcache_attach:  share a file-backed vm_object's pages with every
+ *                    other vm_object mapping the same segment.
+ * textcache_detach:  drop a vm_object's reference to its text cache
+ *                    entry.
+ * textcache_getpage: get a shared reference to a page of the segment,
+ *                    creating it if needed.
+ * textcache_printstats: print text cache counters.
+ */
+void		textcache_bootstrap(void);
+int		textcache_attach(struct vm_object *vmo);
+void		textcache_detach(struct textcache *tc);
+int		textcache_getpage(struct textcache *tc, unsigned index,
+				  struct lpage **ret);
+void		textcache_printstats(void);
 
 ////////////////////////////////////////////////////////////
 //
@@ -183,6 +316,8 @@ void 			 vm_object_destroy(struct addrspace *as,
  *
  * swap_free:        unmarks a swap page.
  *
+ * swap_unalloc:     unmarks a swap page, keeping its reservation.
+ *
  * swap_reserve:     reserve some swap pages for future allocation.
  *
  * swap_unreserve:   release some previously-reserved swap pages.
@@ -190,17 +325,23 @@ void 			 vm_object_destroy(struct addrspace *as,
  * swap_pagein:      Reads a page from the requested swap address 
  *                   into the requested physical page.
  *
+ * swap_pagein_cluster: Reads several pages from consecutive swap
+ *                   addresses into the requested physical pages.
+ *
  * swap_pageout:     Writes a page to the requested swap address 
  *                   from the requested physical page.
  */
 
-off_t	 	swap_alloc(void);
+off_t	 	swap_alloc(off_t hint);
 void 		swap_free(off_t diskpage);
+void		swap_unalloc(off_t diskpage);
 
 int		swap_reserve(unsigned long npages);
 void		swap_unreserve(unsigned long npages);
 
 void 		swap_pagein(paddr_t paddr, off_t swapaddr);
+void		swap_pagein_cluster(const paddr_t *paddrs, unsigned npages,
+				    off_t swapaddr);
 void 		swap_pageout(paddr_t paddr, off_t swapaddr);
 
 /*
@@ -210,11 +351,17 @@ void 		swap_pageout(paddr_t paddr, off_t swapaddr);
 #define INVALID_SWAPADDR	(0)
 
 /*
- * Global lock for paging. Only one page can be in transit at a time
- * (at least under current circumstances) so we get this at a fairly
- * high level to try to improve paging decisions.
+ * Most pages read from or written to swap in one I/O.
+ */
+#define SWAP_CLUSTER_PAGES	8
+
+/*
+ * Size of the fault-around window (OPT_FAULTAROUND): on a fault, the
+ * other resident pages in the same aligned block of this many pages
+ * are mapped too. Must be a power of 2, and should stay well under
+ * NUM_TLB.
  */
-extern struct lock *global_paging_lock;
+#define FAULTAROUND_PAGES	8
 
 ////////////////////////////////////////////////////////////
 //
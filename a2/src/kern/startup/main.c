@@ -129,7 +129,7 @@ boot(void)
 	 * come before additional cpus are brought online.
 	 */
 	pid_bootstrap(); 
-	dumb_consoleIO_bootstrap(); /* And initialize for user console IO */
+	pageout_bootstrap(); /* Needs swap and pids */
 
 	thread_start_cpus();
 
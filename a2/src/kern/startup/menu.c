@@ -495,6 +495,18 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_diskstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_printdevstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -596,6 +608,7 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[ds] Disk queue stats               ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -644,6 +657,7 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "ds",		cmd_diskstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
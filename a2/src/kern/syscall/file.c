@@ -0,0 +1,238 @@
+/*
+ * Open files and per-process file tables.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/limits.h>
+#include <kern/unistd.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <file.h>
+
+/*
+ * openfile_create: make an openfile for a vnode opened with vfs_open,
+ * with one reference. On failure the caller still has the vnode.
+ */
+static
+struct openfile *
+openfile_create(struct vnode *v, int accmode)
+{
+	struct openfile *of;
+
+	of = kmalloc(sizeof(struct openfile));
+	if (of == NULL) {
+		return NULL;
+	}
+	of->of_lock = lock_create("openfile");
+	if (of->of_lock == NULL) {
+		kfree(of);
+		return NULL;
+	}
+	of->of_vnode = v;
+	of->of_accmode = accmode;
+	of->of_offset = 0;
+	of->of_refcount = 1;
+	return of;
+}
+
+/*
+ * openfile_incref: add a descriptor referring to an openfile.
+ */
+static
+void
+openfile_incref(struct openfile *of)
+{
+	lock_acquire(of->of_lock);
+	of->of_refcount++;
+	lock_release(of->of_lock);
+}
+
+/*
+ * openfile_decref: drop a descriptor's reference to an openfile. The
+ * last one closes the file.
+ */
+static
+void
+openfile_decref(struct openfile *of)
+{
+	lock_acquire(of->of_lock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount--;
+	if (of->of_refcount > 0) {
+		lock_release(of->of_lock);
+		return;
+	}
+	lock_release(of->of_lock);
+
+	vfs_close(of->of_vnode);
+	lock_destroy(of->of_lock);
+	kfree(of);
+}
+
+/*
+ * filetable_create: make a new file table, with the console open on
+ * stdin, stdout, and stderr. The three descriptors share one open
+ * file.
+ */
+int
+filetable_create(struct filetable **ret)
+{
+	struct filetable *ft;
+	struct openfile *of;
+	struct vnode *v;
+	char path[5];
+	int i, result;
+
+	ft = kmalloc(sizeof(struct filetable));
+	if (ft == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<__OPEN_MAX; i++) {
+		ft->ft_openfiles[i] = NULL;
+	}
+
+	/* The path passed to vfs_open must be mutable. */
+	strcpy(path, "con:");
+	result = vfs_open(path, O_RDWR, 0, &v);
+	if (result) {
+		kfree(ft);
+		return result;
+	}
+	of = openfile_create(v, O_RDWR);
+	if (of == NULL) {
+		vfs_close(v);
+		kfree(ft);
+		return ENOMEM;
+	}
+	of->of_refcount = 3;
+	ft->ft_openfiles[STDIN_FILENO] = of;
+	ft->ft_openfiles[STDOUT_FILENO] = of;
+	ft->ft_openfiles[STDERR_FILENO] = of;
+
+	*ret = ft;
+	return 0;
+}
+
+/*
+ * filetable_copy: make a copy of FT for a new process. The copy
+ * refers to the same open files.
+ */
+int
+filetable_copy(struct filetable *ft, struct filetable **ret)
+{
+	struct filetable *newft;
+	int i;
+
+	newft = kmalloc(sizeof(struct filetable));
+	if (newft == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<__OPEN_MAX; i++) {
+		newft->ft_openfiles[i] = ft->ft_openfiles[i];
+		if (newft->ft_openfiles[i] != NULL) {
+			openfile_incref(newft->ft_openfiles[i]);
+		}
+	}
+
+	*ret = newft;
+	return 0;
+}
+
+/*
+ * filetable_destroy: close all the descriptors in FT and free it.
+ */
+void
+filetable_destroy(struct filetable *ft)
+{
+	int i;
+
+	for (i=0; i<__OPEN_MAX; i++) {
+		if (ft->ft_openfiles[i] != NULL) {
+			openfile_decref(ft->ft_openfiles[i]);
+			ft->ft_openfiles[i] = NULL;
+		}
+	}
+	kfree(ft);
+}
+
+/*
+ * file_open: open PATH and put it in the lowest free descriptor of
+ * curthread's file table.
+ */
+int
+file_open(char *path, int flags, mode_t mode, int *retfd)
+{
+	struct filetable *ft = curthread->t_filetable;
+	struct openfile *of;
+	struct vnode *v;
+	int fd, result;
+
+	KASSERT(ft != NULL);
+
+	for (fd=0; fd<__OPEN_MAX; fd++) {
+		if (ft->ft_openfiles[fd] == NULL) {
+			break;
+		}
+	}
+	if (fd == __OPEN_MAX) {
+		return EMFILE;
+	}
+
+	result = vfs_open(path, flags, mode, &v);
+	if (result) {
+		return result;
+	}
+
+	of = openfile_create(v, flags & O_ACCMODE);
+	if (of == NULL) {
+		vfs_close(v);
+		return ENOMEM;
+	}
+
+	ft->ft_openfiles[fd] = of;
+	*retfd = fd;
+	return 0;
+}
+
+/*
+ * file_close: close descriptor FD of curthread's file table.
+ */
+int
+file_close(int fd)
+{
+	struct filetable *ft = curthread->t_filetable;
+	struct openfile *of;
+
+	KASSERT(ft != NULL);
+
+	if (fd < 0 || fd >= __OPEN_MAX || ft->ft_openfiles[fd] == NULL) {
+		return EBADF;
+	}
+	of = ft->ft_openfiles[fd];
+	ft->ft_openfiles[fd] = NULL;
+	openfile_decref(of);
+	return 0;
+}
+
+/*
+ * file_get: look up descriptor FD of curthread's file table.
+ */
+int
+file_get(int fd, struct openfile **ret)
+{
+	struct filetable *ft = curthread->t_filetable;
+
+	KASSERT(ft != NULL);
+
+	if (fd < 0 || fd >= __OPEN_MAX || ft->ft_openfiles[fd] == NULL) {
+		return EBADF;
+	}
+	*ret = ft->ft_openfiles[fd];
+	return 0;
+}
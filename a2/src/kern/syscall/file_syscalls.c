@@ -1,50 +1,24 @@
 /*
  * File-related system call implementations.
  * New for A2
- * Only crippled version of read/write for console I/O.
+ * The open files themselves are managed in file.c.
  */
 
 #include <types.h>
 #include <kern/errno.h>
-#include <kern/unistd.h>
+#include <kern/fcntl.h>
+#include <kern/limits.h>
 #include <lib.h>
 #include <uio.h>
 #include <thread.h>
 #include <current.h>
+#include <synch.h>
+#include <copyinout.h>
 #include <vfs.h>
 #include <vnode.h>
-#include <kern/fcntl.h>
+#include <file.h>
 #include <syscall.h>
 
-/* dumb_consoleIO_bootstrap
- * Initialize a vnode for the console device so that
- * user programs can use it.
- */
-struct vnode *cons_vnode;
-
-void dumb_consoleIO_bootstrap() 
-{
-  int result;
-  char path[5];
-
-  /* The path passed to vfs_open must be mutable. 
-   * vfs_open may modify it.
-   */
-  
-  strcpy(path, "con:");
-  result = vfs_open(path, O_RDWR, 0, &cons_vnode);
-
-  if (result) {
-    /* Tough one... if there's no console, there's not
-     * much point printing a warning...
-     * but maybe the bootstrap was just called in the wrong place
-     */
-    kprintf("Warning: could not initialize console vnode\n");
-    kprintf("User programs will not be able to read/write\n");
-    cons_vnode = NULL;
-  }
-}
-
 /*
  * mk_useruio
  * sets up the uio for a USERSPACE transfer. 
@@ -67,39 +41,83 @@ mk_useruio(struct iovec *iov, struct uio *u,
 	u->uio_space = curthread->t_addrspace;
 }
 
+/*
+ * sys_open
+ * copies in the path and passes the work on to file_open.
+ */
+int
+sys_open(userptr_t path, int flags, mode_t mode, int *retval)
+{
+	char *kpath;
+	int result;
+
+	switch (flags & O_ACCMODE) {
+	    case O_RDONLY:
+	    case O_WRONLY:
+	    case O_RDWR:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	kpath = kmalloc(__PATH_MAX);
+	if (kpath == NULL) {
+		return ENOMEM;
+	}
+	result = copyinstr(path, kpath, __PATH_MAX, NULL);
+	if (result) {
+		kfree(kpath);
+		return result;
+	}
+
+	result = file_open(kpath, flags, mode, retval);
+	kfree(kpath);
+	return result;
+}
+
+/*
+ * sys_close
+ */
+int
+sys_close(int fd)
+{
+	return file_close(fd);
+}
+
 /*
  * sys_read
- * calls VOP_READ.
+ * calls VOP_READ at the open file's seek position.
  */
 int
 sys_read(int fd, userptr_t buf, size_t size, int *retval)
 {
+	struct openfile *of;
 	struct uio user_uio;
 	struct iovec user_iov;
 	int result;
-	int offset = 0;
 
-	/* Make sure we were able to init the cons_vnode */
-	if (cons_vnode == NULL) {
-	  return ENODEV;
+	result = file_get(fd, &of);
+	if (result) {
+		return result;
 	}
-
-	/* better be a valid file descriptor */
-	/* Right now, only stdin (0), stdout (1) and stderr (2)
-	 * are supported, and they can't be redirected to a file
-	 */
-	if (fd < 0 || fd > 2) {
-	  return EBADF;
+	if (of->of_accmode == O_WRONLY) {
+		return EBADF;
 	}
 
+	lock_acquire(of->of_lock);
+
 	/* set up a uio with the buffer, its size, and the current offset */
-	mk_useruio(&user_iov, &user_uio, buf, size, offset, UIO_READ);
+	mk_useruio(&user_iov, &user_uio, buf, size, of->of_offset, UIO_READ);
 
 	/* does the read */
-	result = VOP_READ(cons_vnode, &user_uio);
+	result = VOP_READ(of->of_vnode, &user_uio);
 	if (result) {
+		lock_release(of->of_lock);
 		return result;
 	}
+	of->of_offset = user_uio.uio_offset;
+
+	lock_release(of->of_lock);
 
 	/*
 	 * The amount read is the size of the buffer originally, minus
@@ -112,36 +130,38 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 
 /*
  * sys_write
- * calls VOP_WRITE.
+ * calls VOP_WRITE at the open file's seek position.
  */
 int
 sys_write(int fd, userptr_t buf, size_t size, int *retval)
 {
+	struct openfile *of;
 	struct uio user_uio;
 	struct iovec user_iov;
 	int result;
-	int offset = 0;
 
-	/* Make sure we were able to init the cons_vnode */
-	if (cons_vnode == NULL) {
-	  return ENODEV;
+	result = file_get(fd, &of);
+	if (result) {
+		return result;
 	}
-
-	/* Right now, only stdin (0), stdout (1) and stderr (2)
-	 * are supported, and they can't be redirected to a file
-	 */
-	if (fd < 0 || fd > 2) {
-	  return EBADF;
+	if (of->of_accmode == O_RDONLY) {
+		return EBADF;
 	}
 
+	lock_acquire(of->of_lock);
+
 	/* set up a uio with the buffer, its size, and the current offset */
-	mk_useruio(&user_iov, &user_uio, buf, size, offset, UIO_WRITE);
+	mk_useruio(&user_iov, &user_uio, buf, size, of->of_offset, UIO_WRITE);
 
 	/* does the write */
-	result = VOP_WRITE(cons_vnode, &user_uio);
+	result = VOP_WRITE(of->of_vnode, &user_uio);
 	if (result) {
+		lock_release(of->of_lock);
 		return result;
 	}
+	of->of_offset = user_uio.uio_offset;
+
+	lock_release(of->of_lock);
 
 	/*
 	 * the amount written is the size of the buffer originally,
@@ -151,4 +171,3 @@ sys_write(int fd, userptr_t buf, size_t size, int *retval)
 
 	return 0;
 }
-
@@ -34,7 +34,8 @@
  * It makes the following address space calls:
  *    - first, as_define_region once for each segment of the program;
  *    - then, as_prepare_load;
- *    - then it loads each chunk of the program;
+ *    - then it loads each chunk of the program, or with the full VM
+ *      system, maps it with as_map_segment to be paged in on demand;
  *    - finally, as_complete_load.
  *
  * This gives the VM code enough flexibility to deal with even grossly
@@ -42,9 +43,6 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
- *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
  * linker). And you'd have to write a dynamic linker...
@@ -285,6 +283,21 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if !OPT_DUMBVM
+		/*
+		 * Let the VM system page the segment in from the file
+		 * as it's touched. If it can't, read it in now.
+		 */
+		result = as_map_segment(curthread->t_addrspace, v,
+					ph.p_offset, ph.p_vaddr,
+					ph.p_filesz < ph.p_memsz ?
+					ph.p_filesz : ph.p_memsz,
+					ph.p_flags & PF_W);
+		if (result == 0) {
+			continue;
+		}
+#endif
+
 		result = load_segment(v, ph.p_offset, ph.p_vaddr, 
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
@@ -42,6 +42,7 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <vfs.h>
+#include <file.h>
 #include <syscall.h>
 #include <test.h>
 #include <copyinout.h>
@@ -67,6 +68,15 @@ runprogram(char *progname, char **args, int argc) {
     /* We should be a new thread. */
     KASSERT(curthread->t_addrspace == NULL);
 
+    /* Give it the console on stdin, stdout, and stderr. */
+    if (curthread->t_filetable == NULL) {
+        result = filetable_create(&curthread->t_filetable);
+        if (result) {
+            vfs_close(v);
+            return result;
+        }
+    }
+
     /* Create a new address space. */
     curthread->t_addrspace = as_create();
     if (curthread->t_addrspace == NULL) {
@@ -0,0 +1,104 @@
+/*
+ * Memory-management syscalls: sbrk and memory mapping.
+ * The work is done by the VM system; see as_sbrk, as_mmap and friends
+ * in vm/addrspace.c.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <thread.h>
+#include <current.h>
+#include <vnode.h>
+#include <file.h>
+#include <addrspace.h>
+#include <syscall.h>
+
+/*
+ * sys_sbrk
+ * moves the end of the heap by AMOUNT bytes and returns the old end.
+ */
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+	vaddr_t oldend;
+	int result;
+
+	result = as_sbrk(curthread->t_addrspace, amount, &oldend);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)oldend;
+	return 0;
+}
+
+/*
+ * sys_mmap
+ * maps a file (or, with MAP_ANON, zero-filled memory) and returns
+ * the address.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int32_t *retval)
+{
+	struct openfile *of;
+	struct vnode *v = NULL;
+	vaddr_t va;
+	int result;
+
+	if ((flags & MAP_ANON) == 0) {
+		result = file_get(fd, &of);
+		if (result) {
+			return result;
+		}
+		/*
+		 * The file has to be open for reading, and for writing
+		 * too if changes to the mapping are to go back to it.
+		 */
+		if (of->of_accmode == O_WRONLY) {
+			return EACCES;
+		}
+		if ((flags & MAP_TYPE) == MAP_SHARED && (prot & PROT_WRITE) &&
+		    of->of_accmode != O_RDWR) {
+			return EACCES;
+		}
+		v = of->of_vnode;
+		/* make sure it's something that can be mapped */
+		result = VOP_MMAP(v);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = as_mmap(curthread->t_addrspace, (vaddr_t)addr, len, prot,
+			 flags, v, offset, &va);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)va;
+	return 0;
+}
+
+/*
+ * sys_munmap
+ * removes a mapping made by mmap.
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	return as_munmap(curthread->t_addrspace, (vaddr_t)addr, len);
+}
+
+/*
+ * sys_msync
+ * writes changes to shared file mappings back to their files.
+ */
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+	return as_msync(curthread->t_addrspace, (vaddr_t)addr, len, flags);
+}
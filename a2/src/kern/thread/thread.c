@@ -45,8 +45,10 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <file.h>
 #include <kern/sysexits.h>
 #include <kern/wait.h> /* New include of macros to make exit codes for ASST2 */
 #include <pid.h> /* New include of pid functions for ASST 2 */
@@ -64,6 +66,10 @@ struct wchan {
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
 };
 
+/* Object caches for threads and wait channels. */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -123,14 +129,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -156,6 +162,7 @@ thread_create(const char *name)
 
 	/* VFS fields */
 	thread->t_cwd = NULL;
+	thread->t_filetable = NULL;
 
 	/* If you add to struct thread, be sure to initialize here */
 
@@ -264,6 +271,7 @@ thread_destroy(struct thread *thread)
 
 	/* VFS fields, cleaned up in thread_exit */
 	KASSERT(thread->t_cwd == NULL);
+	KASSERT(thread->t_filetable == NULL);
 
 	/* VM fields, cleaned up in thread_exit */
 	KASSERT(thread->t_addrspace == NULL);
@@ -279,7 +287,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -371,6 +379,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 NULL);
+	if (thread_cache == NULL) {
+		panic("Out of memory creating thread cache\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -535,6 +549,21 @@ thread_fork(const char *name,
  			return ENOMEM;
 		}
 	}
+
+	/* Share the open files - also for sys_fork */
+	if (curthread->t_filetable != NULL) {
+		result = filetable_copy(curthread->t_filetable,
+					&newthread->t_filetable);
+		if (result) {
+			if (newthread->t_addrspace != NULL) {
+				as_destroy(newthread->t_addrspace);
+				newthread->t_addrspace = NULL;
+			}
+			pid_unalloc(newthread->t_pid);
+			thread_destroy(newthread);
+			return result;
+		}
+	}
 	
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -663,6 +692,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
 	 *
+	 * Before actually idling, give the VM system a chance to do
+	 * background work (zeroing free pages). It does a little at
+	 * a time, so we check the runqueue again after each piece.
+	 *
 	 * Note that we don't need to unlock the runqueue atomically
 	 * with idling; becoming unidle requires receiving an
 	 * interrupt (either a hardware interrupt or an interprocessor
@@ -680,7 +713,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!vm_idle()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -835,6 +870,10 @@ thread_exit(int exitcode)
 	cur = curthread;
 
 	/* VFS fields */
+	if (cur->t_filetable) {
+		filetable_destroy(cur->t_filetable);
+		cur->t_filetable = NULL;
+	}
 	if (cur->t_cwd) {
 		VOP_DECREF(cur->t_cwd);
 		cur->t_cwd = NULL;
@@ -1026,31 +1065,54 @@ thread_consider_migration(void)
  * arrangements should be made to free it after the wait channel is
  * destroyed.
  */
+static
+void
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+}
+
 struct wchan *
 wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	/*
+	 * The first wait channels are made in vm_bootstrap, before
+	 * thread_bootstrap, so make the cache on first use. That's
+	 * early in boot while there's only one thread.
+	 */
+	if (wchan_cache == NULL) {
+		wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+						wchan_ctor);
+		if (wchan_cache == NULL) {
+			return NULL;
+		}
+	}
+
+	/* the lock and list are set up by wchan_ctor */
+	wc = kmem_cache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
 
 /*
  * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
+ * (The corresponding cleanup functions require this, and that also
+ * leaves it as wchan_ctor made it, ready for reuse.)
  */
 void
 wchan_destroy(struct wchan *wc)
 {
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	kmem_cache_free(wchan_cache, wc);
 }
 
 /*
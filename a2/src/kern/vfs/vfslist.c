@@ -169,6 +169,30 @@ vfs_sync(void)
 	return 0;
 }
 
+/*
+ * Global statistics function - call d_printstats on all devices
+ * that have one.
+ */
+void
+vfs_printdevstats(void)
+{
+	struct knowndev *dev;
+	unsigned i, num;
+
+	vfs_biglock_acquire();
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		dev = knowndevarray_get(knowndevs, i);
+		if (dev->kd_device != NULL &&
+		    dev->kd_device->d_printstats != NULL) {
+			dev->kd_device->d_printstats(dev->kd_device);
+		}
+	}
+
+	vfs_biglock_release();
+}
+
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
@@ -29,10 +29,13 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
 #include <kern/unistd.h>
 #include <limits.h>
 #include <lib.h>
 #include <array.h>
+#include <synch.h>
 #include <uio.h>
 #include <thread.h>
 #include <current.h>
@@ -43,6 +46,7 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <syscall.h>
+#include "opt-faultaround.h"
 
 
 /*
@@ -74,6 +78,10 @@ as_create(void)
 		kfree(as);
 		return NULL;
 	}
+	as->as_lasthit = 0;
+	as->as_heap = NULL;
+	as->as_heapend = 0;
+	as_machdep_init(&as->as_machdep);
 
 	return as;
 }
@@ -110,7 +118,7 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 	KASSERT(as == curthread->t_addrspace);
 
 
-	/* copy the vmos */
+	/* copy the vmos (in order, so the new array is sorted too) */
 	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
 		vmo = vm_object_array_get(as->as_objects, i);
 
@@ -124,7 +132,12 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 			vm_object_destroy(newas, newvmo);
 			goto fail;
 		}
+
+		if (vmo == as->as_heap) {
+			newas->as_heap = newvmo;
+		}
 	}
+	newas->as_heapend = as->as_heapend;
 	
 	*ret = newas;
 	return 0;
@@ -135,54 +148,351 @@ fail:
 }
 
 /*
- * as_fault: fault handling. Handle a fault on an address space, of
- * specified type, at specified address.
- *
- * Synchronization: none. We assume the address space is not shared,
- * so we don't lock it.
+ * as_objects is sorted by vmo_base. Objects can't overlap, but an
+ * empty object (such as the heap before the first sbrk) can have the
+ * same base as another one; in that case the empty one goes first.
  */
+
+/*
+ * as_search: return the index of the first vm_object in AS that would
+ * go after one based at VA with NPAGES pages. So for NPAGES of
+ * (unsigned)-1, everything before the returned index has a base no
+ * higher than VA.
+ */
+static
+unsigned
+as_search(struct addrspace *as, vaddr_t va, unsigned npages)
+{
+	struct vm_object *vmo;
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = vm_object_array_num(as->as_objects);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		vmo = vm_object_array_get(as->as_objects, mid);
+		if (vmo->vmo_base < va ||
+		    (vmo->vmo_base == va &&
+		     lpage_array_num(vmo->vmo_lpages) <= npages)) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * as_addobject: add VMO to AS, keeping as_objects sorted.
+ */
+static
 int
-as_fault(struct addrspace *as, int faulttype, vaddr_t va)
+as_addobject(struct addrspace *as, struct vm_object *vmo)
 {
-	struct vm_object *faultobj = NULL;
-	struct lpage *lp;
-	vaddr_t bot=0, top;
-	unsigned i, index;
+	unsigned ix, i;
 	int result;
 
-	/* Find the vm_object concerned */
-	for (i=0; i<vm_object_array_num(as->as_objects); i++) {
-		struct vm_object *vmo;
+	ix = as_search(as, vmo->vmo_base, lpage_array_num(vmo->vmo_lpages));
 
-		vmo = vm_object_array_get(as->as_objects, i);
-		bot = vmo->vmo_base;
-		top = bot + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
-		if (va >= bot && va < top) {
-			faultobj = vmo;
-			break;
+	result = vm_object_array_add(as->as_objects, vmo, &i);
+	if (result) {
+		return result;
+	}
+	/* slide the ones above up to make room */
+	for (; i > ix; i--) {
+		vm_object_array_set(as->as_objects, i,
+			vm_object_array_get(as->as_objects, i-1));
+	}
+	vm_object_array_set(as->as_objects, ix, vmo);
+	return 0;
+}
+
+/*
+ * as_findobject: return the vm_object in AS containing VA, or NULL,
+ * and its index in as_objects.
+ *
+ * This is called on every fault, so first check the object we found
+ * last time. as_lasthit isn't updated when objects come and go, but
+ * that's fine: it's only a guess, and it's checked before use.
+ */
+static
+struct vm_object *
+as_findobject(struct addrspace *as, vaddr_t va, unsigned *ixret)
+{
+	struct vm_object *vmo;
+	unsigned ix;
+
+	ix = as->as_lasthit;
+	if (ix < vm_object_array_num(as->as_objects)) {
+		vmo = vm_object_array_get(as->as_objects, ix);
+		if (va >= vmo->vmo_base && va < vmo->vmo_base +
+		    PAGE_SIZE * lpage_array_num(vmo->vmo_lpages)) {
+			goto found;
 		}
 	}
 
-	if (faultobj == NULL) {
-		DEBUG(DB_VM, "vm_fault: EFAULT: va=0x%x\n", va);
-		return EFAULT;
+	/*
+	 * The object containing VA, if any, is the last one with a base
+	 * no higher than VA. (If that's one of a pair with the same
+	 * base, it's the nonempty one.)
+	 */
+	ix = as_search(as, va, (unsigned)-1);
+	if (ix == 0) {
+		return NULL;
+	}
+	ix--;
+	vmo = vm_object_array_get(as->as_objects, ix);
+	if (va >= vmo->vmo_base + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages)) {
+		return NULL;
 	}
+	as->as_lasthit = ix;
+
+ found:
+	if (ixret != NULL) {
+		*ixret = ix;
+	}
+	return vmo;
+}
+
+/*
+ * as_overlaps: check if VMO, counting its guard band, overlaps the
+ * range of SZ bytes at VADDR.
+ */
+static
+bool
+as_overlaps(struct vm_object *vmo, vaddr_t vaddr, size_t sz)
+{
+	vaddr_t bot, top;
+
+	bot = vmo->vmo_base;
+	top = bot + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+
+	/* Check guard band, if any */
+	KASSERT(bot >= vmo->vmo_lower_redzone);
+	bot = bot - vmo->vmo_lower_redzone;
+
+	return vaddr+sz > bot && vaddr < top;
+}
+
+/*
+ * as_overlap: return a vm_object in AS that overlaps the range of SZ
+ * bytes at VADDR, counting the guard band under each object, or NULL
+ * if there isn't one.
+ *
+ * Only the last object based at or below VADDR can reach up into the
+ * range. Of those above, only the first can reach down into it (if it
+ * doesn't, the ones above it are further away still), except that it
+ * might be empty and have a nonempty partner at the same base.
+ */
+static
+struct vm_object *
+as_overlap(struct addrspace *as, vaddr_t vaddr, size_t sz)
+{
+	struct vm_object *vmo;
+	vaddr_t base;
+	unsigned ix, num;
+
+	num = vm_object_array_num(as->as_objects);
+	ix = as_search(as, vaddr, (unsigned)-1);
+
+	if (ix > 0) {
+		vmo = vm_object_array_get(as->as_objects, ix-1);
+		if (as_overlaps(vmo, vaddr, sz)) {
+			return vmo;
+		}
+	}
+	if (ix < num) {
+		base = vm_object_array_get(as->as_objects, ix)->vmo_base;
+		for (; ix < num; ix++) {
+			vmo = vm_object_array_get(as->as_objects, ix);
+			if (vmo->vmo_base != base) {
+				break;
+			}
+			if (as_overlaps(vmo, vaddr, sz)) {
+				return vmo;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * as_fault_getpage: get the lpage for page INDEX of FAULTOBJ, where a
+ * fault at VA happened, creating it if need be. For a write, make sure
+ * it's not shared copy-on-write. A page backed by a file gets a file
+ * page, which lpage_fault reads in, instead of a zero-filled one.
+ *
+ * Synchronization: for a VMO_SHARED object the caller holds vmo_lock.
+ */
+static
+int
+as_fault_getpage(struct vm_object *faultobj, unsigned index, int faulttype,
+		 vaddr_t va, struct lpage **ret)
+{
+	struct lpage *lp;
+	int result;
 
-	/* Now get the logical page */
-	index = (va - bot) / PAGE_SIZE;
 	lp = lpage_array_get(faultobj->vmo_lpages, index);
 
-	if (lp == NULL) {
+	if (lp == NULL && vm_object_isfilepage(faultobj, index)) {
+		/* file page; it gets read in below */
+		if (faultobj->vmo_textcache != NULL) {
+			result = textcache_getpage(faultobj->vmo_textcache,
+						   index, &lp);
+			if (result) {
+				return result;
+			}
+		}
+		else {
+			lp = lpage_create();
+			if (lp == NULL) {
+				return ENOMEM;
+			}
+		}
+		lpage_array_set(faultobj->vmo_lpages, index, lp);
+		if (faulttype != VM_FAULT_READ) {
+			/* written text gets a private copy like any other */
+			result = lpage_unshare(lp,
+				vm_object_swaphint(faultobj, index), &lp);
+			if (result) {
+				return result;
+			}
+			lpage_array_set(faultobj->vmo_lpages, index, lp);
+		}
+	}
+	else if (lp == NULL) {
 		/* zerofill page */
-		result = lpage_zerofill(&lp);
+		result = lpage_zerofill(vm_object_swaphint(faultobj, index),
+					&lp);
 		if (result) {
 			kprintf("vm: zerofill fault at 0x%x failed\n", va);
 			return result;
 		}
 		lpage_array_set(faultobj->vmo_lpages, index, lp);
 	}
+	else {
+		/*
+		 * If it's out in swap, bring in its neighbours too.
+		 * (Not for shared objects; see lpage_readahead.)
+		 */
+		if ((faultobj->vmo_flags & VMO_SHARED) == 0) {
+			vm_object_readahead(faultobj, index);
+		}
+
+		if (faulttype != VM_FAULT_READ) {
+			result = lpage_unshare(lp,
+				vm_object_swaphint(faultobj, index), &lp);
+			if (result) {
+				kprintf("vm: copy-on-write fault at 0x%x "
+					"failed\n", va);
+				return result;
+			}
+			lpage_array_set(faultobj->vmo_lpages, index, lp);
+		}
+	}
+
+	*ret = lp;
+	return 0;
+}
+
+#if OPT_FAULTAROUND
+/*
+ * as_faultaround: after a fault on page INDEX of FAULTOBJ, map the
+ * other pages in the same FAULTAROUND_PAGES-aligned block that are
+ * already in memory, so that sweeping through them doesn't take a
+ * TLB miss on every page. Pages that aren't there are left alone;
+ * this never does I/O or allocates anything.
+ *
+ * Synchronization: as in as_fault; a VMO_SHARED vm_object is locked
+ * so its pages can't go away while we look at them.
+ */
+static
+void
+as_faultaround(struct addrspace *as, struct vm_object *faultobj,
+	       unsigned index)
+{
+	struct lpage *lp;
+	unsigned i, start, end;
+	bool canwrite;
+
+	start = index & ~(FAULTAROUND_PAGES - 1);
+	end = start + FAULTAROUND_PAGES;
+	canwrite = (faultobj->vmo_flags & VMO_READONLY) == 0;
+
+	if (faultobj->vmo_flags & VMO_SHARED) {
+		lock_acquire(faultobj->vmo_lock);
+	}
+	if (end > lpage_array_num(faultobj->vmo_lpages)) {
+		end = lpage_array_num(faultobj->vmo_lpages);
+	}
+	for (i = start; i < end; i++) {
+		if (i == index) {
+			continue;
+		}
+		lp = lpage_array_get(faultobj->vmo_lpages, i);
+		if (lp != NULL) {
+			lpage_premap(lp, as,
+				     faultobj->vmo_base + i * PAGE_SIZE,
+				     canwrite);
+		}
+	}
+	if (faultobj->vmo_flags & VMO_SHARED) {
+		lock_release(faultobj->vmo_lock);
+	}
+}
+#endif /* OPT_FAULTAROUND */
+
+/*
+ * as_fault: fault handling. Handle a fault on an address space, of
+ * specified type, at specified address.
+ *
+ * Synchronization: none. We assume the address space is not shared,
+ * so we don't lock it. A VMO_SHARED vm_object is locked while we find
+ * or make the page, since other processes use it too.
+ */
+int
+as_fault(struct addrspace *as, int faulttype, vaddr_t va)
+{
+	struct vm_object *faultobj;
+	struct lpage *lp;
+	unsigned index;
+	int result;
+
+	/* Find the vm_object concerned */
+	faultobj = as_findobject(as, va, NULL);
+	if (faultobj == NULL) {
+		DEBUG(DB_VM, "vm_fault: EFAULT: va=0x%x\n", va);
+		return EFAULT;
+	}
+
+	if (faulttype != VM_FAULT_READ &&
+	    (faultobj->vmo_flags & VMO_READONLY)) {
+		DEBUG(DB_VM, "vm_fault: EFAULT: write to read-only "
+		      "mapping: va=0x%x\n", va);
+		return EFAULT;
+	}
+
+	/* Now get the logical page */
+	index = (va - faultobj->vmo_base) / PAGE_SIZE;
+	if (faultobj->vmo_flags & VMO_SHARED) {
+		lock_acquire(faultobj->vmo_lock);
+	}
+	result = as_fault_getpage(faultobj, index, faulttype, va, &lp);
+	if (faultobj->vmo_flags & VMO_SHARED) {
+		lock_release(faultobj->vmo_lock);
+	}
+	if (result) {
+		return result;
+	}
 	
-	return lpage_fault(lp, as, faulttype, va);
+	result = lpage_fault(lp, as, faultobj, index, faulttype, va);
+#if OPT_FAULTAROUND
+	if (result == 0) {
+		as_faultaround(as, faultobj, index);
+	}
+#endif
+	return result;
 }
 
 /*
@@ -236,7 +546,6 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
 	struct vm_object *vmo;
-	unsigned i;
 	int result;
 	vaddr_t check_vaddr;	/* vaddr to use for overlap check */
 
@@ -258,24 +567,10 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	sz = ROUNDUP(sz, PAGE_SIZE);
 
 	/*
-	 * Check for overlaps.
+	 * Check for overlaps, of the region and its guard band.
 	 */
-	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
-		vaddr_t bot, top;
-		
-		vmo = vm_object_array_get(as->as_objects, i);
-		KASSERT(vmo != NULL);
-		bot = vmo->vmo_base;
-		top = bot + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
-
-		/* Check guard band, if any */
-		KASSERT(bot >= vmo->vmo_lower_redzone);
-		bot = bot - vmo->vmo_lower_redzone;
-
-		if (check_vaddr+sz > bot && check_vaddr < top) {
-			/* overlap */
-			return EINVAL;
-		}
+	if (as_overlap(as, check_vaddr, lower_redzone + sz) != NULL) {
+		return EINVAL;
 	}
 
 
@@ -288,7 +583,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	vmo->vmo_lower_redzone = lower_redzone;
 
 	/* Add it to the parent address space. */
-	result = vm_object_array_add(as->as_objects, vmo, NULL);
+	result = as_addobject(as, vmo);
 	if (result) {
 		vm_object_destroy(as, vmo);
 		return result;
@@ -298,6 +593,46 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return 0;
 }
 
+/*
+ * as_map_segment: arrange for the FILESIZE bytes at OFFSET in file V
+ * to appear at VADDR, which must lie within a region already defined
+ * and not yet touched. The pages are read from the file when first
+ * touched rather than now, and clean ones are simply dropped and
+ * reread instead of going to swap. If the segment isn't WRITEABLE,
+ * its pages are shared with other processes running the same program
+ * through the text cache.
+ *
+ * Returns EINVAL if the range can't be mapped this way; the caller
+ * can then read it in by hand.
+ */
+int
+as_map_segment(struct addrspace *as, struct vnode *v, off_t offset,
+	       vaddr_t vaddr, size_t filesize, int writeable)
+{
+	struct vm_object *vmo;
+	vaddr_t top;
+
+	if (filesize == 0) {
+		/* nothing to read; the region is already zerofill */
+		return 0;
+	}
+
+	vmo = as_findobject(as, vaddr, NULL);
+	if (vmo == NULL) {
+		return EINVAL;
+	}
+	top = vmo->vmo_base + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+	if (filesize > top - vaddr || vmo->vmo_vnode != NULL) {
+		return EINVAL;
+	}
+	vm_object_setfile(vmo, v, vaddr, offset, filesize);
+	if (!writeable) {
+		/* if this fails the pages are just private */
+		(void)textcache_attach(vmo);
+	}
+	return 0;
+}
+
 /*
  * as_prepare_load: called before loading executable segments.
  */
@@ -314,15 +649,91 @@ as_prepare_load(struct addrspace *as)
 
 /*
  * as_complete_load: called after loading executable segments.
+ *
+ * Makes the heap: an empty vm_object starting at the first page above
+ * the highest segment, which as_sbrk grows and shrinks.
  */
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Do nothing.
-	 */
+	struct vm_object *vmo;
+	vaddr_t top, heapbase;
+	unsigned i, num;
+	int result;
 
-	(void)as;
+	KASSERT(as->as_heap == NULL);
+
+	heapbase = 0;
+	num = vm_object_array_num(as->as_objects);
+	for (i=0; i<num; i++) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		top = vmo->vmo_base + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+		if (top > heapbase) {
+			heapbase = top;
+		}
+	}
+
+	result = as_define_region(as, heapbase, 0, 0, 1, 1, 0);
+	if (result) {
+		return result;
+	}
+
+	/* it's the highest, so it sorts last */
+	KASSERT(vm_object_array_num(as->as_objects) == num + 1);
+	as->as_heap = vm_object_array_get(as->as_objects, num);
+	as->as_heapend = heapbase;
+	return 0;
+}
+
+/*
+ * as_sbrk: move the break by AMOUNT bytes and hand back the old one.
+ *
+ * The heap vm_object is resized to cover the new break. New pages are
+ * zerofill and only get memory when they're first touched; all that
+ * happens here is reserving swap for them. The heap can't grow into
+ * any other object (or its guard band), including the stack.
+ *
+ * Synchronization: none.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *ret)
+{
+	struct vm_object *heap;
+	vaddr_t newend, heaptop;
+	size_t npages;
+	int result;
+
+	heap = as->as_heap;
+	if (heap == NULL) {
+		/* not loaded from an executable */
+		return ENOMEM;
+	}
+
+	if (amount < 0) {
+		/* negate unsigned; -amount overflows for INT_MIN */
+		if (-(vaddr_t)amount > as->as_heapend - heap->vmo_base) {
+			return EINVAL;
+		}
+	}
+	else if ((vaddr_t)amount > USERSTACK - as->as_heapend) {
+		return ENOMEM;
+	}
+	newend = as->as_heapend + amount;
+
+	npages = ROUNDUP(newend - heap->vmo_base, PAGE_SIZE) / PAGE_SIZE;
+	heaptop = heap->vmo_base + PAGE_SIZE * lpage_array_num(heap->vmo_lpages);
+	if (newend > heaptop &&
+	    as_overlap(as, heaptop, newend - heaptop) != NULL) {
+		return ENOMEM;
+	}
+
+	result = vm_object_setsize(as, heap, npages);
+	if (result) {
+		return result;
+	}
+
+	*ret = as->as_heapend;
+	as->as_heapend = newend;
 	return 0;
 }
 
@@ -354,3 +765,218 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+//
+// mmap
+
+/*
+ * as_findspace: pick an address for a new mapping of SZ bytes: HINT
+ * if that's free, otherwise the highest free place under the stack.
+ * Returns 0 if there's no room.
+ */
+static
+vaddr_t
+as_findspace(struct addrspace *as, vaddr_t hint, size_t sz)
+{
+	struct vm_object *vmo;
+	vaddr_t top;
+
+	if (hint != 0 && (hint & PAGE_FRAME) == hint &&
+	    hint < USERSPACETOP && sz <= USERSPACETOP - hint &&
+	    as_overlap(as, hint, sz) == NULL) {
+		return hint;
+	}
+
+	top = USERSTACKBASE;
+	while (top >= sz + PAGE_SIZE) {
+		vmo = as_overlap(as, top - sz, sz);
+		if (vmo == NULL) {
+			return top - sz;
+		}
+		/* go below it and its guard band and try again */
+		top = vmo->vmo_base - vmo->vmo_lower_redzone;
+	}
+	return 0;
+}
+
+/*
+ * as_mmap: set up a new mapping in AS of LEN bytes, as for mmap().
+ * PROT and FLAGS are as for mmap. If V is not NULL, the mapping shows
+ * the file V starting at OFFSET (which must be page-aligned); past the
+ * end of the file it's zero-filled. With MAP_PRIVATE, writes go to
+ * private copies of the pages; with MAP_SHARED, the vm_object is
+ * shared with child processes and changes go back to the file.
+ *
+ * A MAP_FIXED mapping must not overlap anything already mapped.
+ *
+ * Returns the address of the mapping in RET.
+ */
+int
+as_mmap(struct addrspace *as, vaddr_t addr, size_t len, int prot, int flags,
+	struct vnode *v, off_t offset, vaddr_t *ret)
+{
+	struct vm_object *vmo;
+	struct stat st;
+	vaddr_t base;
+	size_t filesize;
+	unsigned ix;
+	int result;
+
+	if (len == 0) {
+		return EINVAL;
+	}
+	if ((flags & MAP_TYPE) != MAP_SHARED &&
+	    (flags & MAP_TYPE) != MAP_PRIVATE) {
+		return EINVAL;
+	}
+	if (offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	len = ROUNDUP(len, PAGE_SIZE);
+
+	if (flags & MAP_FIXED) {
+		if ((addr & PAGE_FRAME) != addr || addr == 0 ||
+		    addr >= USERSPACETOP || len > USERSPACETOP - addr) {
+			return EINVAL;
+		}
+		base = addr;
+	}
+	else {
+		base = as_findspace(as, addr, len);
+		if (base == 0) {
+			return ENOMEM;
+		}
+	}
+
+	filesize = 0;
+	if (v != NULL) {
+		result = VOP_STAT(v, &st);
+		if (result) {
+			return result;
+		}
+		if (st.st_size > offset) {
+			filesize = len;
+			if ((off_t)filesize > st.st_size - offset) {
+				filesize = st.st_size - offset;
+			}
+		}
+	}
+
+	/* This fails if a MAP_FIXED address is already in use. */
+	result = as_define_region(as, base, len, 0,
+				  prot & PROT_READ, prot & PROT_WRITE,
+				  prot & PROT_EXEC);
+	if (result) {
+		return result;
+	}
+	vmo = as_findobject(as, base, &ix);
+	KASSERT(vmo != NULL && vmo->vmo_base == base);
+
+	vmo->vmo_flags |= VMO_MAPPED;
+	if ((prot & PROT_WRITE) == 0) {
+		vmo->vmo_flags |= VMO_READONLY;
+	}
+	if (flags & MAP_SHARED) {
+		result = vm_object_makeshared(vmo);
+		if (result) {
+			vm_object_array_remove(as->as_objects, ix);
+			vm_object_destroy(as, vmo);
+			return result;
+		}
+	}
+	if (filesize > 0) {
+		vm_object_setfile(vmo, v, base, offset, filesize);
+	}
+
+	*ret = base;
+	return 0;
+}
+
+/*
+ * as_munmap: remove the mapping at ADDR, as for munmap(). The range
+ * must be exactly one made by as_mmap; splitting mappings isn't
+ * supported. Changes to a shared file mapping are written back if
+ * this was the last process using it.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct vm_object *vmo;
+	unsigned ix;
+
+	if ((addr & PAGE_FRAME) != addr || len == 0) {
+		return EINVAL;
+	}
+
+	vmo = as_findobject(as, addr, &ix);
+	if (vmo == NULL || vmo->vmo_base != addr ||
+	    (vmo->vmo_flags & VMO_MAPPED) == 0 ||
+	    lpage_array_num(vmo->vmo_lpages) * PAGE_SIZE !=
+	    ROUNDUP(len, PAGE_SIZE)) {
+		return EINVAL;
+	}
+
+	vm_object_array_remove(as->as_objects, ix);
+	vm_object_destroy(as, vmo);
+	return 0;
+}
+
+/*
+ * as_msync: write back the changes in the LEN bytes at ADDR to the
+ * files they're mapped from, as for msync(). Private and anonymous
+ * mappings have nothing to write back. The writes are always done
+ * right away; MS_SYNC also flushes them out of the file system.
+ */
+int
+as_msync(struct addrspace *as, vaddr_t addr, size_t len, int flags)
+{
+	struct vm_object *vmo;
+	vaddr_t va, end, top;
+	int result;
+
+	if ((addr & PAGE_FRAME) != addr) {
+		return EINVAL;
+	}
+	if ((flags & (MS_ASYNC|MS_SYNC)) == (MS_ASYNC|MS_SYNC) ||
+	    (flags & ~(MS_ASYNC|MS_SYNC|MS_INVALIDATE)) != 0) {
+		return EINVAL;
+	}
+	if (len > USERSPACETOP - addr) {
+		return ENOMEM;
+	}
+	end = addr + ROUNDUP(len, PAGE_SIZE);
+
+	for (va = addr; va < end; va = top) {
+		vmo = as_findobject(as, va, NULL);
+		if (vmo == NULL) {
+			return ENOMEM;
+		}
+		top = vmo->vmo_base +
+			PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
+		if (top > end) {
+			top = end;
+		}
+		if ((vmo->vmo_flags & VMO_SHARED) == 0 ||
+		    vmo->vmo_vnode == NULL) {
+			continue;
+		}
+
+		result = vm_object_writeback(vmo,
+				(va - vmo->vmo_base) / PAGE_SIZE,
+				(top - vmo->vmo_base) / PAGE_SIZE);
+		if (result) {
+			return result;
+		}
+		if (flags & MS_SYNC) {
+			result = VOP_FSYNC(vmo->vmo_vnode);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
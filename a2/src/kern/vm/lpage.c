@@ -37,6 +37,7 @@
 #include <vm.h>
 #include <vmprivate.h>
 #include <machine/coremap.h>
+#include "opt-faultaround.h"
 
 /* 
  * lpage operations
@@ -48,12 +49,17 @@ static volatile uint32_t ct_minfaults;
 static volatile uint32_t ct_majfaults;
 static volatile uint32_t ct_discard_evictions;
 static volatile uint32_t ct_write_evictions;
+static volatile uint32_t ct_cowfaults;
+static volatile uint32_t ct_readaheads;
+static volatile uint32_t ct_filefaults;
+static volatile uint32_t ct_writebacks;
+static volatile uint32_t ct_premaps;
 static struct spinlock stats_spinlock = SPINLOCK_INITIALIZER;
 
 void
 vm_printstats(void)
 {
-	uint32_t zf, mn, mj, de, we, te;
+	uint32_t zf, mn, mj, de, we, te, cw, ra, ff, wb, pm;
 
 	spinlock_acquire(&stats_spinlock);
 	zf = ct_zerofills;
@@ -61,6 +67,11 @@ vm_printstats(void)
 	mj = ct_majfaults;
 	de = ct_discard_evictions;
 	we = ct_write_evictions;
+	cw = ct_cowfaults;
+	ra = ct_readaheads;
+	ff = ct_filefaults;
+	wb = ct_writebacks;
+	pm = ct_premaps;
 	spinlock_release(&stats_spinlock);
 
 	te = de+we;
@@ -69,11 +80,48 @@ vm_printstats(void)
 		(unsigned long) zf, (unsigned long) mn, (unsigned long) mj);
 	kprintf("vm: %lu evictions (%lu discarding, %lu writes)\n",
 		(unsigned long) te, (unsigned long) de, (unsigned long) we);
+	kprintf("vm: %lu copy-on-write faults\n", (unsigned long) cw);
+	kprintf("vm: %lu pages read ahead\n", (unsigned long) ra);
+	kprintf("vm: %lu pages read from files, %lu written back\n",
+		(unsigned long) ff, (unsigned long) wb);
+#if OPT_FAULTAROUND
+	kprintf("vm: %lu pages mapped by fault-around\n", (unsigned long) pm);
+#else
+	(void)pm;
+#endif
+	textcache_printstats();
 	vm_printmdstats();
 }
 
+/* Object cache for lpages. */
+static struct kmem_cache *lpage_cache;
+
+static
+void
+lpage_ctor(void *obj)
+{
+	struct lpage *lp = obj;
+
+	spinlock_init(&lp->lp_spinlock);
+}
+
 /*
- * Create a logical page object.
+ * lpage_bootstrap: set up the lpage cache.
+ * Synchronization: none; runs at boot.
+ */
+void
+lpage_bootstrap(void)
+{
+	lpage_cache = kmem_cache_create("lpage", sizeof(struct lpage),
+					lpage_ctor);
+	if (lpage_cache == NULL) {
+		panic("lpage: Out of memory creating lpage cache\n");
+	}
+}
+
+/*
+ * Create a logical page object. (The spinlock is set up already, by
+ * lpage_ctor.)
  * Synchronization: none.
  */
 struct lpage *
@@ -81,28 +129,71 @@ lpage_create(void)
 {
 	struct lpage *lp;
 
-	lp = kmalloc(sizeof(struct lpage));
+	lp = kmem_cache_alloc(lpage_cache);
 	if (lp==NULL) {
 		return NULL;
 	}
 
 	lp->lp_swapaddr = INVALID_SWAPADDR;
 	lp->lp_paddr = INVALID_PADDR;
-	spinlock_init(&lp->lp_spinlock);
+	lp->lp_refcount = 1;
 
 	return lp;
 }
 
 /*
- * lpage_destroy: deallocates a logical page. Releases any RAM or swap
+ * Release the memory of an lpage that holds no page, swap, or swap
+ * reservation.
+ */
+static
+void
+lpage_free(struct lpage *lp)
+{
+	/* this leaves the spinlock as lpage_ctor made it */
+	spinlock_cleanup(&lp->lp_spinlock);
+	kmem_cache_free(lpage_cache, lp);
+}
+
+/*
+ * lpage_unref: drop one of several references to a shared lpage.
+ * Any TLB mapping of the page is removed, since it may belong to the
+ * address space letting go of it.
+ *
+ * Synchronization: the lpage must be locked and pinned; both are
+ * released.
+ */
+static
+void
+lpage_unref(struct lpage *lp)
+{
+	paddr_t pa;
+
+	KASSERT(spinlock_do_i_hold(&lp->lp_spinlock));
+	KASSERT(lp->lp_refcount > 1);
+
+	lp->lp_refcount--;
+	pa = lp->lp_paddr & PAGE_FRAME;
+	lpage_unlock(lp);
+
+	if (pa != INVALID_PADDR) {
+		mmu_unmap_page(pa);
+		coremap_unpin(pa);
+	}
+}
+
+/*
+ * lpage_destroy: drops a reference to a logical page. If it was the
+ * last reference, deallocates the page and releases any RAM or swap
  * pages involved.
  *
+ * If the page is still shared, the swap page reserved for this
+ * reference's eventual copy is unreserved instead.
+ *
  * Synchronization: Someone might be in the process of evicting the
  * page if it's resident, so it might be pinned. So lock and pin
  * together.
  *
- * We assume that lpages are not shared between address spaces and
- * address spaces are not shared between threads.
+ * We assume that address spaces are not shared between threads.
  */
 void 					
 lpage_destroy(struct lpage *lp)
@@ -113,6 +204,12 @@ lpage_destroy(struct lpage *lp)
 
 	lpage_lock_and_pin(lp);
 
+	if (lp->lp_refcount > 1) {
+		lpage_unref(lp);
+		swap_unreserve(1);
+		return;
+	}
+
 	pa = lp->lp_paddr & PAGE_FRAME;
 	if (pa != INVALID_PADDR) {
 		DEBUG(DB_VM, "lpage_destroy: freeing paddr 0x%x\n", pa);
@@ -130,9 +227,12 @@ lpage_destroy(struct lpage *lp)
 		      lp->lp_swapaddr);
 		swap_free(lp->lp_swapaddr);
 	}
+	else {
+		/* file page; give back the swap it never used */
+		swap_unreserve(1);
+	}
 
-	spinlock_cleanup(&lp->lp_spinlock);
-	kfree(lp);
+	lpage_free(lp);
 }
 
 
@@ -212,14 +312,14 @@ lpage_lock_and_pin(struct lpage *lp)
 		/*
 		 * If what we just got out of the lpage is *now*
 		 * invalid, because the page was paged out on us,
-		 * we're done. The page can't be paged in again behind
-		 * our back, so assert it hasn't after regrabbing the
-		 * lpage lock.
+		 * we're probably done. But if the page is shared,
+		 * another sharer may have paged it in again behind
+		 * our back, so go around again to check.
 		 */
 		if (pa == INVALID_PADDR) {
+			pinned = INVALID_PADDR;
 			lpage_lock(lp);
-			KASSERT((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-			break;
+			continue;
 		}
 		/* Pin what we got and try again. */
 		coremap_pin(pa);
@@ -230,14 +330,17 @@ lpage_lock_and_pin(struct lpage *lp)
 
 /*
  * lpage_materialize: create a new lpage and allocate swap and RAM for it.
- * Do not do anything with the page contents though.
+ * Do not do anything with the page contents though, except that if
+ * ZERO is set the RAM comes already zeroed. SWAPHINT is passed to
+ * swap_alloc.
  *
  * Returns the lpage locked and the physical page pinned.
  */
 
 static
 int
-lpage_materialize(struct lpage **lpret, paddr_t *paret)
+lpage_materialize(off_t swaphint, bool zero, struct lpage **lpret,
+		  paddr_t *paret)
 {
 	struct lpage *lp;
 	paddr_t pa;
@@ -248,14 +351,15 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
 		return ENOMEM;
 	}
 
-	swa = swap_alloc();
+	swa = swap_alloc(swaphint);
 	if (swa == INVALID_SWAPADDR) {
-		lpage_destroy(lp);
+		/* not lpage_destroy; the caller still has the reservation */
+		lpage_free(lp);
 		return ENOSPC;
 	}
 	lp->lp_swapaddr = swa;
 
-	pa = coremap_allocuser(lp);
+	pa = zero ? coremap_allocuser_zero(lp) : coremap_allocuser(lp);
 	if (pa == INVALID_PADDR) {
 		/* lpage_destroy will clean up the swap */
 		lpage_destroy(lp);
@@ -273,6 +377,83 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
 	return 0;
 }
 
+/*
+ * lpage_lock_and_pagein: lock an lpage and pin its physical page,
+ * paging it in first if it isn't resident. A page with swap is read
+ * from swap; a file page is read from VMO, the vm_object it's being
+ * faulted through, at page INDEX.
+ *
+ * Synchronization: we can't hold the lpage lock while allocating a
+ * page or doing I/O, so we drop it for the pagein. Because the lpage
+ * may be shared, another process may page the same lpage in while
+ * we're doing that; if so we throw our copy away and use theirs.
+ * (It may even get evicted again before we get to it, hence the
+ * loop.)
+ *
+ * Returns with the lpage locked and the physical page pinned.
+ */
+static
+int
+lpage_lock_and_pagein(struct lpage *lp, struct vm_object *vmo,
+		      unsigned index, paddr_t *paret)
+{
+	paddr_t pa, newpa;
+	off_t swa;
+	int result;
+
+	lpage_lock_and_pin(lp);
+	while ((pa = lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR) {
+		swa = lp->lp_swapaddr;
+		lpage_unlock(lp);
+
+		/* Obtain user page frame. */
+		newpa = coremap_allocuser(lp);
+		if (newpa == INVALID_PADDR) {
+			return ENOMEM;
+		}
+		KASSERT(coremap_pageispinned(newpa));
+
+		if (swa != INVALID_SWAPADDR) {
+			/* Swap page into physical memory from the disk. */
+			swap_pagein(newpa, swa);
+		}
+		else {
+			/* Clean file page; read it from the file. */
+			KASSERT(vmo != NULL);
+			result = vm_object_readpage(vmo, index, newpa);
+			if (result) {
+				coremap_free(newpa, false /* iskern */);
+				coremap_unpin(newpa);
+				return result;
+			}
+		}
+		lpage_lock(lp);
+
+		if ((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR) {
+			lp->lp_paddr = newpa;
+			pa = newpa;
+
+			spinlock_acquire(&stats_spinlock);
+			ct_majfaults++;
+			if (swa == INVALID_SWAPADDR) {
+				ct_filefaults++;
+			}
+			spinlock_release(&stats_spinlock);
+			break;
+		}
+
+		/* Somebody else did the pagein; discard ours and retry. */
+		lpage_unlock(lp);
+		coremap_free(newpa, false /* iskern */);
+		coremap_unpin(newpa);
+		lpage_lock_and_pin(lp);
+	}
+
+	KASSERT(coremap_pageispinned(pa));
+	*paret = pa;
+	return 0;
+}
+
 /*
  * lpage_copy: create a new lpage and copy data from another lpage.
  *
@@ -281,67 +462,36 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
  *
  *      1. Create newlp.
  *      2. Materialize a page for newlp, so it's locked and pinned.
- *      3. Lock and pin oldlp.
- *      4. Extract the physical address and swap address.
- *      5. If oldlp wasn't present,
- *      5a.    Unlock oldlp.
- *      5b.    Page in.
- *      5c.    This pins the page in the coremap.
- *      5d.    Leave the page pinned and relock oldlp.
- *      5e.    Assert nobody else paged the page in.
- *      6. Copy.
- *      7. Unlock the lpages first, so we can enter the coremap.
- *      8. Unpin the physical pages.
+ *      3. Lock oldlp and pin its page, paging it in if needed.
+ *         (This must be done without newlp locked, as the pagein
+ *         may block; newpa stays pinned throughout.)
+ *      4. Copy.
+ *      5. Unlock the lpages first, so we can enter the coremap.
+ *      6. Unpin the physical pages.
  *      
  */
 int
-lpage_copy(struct lpage *oldlp, struct lpage **lpret)
+lpage_copy(struct lpage *oldlp, off_t swaphint, struct lpage **lpret)
 {
 	struct lpage *newlp;
 	paddr_t newpa, oldpa;
-	off_t swa;
 	int result;
 
-	result = lpage_materialize(&newlp, &newpa);
+	result = lpage_materialize(swaphint, false, &newlp, &newpa);
 	if (result) {
 		return result;
 	}
 	KASSERT(coremap_pageispinned(newpa));
+	lpage_unlock(newlp);
 
-	/* Pin the physical page and lock the lpage. */
-	lpage_lock_and_pin(oldlp);
-	oldpa = oldlp->lp_paddr & PAGE_FRAME;
-
-	/*
-	 * If there is no physical page, we allocate one, which pins
-	 * it, and then (re)lock the lpage. Since we are single-
-	 * threaded (if we weren't, we'd hold the address space lock
-	 * to exclude sibling threads) nobody else should have paged
-	 * the page in behind our back.
-	 */
-	if (oldpa == INVALID_PADDR) {
-		/*
-		 * XXX this is mostly copied from lpage_fault
-		 */
-		swa = oldlp->lp_swapaddr;
-		lpage_unlock(oldlp);
-		oldpa = coremap_allocuser(oldlp);
-		if (oldpa == INVALID_PADDR) {
-			coremap_unpin(newlp->lp_paddr & PAGE_FRAME);
-			lpage_destroy(newlp);
-			return ENOMEM;
-		}
-		KASSERT(coremap_pageispinned(oldpa));
-		lock_acquire(global_paging_lock);
-		swap_pagein(oldpa, swa);
-		lpage_lock(oldlp);
-		lock_release(global_paging_lock);
-		/* Assert nobody else did the pagein. */
-		KASSERT((oldlp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-		oldlp->lp_paddr = oldpa;
+	/* lpage_unshare doesn't copy file pages, so no vm_object needed */
+	result = lpage_lock_and_pagein(oldlp, NULL, 0, &oldpa);
+	if (result) {
+		coremap_unpin(newpa);
+		lpage_destroy(newlp);
+		return result;
 	}
-
-	KASSERT(coremap_pageispinned(oldpa));
+	lpage_lock(newlp);
 
 	coremap_copy_page(oldpa, newpa);
 
@@ -357,6 +507,125 @@ lpage_copy(struct lpage *oldlp, struct lpage **lpret)
 	return 0;
 }
 
+/*
+ * lpage_share: add a reference to an lpage, as at fork time, so it is
+ * shared copy-on-write. Any existing TLB mapping of the page may be
+ * writable, so it's removed; from now on the page is mapped read-only
+ * until someone calls lpage_unshare.
+ *
+ * The caller is responsible for having a swap page reserved for the
+ * new reference.
+ *
+ * Synchronization: lock and pin, so the page can't be evicted while
+ * we get rid of the TLB mapping.
+ */
+void
+lpage_share(struct lpage *lp)
+{
+	paddr_t pa;
+
+	lpage_lock_and_pin(lp);
+	lp->lp_refcount++;
+	pa = lp->lp_paddr & PAGE_FRAME;
+	lpage_unlock(lp);
+
+	if (pa != INVALID_PADDR) {
+		mmu_unmap_page(pa);
+		coremap_unpin(pa);
+	}
+}
+
+/*
+ * lpage_unshare: get a private copy of an lpage that's about to be
+ * written. If the lpage isn't shared, it's returned as is. Otherwise
+ * the contents are copied into a new lpage, which uses up the swap
+ * reservation held for this reference, and the reference to the old
+ * lpage is dropped.
+ *
+ * A shared file page is never dirty, so instead of copying it we make
+ * a new file page, which will be read from the file when it's faulted
+ * on. It keeps this reference's swap reservation.
+ *
+ * Synchronization: the other sharers may unshare at the same time,
+ * so by the time the copy is done we may hold the last reference, in
+ * which case the old lpage is destroyed (or, for a file page, kept).
+ * A shared lpage's swap address can't change, as only an unshared
+ * page is written.
+ */
+int
+lpage_unshare(struct lpage *lp, off_t swaphint, struct lpage **lpret)
+{
+	struct lpage *newlp;
+	int result;
+
+	lpage_lock(lp);
+	KASSERT(lp->lp_refcount > 0);
+	if (lp->lp_refcount == 1) {
+		lpage_unlock(lp);
+		*lpret = lp;
+		return 0;
+	}
+	lpage_unlock(lp);
+
+	if (lp->lp_swapaddr == INVALID_SWAPADDR) {
+		newlp = lpage_create();
+		if (newlp == NULL) {
+			return ENOMEM;
+		}
+		lpage_lock_and_pin(lp);
+		if (lp->lp_refcount > 1) {
+			lpage_unref(lp);
+		}
+		else {
+			/* Everyone else left; it's all ours after all. */
+			paddr_t pa = lp->lp_paddr & PAGE_FRAME;
+			lpage_unlock(lp);
+			if (pa != INVALID_PADDR) {
+				coremap_unpin(pa);
+			}
+			lpage_free(newlp);
+			newlp = lp;
+		}
+		*lpret = newlp;
+		return 0;
+	}
+
+	result = lpage_copy(lp, swaphint, &newlp);
+	if (result) {
+		return result;
+	}
+
+	lpage_lock_and_pin(lp);
+	if (lp->lp_refcount > 1) {
+		lpage_unref(lp);
+	}
+	else {
+		/*
+		 * We're the last user, so the old page's swap was ours
+		 * and the new page's swap used up a reservation we
+		 * didn't have: whoever left in the meantime gave back
+		 * the reservation for their reference already. Free
+		 * the old page and put the reservation back. This
+		 * can't fail, since we just freed a swap page.
+		 */
+		paddr_t pa = lp->lp_paddr & PAGE_FRAME;
+		lpage_unlock(lp);
+		if (pa != INVALID_PADDR) {
+			coremap_unpin(pa);
+		}
+		lpage_destroy(lp);
+		result = swap_reserve(1);
+		KASSERT(result == 0);
+	}
+
+	spinlock_acquire(&stats_spinlock);
+	ct_cowfaults++;
+	spinlock_release(&stats_spinlock);
+
+	*lpret = newlp;
+	return 0;
+}
+
 /*
  * lpage_zerofill: create a new lpage and arrange for it to be cleared
  * to all zeros. The current implementation causes the lpage to be
@@ -364,19 +633,22 @@ lpage_copy(struct lpage *oldlp, struct lpage **lpret)
  * nothing prevents the page from being evicted before it is used by
  * the caller.
  *
- * Synchronization: coremap_allocuser returns the new physical page
- * "pinned" (locked) - we hold that lock while we update the page
- * contents and the necessary lpage fields. Unlock the lpage before
- * unpinning, so it's safe to take the coremap spinlock.
+ * The page normally comes from the coremap's pool of pages zeroed
+ * while the system was idle, so there's nothing to clear here.
+ *
+ * Synchronization: coremap_allocuser_zero returns the new physical
+ * page "pinned" (locked) - we hold that lock while we update the
+ * necessary lpage fields. Unlock the lpage before unpinning, so it's
+ * safe to take the coremap spinlock.
  */
 int
-lpage_zerofill(struct lpage **lpret)
+lpage_zerofill(off_t swaphint, struct lpage **lpret)
 {
 	struct lpage *lp;
 	paddr_t pa;
 	int result;
 
-	result = lpage_materialize(&lp, &pa);
+	result = lpage_materialize(swaphint, true, &lp, &pa);
 	if (result) {
 		return result;
 	}
@@ -386,8 +658,6 @@ lpage_zerofill(struct lpage **lpret)
 	/* Don't actually need the lpage locked. */
 	lpage_unlock(lp);
 
-	coremap_zero_page(pa);
-
 	KASSERT(coremap_pageispinned(pa));
 	coremap_unpin(pa);
 
@@ -400,76 +670,313 @@ lpage_zerofill(struct lpage **lpret)
 }
 
 /*
- * lpage_fault - handle a fault on a specific lpage. If the page is
- * not resident, get a physical page from coremap and swap it in.
+ * lpage_fault - handle a fault on a specific lpage, which is page
+ * INDEX of vm_object VMO. If the page is not resident, get a physical
+ * page from coremap and swap it in (or read it from VMO's file).
  * 
- * You do not yet need to distinguish a readonly fault from a write
- * fault. When we implement sharing, there will be a difference.
- *
- * Synchronization: Lock the lpage while checking if it's in memory. 
- * If it's not, unlock the page while allocting space and loading the
- * page in. This only works because lpages are not currently sharable.
- * The page should be locked again as soon as it is loaded, but be 
- * careful of interactions with other locks while modifying the coremap.
- *
- * After it has been loaded, the page must be pinned so that it is not
- * evicted while changes are made to the TLB. It can be unpinned as soon
- * as the TLB is updated. 
+ * A shared (copy-on-write) page is only ever mapped read-only; the
+ * caller must lpage_unshare it before a write fault gets here.
+ *
+ * The first write to a file page gives it a swap page, out of the
+ * reservation it holds. That's allocated before locking (swap_alloc
+ * may sleep) but only installed along with the dirty bit, so the
+ * page is never seen with swap that doesn't hold its contents. In a
+ * shared mapping another process may do the same at the same time,
+ * or write the page back in between, so we check again once locked.
+ *
+ * Synchronization: lpage_lock_and_pagein does the work of getting
+ * the page in memory, locked and pinned. The dirty bit is set while
+ * the lpage is still locked. The lpage lock is then dropped before
+ * updating the TLB, since mmu_map may need to shoot down another
+ * process's mapping of a shared page. The page stays pinned so it
+ * can't be evicted meanwhile; mmu_map unpins it.
  */
 int
-lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
+lpage_fault(struct lpage *lp, struct addrspace *as, struct vm_object *vmo,
+	    unsigned index, int faulttype, vaddr_t va)
 {
 	paddr_t pa;
-	off_t swa;
-	
-	/* Lock lpage and pin physical page. */
-	lpage_lock_and_pin(lp);
-	pa = lp->lp_paddr & PAGE_FRAME;
+	off_t swa = INVALID_SWAPADDR;
+	int result;
 
-	/* pa not in physical memory. */
-	if (pa == INVALID_PADDR) { 
-		swa = lp->lp_swapaddr;
-		lpage_unlock(lp);
+	while (1) {
+		if (faulttype && swa == INVALID_SWAPADDR &&
+		    lp->lp_swapaddr == INVALID_SWAPADDR) {
+			swa = swap_alloc(vm_object_swaphint(vmo, index));
+			if (swa == INVALID_SWAPADDR) {
+				return ENOSPC;
+			}
+		}
 
-		/* Obtain user page frame. */
-		pa = coremap_allocuser(lp);
-		if (pa == INVALID_PADDR) {
-			coremap_unpin(lp->lp_paddr & PAGE_FRAME);
-			return ENOMEM;
+		result = lpage_lock_and_pagein(lp, vmo, index, &pa);
+		if (result) {
+			if (swa != INVALID_SWAPADDR) {
+				/* still a file page; it keeps the reservation */
+				swap_unalloc(swa);
+			}
+			return result;
 		}
-		KASSERT(coremap_pageispinned(pa));
-		lock_acquire(global_paging_lock);
 
-		/* Swap page into physical memory from the disk. */
-		swap_pagein(pa, swa);
-		lpage_lock(lp);
-		lock_release(global_paging_lock);
+		if (!faulttype) {
+			break;
+		}
 
-		/* Assert nobody else did the pagein. */
-		KASSERT((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-		lp->lp_paddr = pa;
+		/* Mark page dirty, giving it swap if it has none. */
+		KASSERT(lp->lp_refcount == 1);
+		if (lp->lp_swapaddr == INVALID_SWAPADDR) {
+			if (swa == INVALID_SWAPADDR) {
+				/*
+				 * Written back to its file (shared
+				 * mapping) since we looked; retry.
+				 */
+				lpage_unlock(lp);
+				coremap_unpin(pa);
+				continue;
+			}
+			lp->lp_swapaddr = swa;
+			swa = INVALID_SWAPADDR;
+		}
+		LP_SET(lp, LPF_DIRTY);
+		break;
 	}
 
-	/* If faulttype, mark page dirty. */
-	if (faulttype) {
-		LP_SET(lp, LPF_DIRTY);
+	lpage_unlock(lp);
+
+	if (swa != INVALID_SWAPADDR) {
+		/*
+		 * another process sharing the mapping got there first;
+		 * the page is still covered by the reservation
+		 */
+		swap_unalloc(swa);
 	}
 
 	KASSERT(coremap_pageispinned(pa));
 	mmu_map(as, va, pa, faulttype);
 
+	return 0;
+}
+
+/*
+ * lpage_readahead: page in the lpages LPS[0..NPAGES-1] (a run of
+ * consecutive pages of a vm_object) with one swap read, as far as
+ * they are paged out and sit at consecutive swap addresses. LPS[0] is
+ * the page being faulted on; the rest are read ahead in the hope that
+ * they'll be wanted soon. Pages read ahead are clean and not mapped,
+ * so they're cheap to evict again if not.
+ *
+ * If fewer than two pages qualify, this does nothing and the fault
+ * is handled the usual way.
+ *
+ * Synchronization: we only take pages that aren't shared. Then only
+ * the thread faulting on the address space (us) can page them in;
+ * and they aren't resident, so nobody can be evicting them, and
+ * their swap contents can't change under us. Physical pages are
+ * allocated without any lpage locked, as usual.
+ */
+void
+lpage_readahead(struct lpage **lps, unsigned npages)
+{
+	paddr_t pas[SWAP_CLUSTER_PAGES];
+	off_t swa = INVALID_SWAPADDR;
+	unsigned i, n;
+	bool ok;
+
+	if (npages > SWAP_CLUSTER_PAGES) {
+		npages = SWAP_CLUSTER_PAGES;
+	}
+
+	/* Find how long the run of paged-out, contiguous pages is. */
+	for (n = 0; n < npages; n++) {
+		lpage_lock(lps[n]);
+		if (n == 0) {
+			swa = lps[n]->lp_swapaddr;
+		}
+		ok = swa != INVALID_SWAPADDR &&
+			(lps[n]->lp_paddr & PAGE_FRAME) == INVALID_PADDR &&
+			lps[n]->lp_refcount == 1 &&
+			lps[n]->lp_swapaddr == swa + n * PAGE_SIZE;
+		lpage_unlock(lps[n]);
+		if (!ok) {
+			break;
+		}
+	}
+
+	/* Get physical pages for them. */
+	for (i = 0; i < n; i++) {
+		pas[i] = coremap_allocuser(lps[i]);
+		if (pas[i] == INVALID_PADDR) {
+			break;
+		}
+		KASSERT(coremap_pageispinned(pas[i]));
+	}
+	n = i;
+
+	if (n < 2) {
+		if (n == 1) {
+			coremap_free(pas[0], false /* iskern */);
+			coremap_unpin(pas[0]);
+		}
+		return;
+	}
+
+	swap_pagein_cluster(pas, n, swa);
+
+	for (i = 0; i < n; i++) {
+		lpage_lock(lps[i]);
+		KASSERT((lps[i]->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
+		lps[i]->lp_paddr = pas[i];
+		lpage_unlock(lps[i]);
+		coremap_unpin(pas[i]);
+	}
+
+	spinlock_acquire(&stats_spinlock);
+	ct_majfaults++;
+	ct_readaheads += n - 1;
+	spinlock_release(&stats_spinlock);
+}
+
+/*
+ * lpage_premap: if LP is in memory and nobody is busy with it, map it
+ * at VA in AS without waiting for a fault on it. Used for
+ * fault-around. Returns true if it was mapped.
+ *
+ * The mapping is writable only if CANWRITE is set and the page is
+ * private and already dirty, so that a write to it doesn't need a
+ * fault to mark it dirty (or unshare it).
+ *
+ * Synchronization: the page is pinned with coremap_trypin while the
+ * lpage is locked; that's safe because it doesn't wait. If the page
+ * is pinned already, someone is evicting it or otherwise working on
+ * it, and we leave it alone. mmu_premap unpins it.
+ */
+bool
+lpage_premap(struct lpage *lp, struct addrspace *as, vaddr_t va,
+	     bool canwrite)
+{
+	paddr_t pa;
+	bool writable;
+
+	lpage_lock(lp);
+	pa = lp->lp_paddr & PAGE_FRAME;
+	if (pa == INVALID_PADDR || !coremap_trypin(pa)) {
+		lpage_unlock(lp);
+		return false;
+	}
+	writable = canwrite && LP_ISDIRTY(lp) && lp->lp_refcount == 1;
 	lpage_unlock(lp);
 
-	return 0;
+	if (!mmu_premap(as, va, pa, writable)) {
+		return false;
+	}
+
+	spinlock_acquire(&stats_spinlock);
+	ct_premaps++;
+	spinlock_release(&stats_spinlock);
+	return true;
+}
+
+/*
+ * lpage_writeback: if LP, page INDEX of the shared file mapping VMO,
+ * has been changed, write it to the file. It then becomes a clean
+ * file page again: its swap is freed (keeping the reservation) and its
+ * TLB mapping removed, so the next write faults and redirties it.
+ *
+ * Synchronization: the page stays pinned while it's written, so it
+ * can't be evicted. The swap address and dirty bit are cleared before
+ * the write, so a write by another process sharing the mapping during
+ * the write makes the page dirty again rather than getting lost. If
+ * the write fails the page is made dirty again, unless that happened
+ * anyway.
+ */
+int
+lpage_writeback(struct lpage *lp, struct vm_object *vmo, unsigned index)
+{
+	paddr_t pa;
+	off_t swa;
+	int result;
+
+	lpage_lock(lp);
+	swa = lp->lp_swapaddr;
+	lpage_unlock(lp);
+	if (swa == INVALID_SWAPADDR) {
+		/* clean */
+		return 0;
+	}
+
+	result = lpage_lock_and_pagein(lp, vmo, index, &pa);
+	if (result) {
+		return result;
+	}
+	swa = lp->lp_swapaddr;
+	if (swa == INVALID_SWAPADDR) {
+		/* somebody else wrote it back */
+		lpage_unlock(lp);
+		coremap_unpin(pa);
+		return 0;
+	}
+	lp->lp_swapaddr = INVALID_SWAPADDR;
+	LP_CLEAR(lp, LPF_DIRTY);
+	lpage_unlock(lp);
+
+	mmu_unmap_page(pa);
+	result = vm_object_writepage(vmo, index, pa);
+	if (result) {
+		lpage_lock(lp);
+		if (lp->lp_swapaddr == INVALID_SWAPADDR) {
+			lp->lp_swapaddr = swa;
+			LP_SET(lp, LPF_DIRTY);
+			swa = INVALID_SWAPADDR;
+		}
+		lpage_unlock(lp);
+	}
+	coremap_unpin(pa);
+
+	if (swa != INVALID_SWAPADDR) {
+		swap_unalloc(swa);
+	}
+
+	if (result == 0) {
+		spinlock_acquire(&stats_spinlock);
+		ct_writebacks++;
+		spinlock_release(&stats_spinlock);
+	}
+
+	return result;
+}
+
+/*
+ * lpage_unmap: remove the TLB mapping of an lpage, if it has one, on
+ * whatever CPU. For when one address space stops using a page that
+ * others still use.
+ *
+ * Synchronization: lock and pin, as in lpage_share.
+ */
+void
+lpage_unmap(struct lpage *lp)
+{
+	paddr_t pa;
+
+	lpage_lock_and_pin(lp);
+	pa = lp->lp_paddr & PAGE_FRAME;
+	lpage_unlock(lp);
+
+	if (pa != INVALID_PADDR) {
+		mmu_unmap_page(pa);
+		coremap_unpin(pa);
+	}
 }
 
 /*
  * lpage_evict: Evict an lpage from physical memory.
  *
- * Synchronization: lock the lpage while evicting it. We come here
- * from the coremap and should have the coremap spinlock and should 
- * have pinned the physical page. This is why we must not hold lpage
- * locks while entering the coremap code.
+ * Synchronization: lock the lpage while looking at it and again while
+ * marking it non-resident, but not during the pageout. We come here
+ * from the coremap with the physical page pinned, and it stays pinned
+ * throughout; anyone else wanting the lpage waits for that pin in
+ * lpage_lock_and_pin. Leaving lp_paddr alone until the write is done
+ * means nobody can start reading the page back in from swap before
+ * it's all there. Nobody can dirty the page meanwhile either, since
+ * that requires pinning it.
  */
 void
 lpage_evict(struct lpage *lp)
@@ -483,14 +990,31 @@ lpage_evict(struct lpage *lp)
 	pa = lp->lp_paddr;
 	KASSERT(pa != INVALID_PADDR);
 	swa = lp->lp_swapaddr;
-	KASSERT(swa != INVALID_SWAPADDR);
+	lpage_unlock(lp);
+
+	KASSERT(coremap_pageispinned(pa & PAGE_FRAME));
+
+	/*
+	 * If page is dirty, write it to swap. (A clean page without
+	 * swap is a file page and is just dropped.)
+	 */
+	if (pa & LPF_DIRTY) {
+		KASSERT(swa != INVALID_SWAPADDR);
+		swap_pageout(pa & PAGE_FRAME, swa);
+	}
 
 	/* Mark page to indicate that it is no longer in physical memory. */
+	lpage_lock(lp);
+	KASSERT(lp->lp_paddr == pa);
 	lp->lp_paddr = INVALID_PADDR;
 	lpage_unlock(lp);
 
-	/* If page is dirty, write it to swap. */
+	spinlock_acquire(&stats_spinlock);
 	if (pa & LPF_DIRTY) {
-		swap_pageout(pa & PAGE_FRAME, swa);
+		ct_write_evictions++;
+	}
+	else {
+		ct_discard_evictions++;
 	}
+	spinlock_release(&stats_spinlock);
 }
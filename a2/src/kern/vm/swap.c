@@ -69,18 +69,10 @@ static unsigned long swap_reserved_pages;
 static struct vnode *swapstore;	// swap file
 
 /*
- * Only one page can be in transit to/from disk at once (at least under
- * present circumstances.) While the disk device will queue up multiple
- * concurrent requests correctly, there's no benefit to doing so. So we
- * enforce mutual exclusion at a higher level. This reduces the number
- * of pages marked in transit at any one time and thus (hopefully) makes
- * paging more intelligent and multipage allocation less likely to starve.
- *
- * This lock signals "intent to page" and should be construed as
- * advisory.
+ * Where the next swap_alloc without a hint starts looking (as a page
+ * index). See swap_alloc.
  */
-
-struct lock *global_paging_lock;
+static unsigned swap_nextfree;
 
 
 /*
@@ -150,6 +142,9 @@ swap_bootstrap(void)
 	/* mark the first page of swap used so we can check for errors */
 	bitmap_mark(swapmap, 0);
 	swap_free_pages--;
+	swap_nextfree = 1;
+
+	textcache_bootstrap();
 }
 
 /*
@@ -169,12 +164,19 @@ swap_shutdown(void)
  * swap_alloc: allocates a page in the swapfile.
  * The page should have already been reserved with swap_reserve.
  *
+ * We try to keep neighbouring pages of a vm_object next to each
+ * other in swap, so they can be read back in clusters. HINT is the
+ * swap address the caller would like (the one next to a neighbouring
+ * page's), or INVALID_SWAPADDR. If we can't have it, we start a new
+ * run at the next free page after the previous run started, and move
+ * on SWAP_CLUSTER_PAGES so the new run has room to grow.
+ *
  * Synchronization: uses swaplock.
  */
 off_t
-swap_alloc(void)
+swap_alloc(off_t hint)
 {
-	uint32_t rv, index;
+	uint32_t index, n;
 	
 	lock_acquire(swaplock);
 
@@ -184,9 +186,20 @@ swap_alloc(void)
 	KASSERT(swap_reserved_pages>0);
 	KASSERT(swap_free_pages>0);
 
-	rv = bitmap_alloc(swapmap, &index);
-	/* If this blows up, our counters are wrong */
-	KASSERT(rv == 0);
+	index = hint / PAGE_SIZE;
+	if (hint == INVALID_SWAPADDR || index >= swap_total_pages ||
+	    bitmap_isset(swapmap, index)) {
+		for (n = 0; n < swap_total_pages; n++) {
+			index = (swap_nextfree + n) % swap_total_pages;
+			if (!bitmap_isset(swapmap, index)) {
+				break;
+			}
+		}
+		/* If this blows up, our counters are wrong */
+		KASSERT(n < swap_total_pages);
+		swap_nextfree = (index + SWAP_CLUSTER_PAGES) % swap_total_pages;
+	}
+	bitmap_mark(swapmap, index);
 
 	swap_reserved_pages--;
 	swap_free_pages--;
@@ -223,6 +236,37 @@ swap_free(off_t swapaddr)
 	lock_release(swaplock);
 }
 
+/*
+ * swap_unalloc: gives back a page got from swap_alloc that ended up
+ * not being used, and puts back the reservation swap_alloc took for
+ * it, so the page can be allocated again later. (swap_free plus
+ * swap_reserve, except that this can't fail.)
+ *
+ * Synchronization: uses swaplock.
+ */
+void
+swap_unalloc(off_t swapaddr)
+{
+	uint32_t index;
+
+	KASSERT(swapaddr != INVALID_SWAPADDR);
+	KASSERT(swapaddr % PAGE_SIZE == 0);
+
+	index = swapaddr / PAGE_SIZE;
+
+	lock_acquire(swaplock);
+
+	KASSERT(swap_free_pages < swap_total_pages);
+	KASSERT(swap_reserved_pages <= swap_free_pages);
+
+	KASSERT(bitmap_isset(swapmap, index));
+	bitmap_unmark(swapmap, index);
+	swap_free_pages++;
+	swap_reserved_pages++;
+
+	lock_release(swaplock);
+}
+
 /*
  * swap_reserve/unreserve: reserve some pages for future allocation, or
  * release such pages.
@@ -266,30 +310,45 @@ swap_unreserve(unsigned long npages)
 }
 
 /*
- * swap_io: Does one swap I/O. Panics on failure.
+ * swap_io: Does one swap I/O, of NPAGES pages at consecutive swap
+ * addresses starting at SWAPADDR, to or from the physical pages in
+ * PAS. The disk does this as one transfer. Panics on failure.
  *
- * Synchronization: none specifically. The physical page should be
- * marked "pinned" (locked) so it won't be touched by other people.
+ * Synchronization: none specifically. The physical pages should be
+ * marked "pinned" (locked) so they won't be touched by other people.
+ * Any number of swap I/Os may be in progress at once; the disk
+ * driver queues them.
  */
 static
 void
-swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
+swap_io(const paddr_t *pas, unsigned npages, off_t swapaddr,
+	enum uio_rw rw)
 {
-	struct iovec iov;
+	struct iovec iov[SWAP_CLUSTER_PAGES];
 	struct uio u;
-	vaddr_t va;
+	unsigned i;
 	int result;
 
-	KASSERT(lock_do_i_hold(global_paging_lock));
-
-	KASSERT(pa != INVALID_PADDR);
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER_PAGES);
 	KASSERT(swapaddr % PAGE_SIZE == 0);
-	KASSERT(coremap_pageispinned(pa));
-	KASSERT(bitmap_isset(swapmap, swapaddr / PAGE_SIZE));
 
-	va = coremap_map_swap_page(pa);
+	for (i=0; i<npages; i++) {
+		KASSERT(pas[i] != INVALID_PADDR);
+		KASSERT(coremap_pageispinned(pas[i]));
+		KASSERT(bitmap_isset(swapmap, swapaddr / PAGE_SIZE + i));
+
+		iov[i].iov_kbase = (void *)coremap_map_swap_page(pas[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+
+	u.uio_iov = iov;
+	u.uio_iovcnt = npages;
+	u.uio_offset = swapaddr;
+	u.uio_resid = npages * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
 
-	uio_kinit(&iov, &u, (char *)va, PAGE_SIZE, swapaddr, rw);
 	if (rw==UIO_READ) {
 		result = VOP_READ(swapstore, &u);
 	}
@@ -297,7 +356,9 @@ swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
 		result = VOP_WRITE(swapstore, &u);
 	}
 
-	coremap_unmap_swap_page(va, pa);
+	for (i=0; i<npages; i++) {
+		coremap_unmap_swap_page((vaddr_t)iov[i].iov_kbase, pas[i]);
+	}
 
 	if (result==EIO) {
 		panic("swap: EIO on swapfile (offset %ld)\n",
@@ -320,7 +381,18 @@ swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
 void
 swap_pagein(paddr_t pa, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_READ);
+	swap_io(&pa, 1, swapaddr, UIO_READ);
+}
+
+/*
+ * swap_pagein_cluster: load several pages from consecutive swap
+ * addresses into physical memory at once.
+ * Synchronization: none here. See swap_io().
+ */
+void
+swap_pagein_cluster(const paddr_t *pas, unsigned npages, off_t swapaddr)
+{
+	swap_io(pas, npages, swapaddr, UIO_READ);
 }
 
 
@@ -331,5 +403,5 @@ swap_pagein(paddr_t pa, off_t swapaddr)
 void
 swap_pageout(paddr_t pa, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_WRITE);
+	swap_io(&pa, 1, swapaddr, UIO_WRITE);
 }
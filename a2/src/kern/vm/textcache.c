@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <array.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vmprivate.h>
+
+/*
+ * Text cache: file pages of read-only program segments, shared among
+ * all the processes running the same program.
+ *
+ * There is one textcache entry per distinct read-only segment mapping
+ * (same vnode, same place in the file, same addresses). Each vm_object
+ * mapping it holds a reference to the entry. The entry holds its own
+ * reference to every page it has handed out, along with a swap
+ * reservation for that reference, so the pages stay shared: a vm_object
+ * that faults on a page it doesn't have gets the cached lpage with
+ * lpage_share instead of a private file page. Since the cache's
+ * reference never goes away while the entry exists, a write to one of
+ * these pages always goes through lpage_unshare and gets a private
+ * copy.
+ *
+ * The entry goes away with the last vm_object using it, so pages are
+ * only kept while someone is running the program.
+ *
+ * Synchronization: textcache_lock protects the list and the entries.
+ * It's a sleep lock, because creating pages allocates memory and swap
+ * reservations. Nothing else is acquired under it except the swap and
+ * lpage locks.
+ */
+
+struct textcache {
+	struct vnode *tc_vnode;
+	off_t tc_fileoffset;
+	vaddr_t tc_filebase;
+	size_t tc_filesize;
+	vaddr_t tc_base;
+	struct lpage_array *tc_pages;
+	unsigned tc_refcount;
+	struct textcache *tc_next;
+};
+
+static struct lock *textcache_lock;
+static struct textcache *textcache_list;
+
+/* Stats counters (under textcache_lock) */
+static uint32_t ct_textcache_hits;
+static uint32_t ct_textcache_misses;
+
+/*
+ * textcache_bootstrap: set up the text cache.
+ */
+void
+textcache_bootstrap(void)
+{
+	textcache_lock = lock_create("textcache");
+	if (textcache_lock == NULL) {
+		panic("textcache: No memory for lock\n");
+	}
+	textcache_list = NULL;
+}
+
+/*
+ * Check if a textcache entry is for the same segment mapping as a
+ * vm_object.
+ */
+static
+bool
+textcache_matches(struct textcache *tc, struct vm_object *vmo)
+{
+	return tc->tc_vnode == vmo->vmo_vnode &&
+		tc->tc_fileoffset == vmo->vmo_fileoffset &&
+		tc->tc_filebase == vmo->vmo_filebase &&
+		tc->tc_filesize == vmo->vmo_filesize &&
+		tc->tc_base == vmo->vmo_base &&
+		lpage_array_num(tc->tc_pages) ==
+			lpage_array_num(vmo->vmo_lpages);
+}
+
+/*
+ * textcache_attach: make VMO, which must already be backed by a file,
+ * share pages through the text cache. Finds the entry for its mapping
+ * or makes a new one.
+ *
+ * On failure VMO is left alone; its pages are then just private.
+ */
+int
+textcache_attach(struct vm_object *vmo)
+{
+	struct textcache *tc;
+	unsigned i, npages;
+	int result;
+
+	KASSERT(vmo->vmo_vnode != NULL);
+	KASSERT(vmo->vmo_textcache == NULL);
+
+	lock_acquire(textcache_lock);
+
+	for (tc = textcache_list; tc != NULL; tc = tc->tc_next) {
+		if (textcache_matches(tc, vmo)) {
+			tc->tc_refcount++;
+			vmo->vmo_textcache = tc;
+			lock_release(textcache_lock);
+			return 0;
+		}
+	}
+
+	tc = kmalloc(sizeof(struct textcache));
+	if (tc == NULL) {
+		lock_release(textcache_lock);
+		return ENOMEM;
+	}
+	tc->tc_pages = lpage_array_create();
+	if (tc->tc_pages == NULL) {
+		kfree(tc);
+		lock_release(textcache_lock);
+		return ENOMEM;
+	}
+	npages = lpage_array_num(vmo->vmo_lpages);
+	result = lpage_array_setsize(tc->tc_pages, npages);
+	if (result) {
+		lpage_array_destroy(tc->tc_pages);
+		kfree(tc);
+		lock_release(textcache_lock);
+		return result;
+	}
+	for (i=0; i<npages; i++) {
+		lpage_array_set(tc->tc_pages, i, NULL);
+	}
+
+	/* hold the file open for as long as the entry exists */
+	VOP_INCREF(vmo->vmo_vnode);
+	VOP_INCOPEN(vmo->vmo_vnode);
+	tc->tc_vnode = vmo->vmo_vnode;
+	tc->tc_fileoffset = vmo->vmo_fileoffset;
+	tc->tc_filebase = vmo->vmo_filebase;
+	tc->tc_filesize = vmo->vmo_filesize;
+	tc->tc_base = vmo->vmo_base;
+	tc->tc_refcount = 1;
+
+	tc->tc_next = textcache_list;
+	textcache_list = tc;
+
+	vmo->vmo_textcache = tc;
+	lock_release(textcache_lock);
+	return 0;
+}
+
+/*
+ * textcache_detach: drop a vm_object's reference to a textcache entry.
+ * The last one throws away the entry and its references to the pages.
+ */
+void
+textcache_detach(struct textcache *tc)
+{
+	struct textcache **tcp;
+	struct lpage *lp;
+	unsigned i;
+	int result;
+
+	lock_acquire(textcache_lock);
+	KASSERT(tc->tc_refcount > 0);
+	tc->tc_refcount--;
+	if (tc->tc_refcount > 0) {
+		lock_release(textcache_lock);
+		return;
+	}
+
+	for (tcp = &textcache_list; *tcp != tc; tcp = &(*tcp)->tc_next) {
+		KASSERT(*tcp != NULL);
+	}
+	*tcp = tc->tc_next;
+	lock_release(textcache_lock);
+
+	/* Nobody can find it now, so we can tear it down unlocked. */
+	for (i=0; i<lpage_array_num(tc->tc_pages); i++) {
+		lp = lpage_array_get(tc->tc_pages, i);
+		if (lp != NULL) {
+			/* this also returns our swap reservation */
+			lpage_destroy(lp);
+		}
+	}
+	result = lpage_array_setsize(tc->tc_pages, 0);
+	/* shrinking an array shouldn't fail */
+	KASSERT(result==0);
+	lpage_array_destroy(tc->tc_pages);
+	vfs_close(tc->tc_vnode);
+	kfree(tc);
+}
+
+/*
+ * textcache_getpage: get a reference to the shared copy of page INDEX
+ * of the segment, making it (as a file page, not yet read in) if
+ * there isn't one. The reference uses the caller's swap reservation
+ * for the page, as with lpage_share.
+ */
+int
+textcache_getpage(struct textcache *tc, unsigned index, struct lpage **ret)
+{
+	struct lpage *lp;
+	int result;
+
+	lock_acquire(textcache_lock);
+	KASSERT(index < lpage_array_num(tc->tc_pages));
+
+	lp = lpage_array_get(tc->tc_pages, index);
+	if (lp == NULL) {
+		/* the cache's own reference needs its own reservation */
+		result = swap_reserve(1);
+		if (result) {
+			lock_release(textcache_lock);
+			return result;
+		}
+		lp = lpage_create();
+		if (lp == NULL) {
+			swap_unreserve(1);
+			lock_release(textcache_lock);
+			return ENOMEM;
+		}
+		lpage_array_set(tc->tc_pages, index, lp);
+		ct_textcache_misses++;
+	}
+	else {
+		ct_textcache_hits++;
+	}
+
+	lpage_share(lp);
+	lock_release(textcache_lock);
+
+	*ret = lp;
+	return 0;
+}
+
+/*
+ * textcache_printstats: report how often text pages were found
+ * already cached.
+ */
+void
+textcache_printstats(void)
+{
+	uint32_t hits, misses;
+
+	lock_acquire(textcache_lock);
+	hits = ct_textcache_hits;
+	misses = ct_textcache_misses;
+	lock_release(textcache_lock);
+
+	kprintf("vm: %lu text pages shared, %lu created\n",
+		(unsigned long) hits, (unsigned long) misses);
+}
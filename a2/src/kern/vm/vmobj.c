@@ -31,6 +31,10 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <vmprivate.h>
@@ -74,6 +78,14 @@ vm_object_create(size_t npages)
 
 	vmo->vmo_base = 0xdeafbeef;		/* make sure these */
 	vmo->vmo_lower_redzone = 0xdeafbeef;	/* get filled in later */
+	vmo->vmo_vnode = NULL;
+	vmo->vmo_filebase = 0;
+	vmo->vmo_fileoffset = 0;
+	vmo->vmo_filesize = 0;
+	vmo->vmo_textcache = NULL;
+	vmo->vmo_flags = 0;
+	vmo->vmo_refcount = 1;
+	vmo->vmo_lock = NULL;
 
 	/* add the requested number of zerofilled pages */
 	result = lpage_array_setsize(vmo->vmo_lpages, npages);
@@ -92,9 +104,15 @@ vm_object_create(size_t npages)
 }
 
 /*
- * vm_object_copy: clone a vm_object.
+ * vm_object_copy: clone a vm_object. The pages are not copied; they
+ * are shared copy-on-write and copied later on a write fault. The
+ * swap reserved by vm_object_create for the new object covers those
+ * copies.
  *
- * Synchronization: None; lpage_copy does the hard stuff.
+ * A VMO_SHARED object isn't cloned at all; the new address space just
+ * gets another reference to it.
+ *
+ * Synchronization: None; lpage_share does the hard stuff.
  */
 int
 vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
@@ -106,6 +124,15 @@ vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 	unsigned j;
 	int result;
 
+	if (vmo->vmo_flags & VMO_SHARED) {
+		lock_acquire(vmo->vmo_lock);
+		vmo->vmo_refcount++;
+		lock_release(vmo->vmo_lock);
+		(void)newas;
+		*ret = vmo;
+		return 0;
+	}
+
 	newvmo = vm_object_create(lpage_array_num(vmo->vmo_lpages));
 	if (newvmo == NULL) {
 		return ENOMEM;
@@ -113,6 +140,16 @@ vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 
 	newvmo->vmo_base = vmo->vmo_base;
 	newvmo->vmo_lower_redzone = vmo->vmo_lower_redzone;
+	newvmo->vmo_flags = vmo->vmo_flags;
+	if (vmo->vmo_vnode != NULL) {
+		vm_object_setfile(newvmo, vmo->vmo_vnode, vmo->vmo_filebase,
+				  vmo->vmo_fileoffset, vmo->vmo_filesize);
+	}
+	if (vmo->vmo_textcache != NULL) {
+		/* finds the entry vmo is using, so can't fail */
+		result = textcache_attach(newvmo);
+		KASSERT(result == 0);
+	}
 
 	for (j = 0; j < lpage_array_num(vmo->vmo_lpages); j++) {
 		lp = lpage_array_get(vmo->vmo_lpages, j);
@@ -126,19 +163,13 @@ vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 			continue;
 		}
 
-		result = lpage_copy(lp, &newlp);
-		if (result) {
-			goto fail;
-		}
-		lpage_array_set(newvmo->vmo_lpages, j, newlp);
+		lpage_share(lp);
+		lpage_array_set(newvmo->vmo_lpages, j, lp);
 	}
 
+	(void)newas;
 	*ret = newvmo;
 	return 0;
-
- fail:
-	vm_object_destroy(newas, newvmo);
-	return result;
 }
 
 /*
@@ -193,17 +224,294 @@ vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
 }
 
 /*
- * vm_object_destroy: Deallocates a vm_object.
+ * vm_object_swaphint: choose the swap address we'd like for a new
+ * lpage at INDEX: the one right after the previous page's, or right
+ * before the next page's. Returns INVALID_SWAPADDR if neither
+ * neighbour has swap.
+ *
+ * Synchronization: none. A neighbour's swap address can change under
+ * us (lpage_writeback drops it, for one), so what we return may be
+ * stale. That's all right because it's only a hint: swap_alloc checks
+ * it and falls back to searching if it's out of range or taken.
+ */
+off_t
+vm_object_swaphint(struct vm_object *vmo, unsigned index)
+{
+	struct lpage *lp;
+	off_t swa;
+
+	if (index > 0) {
+		lp = lpage_array_get(vmo->vmo_lpages, index-1);
+		if (lp != NULL) {
+			swa = lp->lp_swapaddr;
+			if (swa != INVALID_SWAPADDR) {
+				return swa + PAGE_SIZE;
+			}
+		}
+	}
+	if (index+1 < lpage_array_num(vmo->vmo_lpages)) {
+		lp = lpage_array_get(vmo->vmo_lpages, index+1);
+		if (lp != NULL) {
+			swa = lp->lp_swapaddr;
+			if (swa > PAGE_SIZE) {
+				return swa - PAGE_SIZE;
+			}
+		}
+	}
+	return INVALID_SWAPADDR;
+}
+
+/*
+ * vm_object_readahead: before faulting on the page at INDEX, page it
+ * in along with the pages that follow it, if they are all out in
+ * swap next to each other. See lpage_readahead.
  *
  * Synchronization: none; assumes one thread uniquely owns the object.
  */
+void
+vm_object_readahead(struct vm_object *vmo, unsigned index)
+{
+	struct lpage *lps[SWAP_CLUSTER_PAGES];
+	unsigned n, num;
+
+	num = lpage_array_num(vmo->vmo_lpages);
+	for (n = 0; n < SWAP_CLUSTER_PAGES && index + n < num; n++) {
+		lps[n] = lpage_array_get(vmo->vmo_lpages, index + n);
+		if (lps[n] == NULL) {
+			break;
+		}
+	}
+
+	if (n > 1) {
+		lpage_readahead(lps, n);
+	}
+}
+
+/*
+ * vm_object_setfile: make the FILESIZE bytes at OFFSET in file V the
+ * initial contents of VMO at address VADDR. Pages of VMO that haven't
+ * been touched yet are read from the file on demand instead of being
+ * zero-filled. V is held open until the object is destroyed.
+ *
+ * Synchronization: none; assumes one thread uniquely owns the object.
+ */
+void
+vm_object_setfile(struct vm_object *vmo, struct vnode *v, vaddr_t vaddr,
+		  off_t offset, size_t filesize)
+{
+	KASSERT(vmo->vmo_vnode == NULL);
+	KASSERT(vaddr >= vmo->vmo_base);
+	KASSERT(vaddr + filesize <= vmo->vmo_base +
+		PAGE_SIZE * lpage_array_num(vmo->vmo_lpages));
+
+	VOP_INCREF(v);
+	VOP_INCOPEN(v);
+	vmo->vmo_vnode = v;
+	vmo->vmo_filebase = vaddr;
+	vmo->vmo_fileoffset = offset;
+	vmo->vmo_filesize = filesize;
+}
+
+/*
+ * vm_object_isfilepage: return true if page INDEX of VMO overlaps the
+ * file data, so that creating it means reading from the file.
+ */
+bool
+vm_object_isfilepage(struct vm_object *vmo, unsigned index)
+{
+	vaddr_t va;
+
+	if (vmo->vmo_vnode == NULL) {
+		return false;
+	}
+	va = vmo->vmo_base + index * PAGE_SIZE;
+	return va < vmo->vmo_filebase + vmo->vmo_filesize &&
+		va + PAGE_SIZE > vmo->vmo_filebase;
+}
+
+/*
+ * vm_object_readpage: fill the (pinned) physical page PA with the
+ * initial contents of page INDEX of VMO: whatever part of it comes
+ * from the file, and zeros for the rest.
+ *
+ * Synchronization: none here. Blocks for the read.
+ */
+int
+vm_object_readpage(struct vm_object *vmo, unsigned index, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t va, start, end, kva;
+	int result;
+
+	KASSERT(vmo->vmo_vnode != NULL);
+	KASSERT(coremap_pageispinned(pa));
+
+	coremap_zero_page(pa);
+
+	va = vmo->vmo_base + index * PAGE_SIZE;
+	start = va > vmo->vmo_filebase ? va : vmo->vmo_filebase;
+	end = vmo->vmo_filebase + vmo->vmo_filesize;
+	if (end > va + PAGE_SIZE) {
+		end = va + PAGE_SIZE;
+	}
+	if (start >= end) {
+		return 0;
+	}
+
+	kva = coremap_map_swap_page(pa);
+	uio_kinit(&iov, &u, (void *)(kva + (start - va)), end - start,
+		  vmo->vmo_fileoffset + (start - vmo->vmo_filebase),
+		  UIO_READ);
+	result = VOP_READ(vmo->vmo_vnode, &u);
+	coremap_unmap_swap_page(kva, pa);
+
+	/* If the file has shrunk since it was mapped, the rest stays 0. */
+	return result;
+}
+
+/*
+ * vm_object_writepage: write the part of the (pinned) physical page PA
+ * that came from the file, as page INDEX of VMO, back to the file.
+ *
+ * Synchronization: none here. Blocks for the write.
+ */
+int
+vm_object_writepage(struct vm_object *vmo, unsigned index, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t va, start, end, kva;
+	int result;
+
+	KASSERT(vmo->vmo_vnode != NULL);
+	KASSERT(coremap_pageispinned(pa));
+
+	va = vmo->vmo_base + index * PAGE_SIZE;
+	start = va > vmo->vmo_filebase ? va : vmo->vmo_filebase;
+	end = vmo->vmo_filebase + vmo->vmo_filesize;
+	if (end > va + PAGE_SIZE) {
+		end = va + PAGE_SIZE;
+	}
+	if (start >= end) {
+		return 0;
+	}
+
+	kva = coremap_map_swap_page(pa);
+	uio_kinit(&iov, &u, (void *)(kva + (start - va)), end - start,
+		  vmo->vmo_fileoffset + (start - vmo->vmo_filebase),
+		  UIO_WRITE);
+	result = VOP_WRITE(vmo->vmo_vnode, &u);
+	coremap_unmap_swap_page(kva, pa);
+	return result;
+}
+
+/*
+ * vm_object_makeshared: make VMO a VMO_SHARED object, as for a
+ * MAP_SHARED mapping.
+ */
+int
+vm_object_makeshared(struct vm_object *vmo)
+{
+	KASSERT(vmo->vmo_lock == NULL);
+
+	vmo->vmo_lock = lock_create("vm_object");
+	if (vmo->vmo_lock == NULL) {
+		return ENOMEM;
+	}
+	vmo->vmo_flags |= VMO_SHARED;
+	return 0;
+}
+
+/*
+ * vm_object_writeback: write back the changed file pages of VMO with
+ * indexes START up to (not including) END, as for msync. Pages that
+ * don't overlap the file aren't written anywhere.
+ *
+ * Synchronization: hold vmo_lock, so the pages don't go away.
+ */
+int
+vm_object_writeback(struct vm_object *vmo, unsigned start, unsigned end)
+{
+	struct lpage *lp;
+	unsigned i;
+	int result;
+
+	KASSERT(vmo->vmo_flags & VMO_SHARED);
+	KASSERT(end <= lpage_array_num(vmo->vmo_lpages));
+
+	if (vmo->vmo_vnode == NULL) {
+		return 0;
+	}
+
+	lock_acquire(vmo->vmo_lock);
+	for (i=start; i<end; i++) {
+		lp = lpage_array_get(vmo->vmo_lpages, i);
+		if (lp == NULL || !vm_object_isfilepage(vmo, i)) {
+			continue;
+		}
+		result = lpage_writeback(lp, vmo, i);
+		if (result) {
+			lock_release(vmo->vmo_lock);
+			return result;
+		}
+	}
+	lock_release(vmo->vmo_lock);
+	return 0;
+}
+
+/*
+ * vm_object_destroy: Deallocates a vm_object.
+ *
+ * For a VMO_SHARED object this drops AS's reference, and only the last
+ * one deallocates it, after writing back changes to its file.
+ *
+ * Synchronization: none; assumes one thread uniquely owns the object,
+ * or for a shared object, that it's the last user.
+ */
 void 					
 vm_object_destroy(struct addrspace *as, struct vm_object *vmo)
 {
+	struct lpage *lp;
+	unsigned i;
 	int result;
 
+	if (vmo->vmo_flags & VMO_SHARED) {
+		lock_acquire(vmo->vmo_lock);
+		KASSERT(vmo->vmo_refcount > 0);
+		vmo->vmo_refcount--;
+		if (vmo->vmo_refcount > 0) {
+			/* others still use it; just forget our mappings */
+			for (i=0; i<lpage_array_num(vmo->vmo_lpages); i++) {
+				lp = lpage_array_get(vmo->vmo_lpages, i);
+				if (lp != NULL) {
+					lpage_unmap(lp);
+				}
+			}
+			lock_release(vmo->vmo_lock);
+			return;
+		}
+		lock_release(vmo->vmo_lock);
+
+		result = vm_object_writeback(vmo, 0,
+				lpage_array_num(vmo->vmo_lpages));
+		if (result) {
+			kprintf("vm: writing back shared mapping: %s\n",
+				strerror(result));
+		}
+		lock_destroy(vmo->vmo_lock);
+	}
+
 	result = vm_object_setsize(as, vmo, 0);
 	KASSERT(result==0);
+
+	/* after our own page references, so the cache's are the last */
+	if (vmo->vmo_textcache != NULL) {
+		textcache_detach(vmo->vmo_textcache);
+	}
+	if (vmo->vmo_vnode != NULL) {
+		vfs_close(vmo->vmo_vnode);
+	}
 	
 	lpage_array_destroy(vmo->vmo_lpages);
 	kfree(vmo);
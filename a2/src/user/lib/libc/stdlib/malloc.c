@@ -30,10 +30,22 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * Blocks are carved out of the heap, which is grown (and occasionally
+ * shrunk) with sbrk. Each block has a header giving the offsets to the
+ * blocks on either side, so adjacent free blocks can be merged in
+ * constant time.
+ *
+ * Free blocks are kept on doubly-linked lists ("bins") by size. Small
+ * sizes each get their own bin, so most requests are satisfied by
+ * taking the first block off the exact-size bin. Larger blocks are
+ * binned by power of two. A bitmap records which bins are nonempty so
+ * finding the next bin up that can satisfy a request doesn't mean
+ * looking at every bin.
+ *
+ * The heap is grown in chunks of at least MSBRKMIN bytes to keep the
+ * number of sbrk calls down. The kernel doesn't give the new pages
+ * memory until they're touched, so this is cheap. When the block at
+ * the top of the heap is free and large, it's given back.
  */
 
 #include <stdlib.h>
@@ -106,6 +118,15 @@ struct mheader {
 #endif
 };
 
+/*
+ * Free list links. These live in the data area of a free block, which
+ * is always at least MBLOCKSIZE bytes, so they always fit.
+ */
+struct mfree {
+	struct mfree *mf_next;
+	struct mfree *mf_prev;
+};
+
 /*
  * Operator macros on struct mheader.
  *
@@ -114,6 +135,7 @@ struct mheader {
  * 
  * M_DATA:		return data pointer of a header
  * M_SIZE:		return data size of a header
+ * M_HEADER:		return header of a free list entry
  *
  * M_OK:		true if the magic values are correct
  * 
@@ -128,17 +150,53 @@ struct mheader {
 
 #define M_DATA(mh)	((void *)((mh)+1))
 #define M_SIZE(mh)	(M_NEXTOFF(mh)-MBLOCKSIZE)
+#define M_HEADER(mf)	(((struct mheader *)(mf))-1)
 
 #define M_OK(mh)	((mh)->mh_magic1==MMAGIC && (mh)->mh_magic2==MMAGIC)
 
 #define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
 
+/*
+ * Bins.
+ *
+ * MSMALLBINS bins hold one size each: bin i holds blocks of exactly
+ * (i+1)*MBLOCKSIZE bytes, up to MSMALLMAX. Each bin after that holds
+ * blocks from one power of two up to the next, starting with sizes
+ * above MSMALLMAX.
+ *
+ * MBITS is the number of bits in a word of the bitmap.
+ */
+#define MSMALLBINS	64
+#define MSMALLSHIFT	(MBLOCKSHIFT + 6)	/* log2(MSMALLMAX) */
+#define MSMALLMAX	(MSMALLBINS * MBLOCKSIZE)
+#define MNBINS		(MSMALLBINS + sizeof(size_t)*8 - MSMALLSHIFT)
+#define MBITS		32
+#define MBITMAPWORDS	((MNBINS + MBITS - 1) / MBITS)
+
+/*
+ * Heap growth and shrinkage.
+ *
+ * MSBRKMIN is the smallest amount to grow the heap by at once.
+ * MTRIM is how big a free block at the top of the heap has to be
+ * before it's given back. It should be comfortably bigger than
+ * MSBRKMIN, or we'll just go back and forth.
+ */
+#define MSBRKMIN	(16*1024)
+#define MTRIM		(128*1024)
+
+/* The most sbrk can be asked for at once (it takes an int). */
+#define MSBRKMAX	((size_t)0x7fffffff)
+
 ////////////////////////////////////////////////////////////
 
 /*
- * Static variables - the bottom and top addresses of the heap.
+ * Static variables - the bottom and top addresses of the heap, the
+ * header of the highest block (NULL if there are none), and the bins.
  */
 static uintptr_t __heapbase, __heaptop;
+static struct mheader *__heaplast;
+static struct mfree *__bins[MNBINS];
+static uint32_t __binmap[MBITMAPWORDS];
 
 /*
  * Setup function.
@@ -161,6 +219,12 @@ __malloc_init(void)
 	if (1<<MBLOCKSHIFT != MBLOCKSIZE) {
 		errx(1, "malloc: Internal error - MBLOCKSHIFT wrong");
 	}
+	if (sizeof(struct mfree) > MBLOCKSIZE) {
+		errx(1, "malloc: Internal error - free list links too big");
+	}
+	if (1<<MSMALLSHIFT != MSMALLMAX) {
+		errx(1, "malloc: Internal error - MSMALLSHIFT wrong");
+	}
 
 	/* init should only be called once. */
 	if (__heapbase!=0 || __heaptop!=0) {
@@ -204,6 +268,112 @@ __malloc_init(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Return the bin for a free block of SIZE bytes (a multiple of
+ * MBLOCKSIZE).
+ */
+static
+unsigned
+__malloc_bin(size_t size)
+{
+	unsigned bin;
+
+	if (size <= MSMALLMAX) {
+		return size/MBLOCKSIZE - 1;
+	}
+	bin = MSMALLBINS;
+	for (size >>= MSMALLSHIFT; size > 1; size >>= 1) {
+		bin++;
+	}
+	return bin;
+}
+
+/*
+ * Put a free block on its bin.
+ */
+static
+void
+__malloc_binadd(struct mheader *mh)
+{
+	struct mfree *mf;
+	unsigned bin;
+
+	bin = __malloc_bin(M_SIZE(mh));
+	mf = M_DATA(mh);
+	mf->mf_prev = NULL;
+	mf->mf_next = __bins[bin];
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf;
+	}
+	__bins[bin] = mf;
+	__binmap[bin / MBITS] |= (uint32_t)1 << (bin % MBITS);
+}
+
+/*
+ * Take a free block off its bin.
+ */
+static
+void
+__malloc_binremove(struct mheader *mh)
+{
+	struct mfree *mf;
+	unsigned bin;
+
+	bin = __malloc_bin(M_SIZE(mh));
+	mf = M_DATA(mh);
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf->mf_prev;
+	}
+	if (mf->mf_prev != NULL) {
+		mf->mf_prev->mf_next = mf->mf_next;
+	}
+	else {
+		if (__bins[bin] != mf) {
+			errx(1, "malloc: Heap corrupt; free block at %p "
+			     "not on its bin", mh);
+		}
+		__bins[bin] = mf->mf_next;
+		if (__bins[bin] == NULL) {
+			__binmap[bin / MBITS] &=
+				~((uint32_t)1 << (bin % MBITS));
+		}
+	}
+}
+
+/*
+ * Find the first nonempty bin at or above BIN. Returns MNBINS if
+ * there isn't one.
+ */
+static
+unsigned
+__malloc_nextbin(unsigned bin)
+{
+	unsigned word;
+	uint32_t bits;
+
+	word = bin / MBITS;
+	if (word >= MBITMAPWORDS) {
+		return MNBINS;
+	}
+	bits = __binmap[word] & ~(((uint32_t)1 << (bin % MBITS)) - 1);
+	while (bits == 0) {
+		word++;
+		if (word >= MBITMAPWORDS) {
+			return MNBINS;
+		}
+		bits = __binmap[word];
+	}
+
+	bin = word * MBITS;
+	while ((bits & 1) == 0) {
+		bits >>= 1;
+		bin++;
+	}
+	return bin;
+}
+
+////////////////////////////////////////////////////////////
+
 #ifdef MALLOCDEBUG
 
 /*
@@ -246,6 +416,9 @@ __malloc_dump(void)
 	if (i!=__heaptop) {
 		errx(1, "malloc: Heap corrupt; ran off end");
 	}
+	if (__heaplast != NULL && M_NEXT(__heaplast) != (void *)__heaptop) {
+		errx(1, "malloc: Heap corrupt; wrong last block");
+	}
 
 	warnx("heap: ************************************************");
 }
@@ -264,6 +437,11 @@ __malloc_sbrk(size_t size)
 {
 	void *x;
 
+	if (size > MSBRKMAX) {
+		/* sbrk can't take it */
+		return NULL;
+	}
+
 	x = sbrk(size);
 	if (x == (void *)-1) {
 		return NULL;
@@ -279,10 +457,29 @@ __malloc_sbrk(size_t size)
 	return x;
 }
 
+/*
+ * Give back the (free, not binned) block at the top of the heap.
+ */
+static
+void
+__malloc_trim(struct mheader *mh)
+{
+	size_t size;
+
+	size = M_NEXTOFF(mh);
+	if (sbrk(-(int)size) == (void *)-1) {
+		/* oh well, keep it */
+		__malloc_binadd(mh);
+		return;
+	}
+	__heaptop -= size;
+	__heaplast = (mh == (struct mheader *)__heapbase) ? NULL : M_PREV(mh);
+}
+
 /*
  * Make a new (free) block from the block passed in, leaving size
  * bytes for data in the current block. size must be a multiple of
- * MBLOCKSIZE.
+ * MBLOCKSIZE. The new block goes on its bin.
  *
  * Only split if the excess space is at least twice the blocksize -
  * one blocksize to hold a header and one for data.
@@ -324,6 +521,94 @@ __malloc_split(struct mheader *mh, size_t size)
 	if (mhnext != (struct mheader *) __heaptop) {
 		mhnext->mh_prevblock = mhnew->mh_nextblock;
 	}
+	else {
+		__heaplast = mhnew;
+	}
+
+	__malloc_binadd(mhnew);
+}
+
+/*
+ * Find a free block with at least SIZE bytes of data and take it off
+ * its bin. Returns NULL if there isn't one.
+ */
+static
+struct mheader *
+__malloc_findfree(size_t size)
+{
+	struct mfree *mf;
+	unsigned bin;
+
+	bin = __malloc_bin(size);
+	if (bin >= MSMALLBINS) {
+		/*
+		 * This bin has a range of sizes; check all of them.
+		 * Everything in the bins above is big enough.
+		 */
+		for (mf = __bins[bin]; mf != NULL; mf = mf->mf_next) {
+			if (M_SIZE(M_HEADER(mf)) >= size) {
+				__malloc_binremove(M_HEADER(mf));
+				return M_HEADER(mf);
+			}
+		}
+		bin++;
+	}
+
+	bin = __malloc_nextbin(bin);
+	if (bin == MNBINS) {
+		return NULL;
+	}
+	mf = __bins[bin];
+	__malloc_binremove(M_HEADER(mf));
+	return M_HEADER(mf);
+}
+
+/*
+ * Grow the heap to make a free block with at least SIZE bytes of
+ * data. If the top block is free, it's extended; otherwise a new block
+ * is made. The block is not put on a bin. Returns NULL if we can't get
+ * the memory.
+ */
+static
+struct mheader *
+__malloc_grow(size_t size)
+{
+	struct mheader *mh;
+	size_t need, grow;
+
+	if (__heaplast != NULL && !__heaplast->mh_inuse) {
+		mh = __heaplast;
+		need = size - M_SIZE(mh);
+	}
+	else {
+		mh = NULL;
+		need = size + MBLOCKSIZE;
+	}
+
+	/* Get a decent chunk if we can, but make do with what we need. */
+	grow = need < MSBRKMIN ? MSBRKMIN : need;
+	if (__malloc_sbrk(grow) == NULL) {
+		if (grow == need || __malloc_sbrk(need) == NULL) {
+			return NULL;
+		}
+		grow = need;
+	}
+
+	if (mh != NULL) {
+		__malloc_binremove(mh);
+		mh->mh_nextblock = M_MKFIELD(M_NEXTOFF(mh) + grow);
+		return mh;
+	}
+
+	mh = (struct mheader *)(__heaptop - grow);
+	mh->mh_prevblock = __heaplast==NULL ? 0 : __heaplast->mh_nextblock;
+	mh->mh_magic1 = MMAGIC;
+	mh->mh_magic2 = MMAGIC;
+	mh->mh_pad = 0;
+	mh->mh_inuse = 0;
+	mh->mh_nextblock = M_MKFIELD(grow);
+	__heaplast = mh;
+	return mh;
 }
 
 /*
@@ -333,8 +618,6 @@ void *
 malloc(size_t size)
 {
 	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
 
 	if (__heapbase==0) {
 		__malloc_init();
@@ -351,74 +634,34 @@ malloc(size_t size)
 	__malloc_dump();
 #endif
 
+	/* Don't let rounding wrap around. */
+	if (size > MSBRKMAX) {
+		return NULL;
+	}
+
 	/* Round size up to an integral number of blocks. */
 	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	if (size == 0) {
+		/* we need room for the free list links later */
+		size = MBLOCKSIZE;
+	}
 
-	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
-	 */
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
-
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
+	mh = __malloc_findfree(size);
+	if (mh == NULL) {
+		/* Didn't find anything. Expand the heap. */
+		mh = __malloc_grow(size);
+		if (mh == NULL) {
+			return NULL;
 		}
-
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
-		/*
-		 * Now, allocate.
-		 */
-		mh->mh_inuse = 1;
-
-#ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
-#endif
-		return M_DATA(mh);
-	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
 	}
 
-	/*
-	 * Didn't find anything. Expand the heap.
-	 */
-
-	mh = __malloc_sbrk(size + MBLOCKSIZE);
-	if (mh == NULL) {
-		return NULL;
+	if (!M_OK(mh) || mh->mh_inuse) {
+		errx(1, "malloc: Heap corrupt; bad free block at %p", mh);
 	}
 
-	mh->mh_prevblock = rightprevblock;
-	mh->mh_magic1 = MMAGIC;
-	mh->mh_magic2 = MMAGIC;
-	mh->mh_pad = 0;
+	/* Split off what we don't need, and allocate. */
+	__malloc_split(mh, size);
 	mh->mh_inuse = 1;
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
 
 #ifdef MALLOCDEBUG
 	warnx("malloc: allocating at %p", M_DATA(mh));
@@ -429,6 +672,7 @@ malloc(size_t size)
 
 ////////////////////////////////////////////////////////////
 
+#ifdef MALLOCDEBUG
 /*
  * Clear a range of memory with 0xdeadbeef.
  * ptr must be suitably aligned.
@@ -443,13 +687,15 @@ __malloc_deadbeef(void *ptr, size_t size)
 		x[i] = 0xdeadbeef;
 	}
 }
+#endif
 
 /*
- * Attempt to merge two adjacent blocks (mh below mhnext).
+ * Merge two adjacent free blocks (mh below mhnext). Neither is on a
+ * bin.
  */
 static
 void
-__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
+__malloc_merge(struct mheader *mh, struct mheader *mhnext)
 {
 	struct mheader *mhnextnext;
 
@@ -457,10 +703,6 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
 		     mh, mhnext);
 	}
-	if (mh->mh_inuse || mhnext->mh_inuse) {
-		/* can't merge */
-		return;
-	}
 
 	mhnextnext = M_NEXT(mhnext);
 
@@ -470,9 +712,14 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	if (mhnextnext != (struct mheader *)__heaptop) {
 		mhnextnext->mh_prevblock = mh->mh_nextblock;
 	}
+	else {
+		__heaplast = mh;
+	}
 
+#ifdef MALLOCDEBUG
 	/* Deadbeef out the memory used by the now-obsolete header */
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
+#endif
 }
 
 /*
@@ -517,19 +764,33 @@ free(void *x)
 	/* mark it free */
 	mh->mh_inuse = 0;
 
+#ifdef MALLOCDEBUG
 	/* wipe it */
 	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+#endif
 
-	/* Try merging with the block above (but not if we're at the top) */
+	/* Merge with the block above if it's free (and there is one) */
 	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	if (mhnext != (struct mheader *)__heaptop && !mhnext->mh_inuse) {
+		__malloc_binremove(mhnext);
+		__malloc_merge(mh, mhnext);
 	}
 
-	/* Try merging with the block below (but not if we're at the bottom) */
+	/* Merge with the block below if it's free (and there is one) */
 	if (mh != (struct mheader *)__heapbase) {
 		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+		if (!mhprev->mh_inuse) {
+			__malloc_binremove(mhprev);
+			__malloc_merge(mhprev, mh);
+			mh = mhprev;
+		}
+	}
+
+	if (mh == __heaplast && M_SIZE(mh) >= MTRIM) {
+		__malloc_trim(mh);
+	}
+	else {
+		__malloc_binadd(mh);
 	}
 
 #ifdef MALLOCDEBUG
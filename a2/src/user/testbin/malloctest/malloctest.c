@@ -623,6 +623,73 @@ test7(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Test 8
+ *
+ * Times a long run of mallocs and frees of mostly small blocks, as
+ * made by allocation-heavy programs, and reports how many operations
+ * per second we got.
+ */
+
+#define T8_SLOTS  256
+#define T8_ITERS  500000
+
+static
+void
+test8(void)
+{
+	static const int sizes[8] = { 8, 16, 24, 40, 64, 100, 250, 3000 };
+
+	void *ptrs[T8_SLOTS];
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	unsigned long msecs;
+	int i, n;
+
+	printf("Beginning malloc test 8\n");
+
+	srandom(0);
+	for (i=0; i<T8_SLOTS; i++) {
+		ptrs[i] = NULL;
+	}
+
+	__time(&startsecs, &startnsecs);
+	for (i=0; i<T8_ITERS; i++) {
+		n = random()%T8_SLOTS;
+		if (ptrs[n] == NULL) {
+			ptrs[n] = malloc(sizes[random()%8]);
+			if (ptrs[n] == NULL) {
+				printf("FAILED: malloc failed\n");
+				break;
+			}
+		}
+		else {
+			free(ptrs[n]);
+			ptrs[n] = NULL;
+		}
+	}
+	__time(&endsecs, &endnsecs);
+
+	for (n=0; n<T8_SLOTS; n++) {
+		if (ptrs[n] != NULL) {
+			free(ptrs[n]);
+		}
+	}
+
+	msecs = (endsecs - startsecs) * 1000;
+	msecs += endnsecs / 1000000;
+	msecs -= startnsecs / 1000000;
+	if (msecs == 0) {
+		msecs = 1;
+	}
+
+	printf("%d operations in %lu ms (%lu per second)\n", i, msecs,
+	       (unsigned long)i * 1000 / msecs);
+	printf("Finished malloc test 8\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static struct {
 	int num;
 	const char *desc;
@@ -635,6 +702,7 @@ static struct {
 	{ 5, "Stress test", test5 },
 	{ 6, "Randomized stress test", test6 },
 	{ 7, "Stress test with particular seed", test7 },
+	{ 8, "Speed test", test8 },
 	{ -1, NULL, NULL }
 };
 
@@ -0,0 +1,254 @@
+/*
+ * mmaptest - test mmap, munmap, and msync.
+ * Usage: mmaptest [filename]
+ *
+ * Writes a few pages of data to a file (mmaptest.dat by default),
+ * maps it shared, checks what's there, changes it through the
+ * mapping, msyncs, and then reads the file back with read() to make
+ * sure the changes got there. Then checks that changes to a private
+ * mapping don't reach the file, that anonymous mappings come out
+ * zeroed, and that munmap only works once.
+ *
+ * The file is left behind, since emufs can't remove files.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE 4096
+#define NPAGES   4
+#define FILESIZE (NPAGES * PAGESIZE)
+
+static char buf[FILESIZE];
+
+/*
+ * The byte at offset I of the file, in generation GEN.
+ */
+static
+char
+pattern(unsigned i, unsigned gen)
+{
+	return (char)((i * 7 + i / PAGESIZE + gen * 13) & 0xff);
+}
+
+/*
+ * Check that P holds generation GEN of the file.
+ */
+static
+void
+check(const char *what, const char *p, unsigned gen)
+{
+	unsigned i;
+
+	for (i=0; i<FILESIZE; i++) {
+		if (p[i] != pattern(i, gen)) {
+			errx(1, "%s: wrong data at offset %u", what, i);
+		}
+	}
+}
+
+/*
+ * Write generation GEN of the file.
+ */
+static
+void
+writefile(const char *file, unsigned gen)
+{
+	unsigned i;
+	int fd, rv;
+
+	for (i=0; i<FILESIZE; i++) {
+		buf[i] = pattern(i, gen);
+	}
+
+	fd = open(file, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open for write", file);
+	}
+	rv = write(fd, buf, FILESIZE);
+	if (rv < 0) {
+		err(1, "%s: write", file);
+	}
+	if (rv != FILESIZE) {
+		errx(1, "%s: short write", file);
+	}
+	if (close(fd)) {
+		err(1, "%s: close", file);
+	}
+}
+
+/*
+ * Read the file back into buf and check it holds generation GEN.
+ */
+static
+void
+readfile(const char *file, unsigned gen)
+{
+	int fd, rv;
+
+	memset(buf, 0, FILESIZE);
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open for read", file);
+	}
+	rv = read(fd, buf, FILESIZE);
+	if (rv < 0) {
+		err(1, "%s: read", file);
+	}
+	if (rv != FILESIZE) {
+		errx(1, "%s: short read", file);
+	}
+	if (close(fd)) {
+		err(1, "%s: close", file);
+	}
+
+	check("read", buf, gen);
+}
+
+/*
+ * Map the file shared, change it through the mapping, msync, and
+ * make sure read() sees the change.
+ */
+static
+void
+test_shared(const char *file)
+{
+	char *p;
+	unsigned i;
+	int fd;
+
+	writefile(file, 0);
+
+	fd = open(file, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+	p = mmap(NULL, FILESIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap (shared)", file);
+	}
+	/* The mapping holds the file; it doesn't need the descriptor. */
+	if (close(fd)) {
+		err(1, "%s: close", file);
+	}
+
+	check("shared mapping", p, 0);
+
+	for (i=0; i<FILESIZE; i++) {
+		p[i] = pattern(i, 1);
+	}
+	if (msync(p, FILESIZE, MS_SYNC)) {
+		err(1, "msync");
+	}
+
+	readfile(file, 1);
+
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap (shared)");
+	}
+
+	printf("Shared mapping ok.\n");
+}
+
+/*
+ * Map the file private and make sure changes stay in the mapping.
+ */
+static
+void
+test_private(const char *file)
+{
+	char *p;
+	unsigned i;
+	int fd;
+
+	writefile(file, 2);
+
+	/* Read-only is enough; the changes never go back to the file. */
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", file);
+	}
+	p = mmap(NULL, FILESIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap (private)", file);
+	}
+	if (close(fd)) {
+		err(1, "%s: close", file);
+	}
+
+	check("private mapping", p, 2);
+
+	for (i=0; i<FILESIZE; i++) {
+		p[i] = pattern(i, 3);
+	}
+	if (msync(p, FILESIZE, MS_SYNC)) {
+		err(1, "msync");
+	}
+	check("private mapping", p, 3);
+
+	readfile(file, 2);
+
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap (private)");
+	}
+
+	printf("Private mapping ok.\n");
+}
+
+/*
+ * Anonymous mappings are zero-filled, and can only be unmapped once.
+ */
+static
+void
+test_anon(void)
+{
+	char *p;
+	unsigned i;
+
+	p = mmap(NULL, FILESIZE, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE,
+		 -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap (anon)");
+	}
+	for (i=0; i<FILESIZE; i++) {
+		if (p[i] != 0) {
+			errx(1, "anon mapping: nonzero byte at offset %u", i);
+		}
+		p[i] = pattern(i, 4);
+	}
+	check("anon mapping", p, 4);
+
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap (anon)");
+	}
+	if (munmap(p, FILESIZE) == 0) {
+		errx(1, "munmap of an unmapped range succeeded");
+	}
+
+	printf("Anonymous mapping ok.\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = "mmaptest.dat";
+
+	if (argc > 2) {
+		errx(1, "Usage: mmaptest [filename]");
+	}
+	if (argc == 2) {
+		file = argv[1];
+	}
+
+	test_shared(file);
+	test_private(file);
+	test_anon();
+
+	printf("Passed mmaptest.\n");
+	return 0;
+}
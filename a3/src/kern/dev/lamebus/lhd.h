@@ -31,12 +31,41 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <spinlock.h>
+#include <kern/iovec.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * A request for a run of contiguous sectors, to or from one or more
+ * kernel buffers (each a whole number of sectors). The hardware only
+ * does one sector at a time, so the interrupt handler moves the data
+ * for each sector and starts the next one itself; the thread that
+ * made the request only wakes up when the whole run is done.
+ *
+ * Requests that arrive while the disk is busy wait in a queue, and
+ * the interrupt handler starts the next one as soon as the previous
+ * one finishes. The queue is kept sorted by sector and served in
+ * C-LOOK order: the next request is the first one at or past the
+ * current head position, wrapping around to the lowest sector when
+ * there are none left ahead. A request that begins right where the
+ * previous one ended is thus picked next and costs no seek.
+ */
+struct lhd_request {
+	struct lhd_request *lr_next;	/* Next in queue */
+	uint32_t lr_sector;		/* Next sector to transfer */
+	uint32_t lr_nsect;		/* Number of sectors left */
+	struct iovec *lr_iov;		/* Buffer we're working on */
+	char *lr_buf;			/* Where the next sector's data goes */
+	size_t lr_bufleft;		/* Bytes left in *lr_iov */
+	bool lr_iswrite;		/* Write (otherwise read) */
+	bool lr_done;			/* Finished (successfully or not) */
+	int lr_result;			/* Error code if done */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +80,21 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the following */
+	struct lhd_request *lh_active;	/* Request in progress, or NULL */
+	struct lhd_request *lh_queue;	/* Waiting requests, by sector */
+	uint32_t lh_headpos;		/* Sector after the last one done */
+	struct wchan *lh_wchan;		/* For waiting for requests */
+	char *lh_wchanname;		/* Name of lh_wchan */
+
+	/* Statistics, also protected by lh_lock */
+	unsigned lh_depth;		/* Requests queued or active */
+	unsigned lh_maxdepth;		/* Most ever queued or active */
+	uint32_t lh_nreqs;		/* Requests completed */
+	uint32_t lh_nsects;		/* Sectors transferred */
+	uint32_t lh_nseqs;		/* Requests needing no seek */
+	uint64_t lh_totwait;		/* Total request latency (ns) */
+	uint32_t lh_maxwait;		/* Largest request latency (ns) */
 
 	struct device lh_dev;		/* VFS device structure */
 };
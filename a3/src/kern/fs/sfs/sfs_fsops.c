@@ -38,9 +38,11 @@
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
@@ -101,6 +103,50 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Write out the free block map and superblock if they're dirty, and
+ * then everything on the volume that's dirty in the buffer cache.
+ * Used by sfs_sync and sfs_unmount.
+ */
+static
+int
+sfs_sync_meta(struct sfs_fs *sfs)
+{
+	int result;
+
+	/* If the free block map needs to be written, write it. */
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_freemapdirty) {
+		result = sfs_mapio(sfs, UIO_WRITE);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		sfs->sfs_freemapdirty = false;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	/* If the superblock needs to be written, write it. */
+	if (sfs->sfs_superdirty) {
+		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+		if (result) {
+			return result;
+		}
+		sfs->sfs_superdirty = false;
+	}
+
+	/*
+	 * All of the above only went as far as the buffer cache.
+	 * Now write back everything that's dirty on this volume.
+	 */
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	return 0;
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -111,11 +157,8 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,35 +191,13 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
-	}
-
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		sfs->sfs_freemapdirty = false;
-	}
-
-	/* If the superblock needs to be written, write it. */
-	if (sfs->sfs_superdirty) {
-		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		sfs->sfs_superdirty = false;
+	/* Write out the loaded inodes that are dirty. */
+	result = sfs_sync_vnodes(sfs);
+	if (result) {
+		return result;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	return sfs_sync_meta(sfs);
 }
 
 /*
@@ -189,13 +210,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* The volume name doesn't change after mount; no lock needed. */
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -208,22 +225,50 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
 	vfs_biglock_acquire();
-	
+
+	/*
+	 * Hold sfs_vnlock from the check to the teardown, so no vnode
+	 * can be loaded or reclaimed in between.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
 
-	/* We should have just had sfs_sync called. */
+	/* With no vnodes loaded, none can be dirty. */
+	KASSERT(sfs->sfs_dirtyvnodes == NULL);
+
+	/*
+	 * We should have just had sfs_sync called, but a reclaim that
+	 * finished since then may have freed blocks. Write out
+	 * whatever it left dirty.
+	 */
+	result = sfs_sync_meta(sfs);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vfs_biglock_release();
+		return result;
+	}
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
 	bitmap_destroy(sfs->sfs_freemap);
+	lock_release(sfs->sfs_vnlock);
+	cv_destroy(sfs->sfs_vncv);
+	lock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_freemaplock);
+	spinlock_cleanup(&sfs->sfs_dirtylock);
+
+	/* Don't keep cached blocks around for a volume that's gone */
+	buffer_drop_device(sfs->sfs_device);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -254,6 +299,7 @@ static
 int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
+	unsigned i;
 	int result;
 	struct sfs_fs *sfs;
 
@@ -282,6 +328,16 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENXIO;
 	}
 
+	/* Set up the vnode cache the first time through */
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = kmem_cache_create("sfs_vnode",
+					sizeof(struct sfs_vnode), NULL);
+		if (sfs_vnode_cache == NULL) {
+			vfs_biglock_release();
+			return ENOMEM;
+		}
+	}
+
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
@@ -289,21 +345,23 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		kfree(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
+	/* No vnodes loaded yet */
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
 	}
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_dirtyvnodes = NULL;
 
 	/* Set the device so we can use sfs_rblock() */
 	sfs->sfs_device = dev;
 
-	/* Load superblock */
+	/*
+	 * Load superblock. From here on, failing has to drop whatever
+	 * blocks got into the buffer cache, as unmount does.
+	 */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buffer_drop_device(dev);
 		kfree(sfs);
 		vfs_biglock_release();
 		return result;
@@ -316,7 +374,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buffer_drop_device(dev);
 		kfree(sfs);
 		vfs_biglock_release();
 		return EINVAL;
@@ -333,7 +391,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buffer_drop_device(dev);
 		kfree(sfs);
 		vfs_biglock_release();
 		return ENOMEM;
@@ -341,12 +399,42 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buffer_drop_device(dev);
 		kfree(sfs);
 		vfs_biglock_release();
 		return result;
 	}
 
+	/* Set up the locks (see sfs.h) */
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		bitmap_destroy(sfs->sfs_freemap);
+		buffer_drop_device(dev);
+		kfree(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+	sfs->sfs_vncv = cv_create("sfs_vncv");
+	if (sfs->sfs_vncv == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+		bitmap_destroy(sfs->sfs_freemap);
+		buffer_drop_device(dev);
+		kfree(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		cv_destroy(sfs->sfs_vncv);
+		lock_destroy(sfs->sfs_vnlock);
+		bitmap_destroy(sfs->sfs_freemap);
+		buffer_drop_device(dev);
+		kfree(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+	spinlock_init(&sfs->sfs_dirtylock);
+
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
 	sfs->sfs_absfs.fs_getvolname = sfs_getvolname;
@@ -43,6 +43,7 @@
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* At bottom of file */
@@ -50,6 +51,12 @@ static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 static int sfs_getdirentry(struct vnode *v, struct uio *uio);
 
+/* With the vnode ops */
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+
+/* Storage for struct sfs_vnode; set up by sfs_domount */
+struct kmem_cache *sfs_vnode_cache;
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -59,16 +66,59 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *buf;
+	int result;
+
+	result = buffer_get(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(buf), SFS_BLOCKSIZE);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/*
+ * Mark an in-memory inode modified. The first time, this also puts it
+ * on the volume's list of dirty vnodes, so sfs_sync doesn't have to
+ * look at the clean ones.
+ *
+ * The caller must hold the vnode's lock exclusively.
+ */
+static
+void
+sfs_dirty_inode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
+	if (sv->sv_dirty) {
+		return;
+	}
+	sv->sv_dirty = true;
+
+	spinlock_acquire(&sfs->sfs_dirtylock);
+	sv->sv_dirtyprev = NULL;
+	sv->sv_dirtynext = sfs->sfs_dirtyvnodes;
+	if (sv->sv_dirtynext != NULL) {
+		sv->sv_dirtynext->sv_dirtyprev = sv;
+	}
+	sfs->sfs_dirtyvnodes = sv;
+	spinlock_release(&sfs->sfs_dirtylock);
+}
+
+/*
+ * Write an on-disk inode structure back out to disk, and take it off
+ * the dirty list. The caller must hold the vnode's lock exclusively.
+ */
 static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
@@ -76,10 +126,117 @@ sfs_sync_inode(struct sfs_vnode *sv)
 			return result;
 		}
 		sv->sv_dirty = false;
+
+		spinlock_acquire(&sfs->sfs_dirtylock);
+		if (sv->sv_dirtyprev != NULL) {
+			sv->sv_dirtyprev->sv_dirtynext = sv->sv_dirtynext;
+		}
+		else {
+			KASSERT(sfs->sfs_dirtyvnodes == sv);
+			sfs->sfs_dirtyvnodes = sv->sv_dirtynext;
+		}
+		if (sv->sv_dirtynext != NULL) {
+			sv->sv_dirtynext->sv_dirtyprev = sv->sv_dirtyprev;
+		}
+		sv->sv_dirtynext = sv->sv_dirtyprev = NULL;
+		spinlock_release(&sfs->sfs_dirtylock);
 	}
 	return 0;
 }
 
+/*
+ * Write back all the dirty inodes on a volume; called by sfs_sync.
+ *
+ * Each vnode is picked off the dirty list under sfs_vnlock, so it
+ * can't be reclaimed out from under us, and referenced so it stays
+ * around while we sleep on its lock. Vnodes dirtied again while
+ * we're at it go back on the list; rather than chase them forever
+ * we stop after about as many as there were loaded when we started.
+ */
+int
+sfs_sync_vnodes(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	unsigned count, max;
+	int result;
+
+	lock_acquire(sfs->sfs_vnlock);
+	max = sfs->sfs_nvnodes;
+	lock_release(sfs->sfs_vnlock);
+
+	for (count = 0; count <= max; count++) {
+		lock_acquire(sfs->sfs_vnlock);
+		while (1) {
+			spinlock_acquire(&sfs->sfs_dirtylock);
+			sv = sfs->sfs_dirtyvnodes;
+			spinlock_release(&sfs->sfs_dirtylock);
+			if (sv == NULL || !sv->sv_busy) {
+				break;
+			}
+			/* Being loaded or reclaimed; can't take a reference */
+			cv_wait(sfs->sfs_vncv, sfs->sfs_vnlock);
+		}
+		if (sv == NULL) {
+			lock_release(sfs->sfs_vnlock);
+			break;
+		}
+		VOP_INCREF(&sv->sv_v);
+		lock_release(sfs->sfs_vnlock);
+
+		rwlock_acquire_write(sv->sv_lock);
+		result = sfs_sync_inode(sv);
+		rwlock_release_write(sv->sv_lock);
+
+		VOP_DECREF(&sv->sv_v);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Take a vnode out of the table of loaded vnodes, and wake up anyone
+ * waiting for it to stop being busy. (They'll find it gone.) The
+ * caller must hold sfs_vnlock.
+ */
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (svp = &sfs->sfs_vnhash[sv->sv_ino % SFS_VNHASH_SIZE];
+	     *svp != sv; svp = &(*svp)->sv_hashnext) {
+		if (*svp == NULL) {
+			panic("sfs: vnode %u not in vnode pool\n",
+			      sv->sv_ino);
+		}
+	}
+	*svp = sv->sv_hashnext;
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+}
+
+/*
+ * Clear sv_busy on a vnode that's done loading, or that failed to be
+ * reclaimed and stays loaded, and wake up anyone waiting for it.
+ */
+static
+void
+sfs_unbusy(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	lock_acquire(sfs->sfs_vnlock);
+	KASSERT(sv->sv_busy);
+	sv->sv_busy = false;
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Space allocation
@@ -93,11 +250,14 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
@@ -108,14 +268,19 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 }
 
 /*
- * Free a block.
+ * Free a block. Any cached copy is thrown away rather than written
+ * back. (This has to happen before the block goes back in the map,
+ * or we might drop the buffer of whoever allocates it next.)
  */
 static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	buffer_drop(sfs->sfs_device, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -125,11 +290,18 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int result;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+
+	return result;
 }
 
 ////////////////////////////////////////////////////////////
@@ -137,89 +309,123 @@ sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 // Block mapping/inode maintenance
 
 /*
- * Look up the disk block number (from 0 up to the number of blocks on
- * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * Levels of indirect blocks. Level 1 is the indirect block, level 2
+ * the double indirect block, and level 3 the triple indirect block.
+ */
+#define SFS_NINDIRLEVELS 3
+
+/*
+ * Return a pointer to the inode's slot for its top-level indirect
+ * block of indirection LEVEL.
  */
 static
-int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
-	 uint32_t *diskblock)
+uint32_t *
+sfs_indirptr(struct sfs_vnode *sv, uint32_t level)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	switch (level) {
+	    case 1: return &sv->sv_i.sfi_indirect;
+	    case 2: return &sv->sv_i.sfi_dindirect;
+	    case 3: return &sv->sv_i.sfi_tindirect;
+	}
+	panic("sfs: indirptr: bad indirection level %u\n", level);
+	return NULL;
+}
 
-	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+/*
+ * Get entry IDOFF of the indirect block IDBLOCK. If DOALLOC is set and
+ * the entry is empty, allocate a block for it.
+ */
+static
+int
+sfs_indir_entry(struct sfs_fs *sfs, uint32_t idblock, uint32_t idoff,
+		int doalloc, uint32_t *ret)
+{
+	struct buf *idbuffer;
+	uint32_t *idbuf;
 	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
 	/*
-	 * If the block we want is one of the direct blocks...
+	 * Get the indirect block from the buffer cache. (If we just
+	 * allocated it, sfs_balloc left it there already zeroed.)
 	 */
-	if (fileblock < SFS_NDIRECT) {
-		/*
-		 * Get the block number
-		 */
-		block = sv->sv_i.sfi_direct[fileblock];
+	result = buffer_read(sfs->sfs_device, idblock, &idbuffer);
+	if (result) {
+		return result;
+	}
+	idbuf = buffer_map(idbuffer);
 
-		/*
-		 * Do we need to allocate?
-		 */
-		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
-			if (result) {
-				return result;
-			}
+	/* Get the block out of the indirect block buffer */
+	block = idbuf[idoff];
 
-			/* Remember what we allocated; mark inode dirty */
-			sv->sv_i.sfi_direct[fileblock] = block;
-			sv->sv_dirty = true;
+	/* If there's no block there, allocate one */
+	if (block==0 && doalloc) {
+		result = sfs_balloc(sfs, &block);
+		if (result) {
+			buffer_release(idbuffer);
+			return result;
 		}
 
-		/*
-		 * Hand back the block
-		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
-			panic("sfs: Data block %u (block %u of file %u) "
-			      "marked free\n", block, fileblock, sv->sv_ino);
-		}
-		*diskblock = block;
-		return 0;
+		/* Remember the block we allocated */
+		idbuf[idoff] = block;
+
+		/* The indirect block is now dirty */
+		buffer_mark_dirty(idbuffer);
 	}
+	buffer_release(idbuffer);
+
+	*ret = block;
+	return 0;
+}
+
+/*
+ * Look up (and if DOALLOC is set, allocate) block FILEBLOCK of a file
+ * by walking down from the inode through whichever of the indirect
+ * blocks covers it. FILEBLOCK must be past the direct blocks.
+ */
+static
+int
+sfs_bmap_indirect(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+		  uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t *idptr;
+	uint32_t block;
+	uint32_t idblock;
+	uint32_t idoff;
+	uint32_t origblock = fileblock;
+	uint32_t level, span;
+	int result;
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * Subtract off the number of direct blocks, and then the
+	 * number of blocks under each indirect block that we're past,
+	 * so FILEBLOCK becomes the offset into the space of the
+	 * indirect block it's under.
 	 */
-
+	KASSERT(fileblock >= SFS_NDIRECT);
 	fileblock -= SFS_NDIRECT;
 
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+	span = SFS_DBPERIDB;
+	for (level = 1; level <= SFS_NINDIRLEVELS; level++) {
+		if (fileblock < span) {
+			break;
+		}
+		fileblock -= span;
+		span *= SFS_DBPERIDB;
+	}
 
 	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * If the offset we were asked for is past what the triple
+	 * indirect block covers, we can't handle it, so fail.
 	 */
-	if (idnum > 0) {
+	if (level > SFS_NINDIRLEVELS) {
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	/* Get the disk block number of the top indirect block. */
+	idptr = sfs_indirptr(sv, level);
+	idblock = *idptr;
 
 	if (idblock==0 && !doalloc) {
 		/*
@@ -243,45 +449,122 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		}
 
 		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		*idptr = idblock;
 
 		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		sfs_dirty_inode(sv);
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
+
+	/*
+	 * Walk down the levels. SPAN is the number of file blocks
+	 * under the current indirect block; each of its entries
+	 * covers SPAN/SFS_DBPERIDB of them.
+	 */
+	while (1) {
+		span /= SFS_DBPERIDB;
+		idoff = fileblock / span;
+		fileblock %= span;
+
+		result = sfs_indir_entry(sfs, idblock, idoff, doalloc, &block);
 		if (result) {
 			return result;
 		}
+
+		if (level == 1) {
+			/* Remember the leaf for next time. */
+			spinlock_acquire(&sv->sv_leaflock);
+			sv->sv_leafbase = origblock - idoff;
+			sv->sv_leafblock = idblock;
+			spinlock_release(&sv->sv_leaflock);
+			break;
+		}
+		if (block == 0) {
+			break;
+		}
+		idblock = block;
+		level--;
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	*diskblock = block;
+	return 0;
+}
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+/*
+ * Look up the disk block number (from 0 up to the number of blocks on
+ * the disk) given a file and the logical block number within that
+ * file. If DOALLOC is set, and no such block exists, one will be
+ * allocated.
+ *
+ * The inode maps the first SFS_NDIRECT blocks directly; after that
+ * come SFS_DBPERIDB blocks under the indirect block, SFS_DBPERIDB^2
+ * under the double indirect block, and SFS_DBPERIDB^3 under the
+ * triple indirect block. The leaf indirect block used last is
+ * remembered in the vnode (sv_leafblock), so runs of lookups in the
+ * same area of the file take one indirect block read each instead of
+ * one per level.
+ *
+ * The caller must hold the vnode's lock, exclusively if DOALLOC is
+ * set. Since several readers can be in here at once, the leaf
+ * indirect block is read and updated under sv_leaflock.
+ */
+static
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	 uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t leafbase, leafblock;
+	uint32_t block;
+	int result;
+
+	COMPILE_ASSERT(SFS_DBPERIDB*sizeof(uint32_t) == SFS_BLOCKSIZE);
+
+	spinlock_acquire(&sv->sv_leaflock);
+	leafbase = sv->sv_leafbase;
+	leafblock = sv->sv_leafblock;
+	spinlock_release(&sv->sv_leaflock);
+
+	if (fileblock < SFS_NDIRECT) {
+		/*
+		 * It's one of the direct blocks. Get the block number.
+		 */
+		block = sv->sv_i.sfi_direct[fileblock];
+
+		/*
+		 * Do we need to allocate?
+		 */
+		if (block==0 && doalloc) {
+			result = sfs_balloc(sfs, &block);
+			if (result) {
+				return result;
+			}
+
+			/* Remember what we allocated; mark inode dirty */
+			sv->sv_i.sfi_direct[fileblock] = block;
+			sfs_dirty_inode(sv);
+		}
+	}
+	else if (leafblock != 0 && fileblock >= leafbase &&
+		 fileblock - leafbase < SFS_DBPERIDB) {
+		/*
+		 * It's under the leaf indirect block we used last.
+		 */
+		result = sfs_indir_entry(sfs, leafblock, fileblock - leafbase,
+					 doalloc, &block);
 		if (result) {
 			return result;
 		}
-
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
+	}
+	else {
+		result = sfs_bmap_indirect(sv, fileblock, doalloc, &block);
 		if (result) {
 			return result;
 		}
 	}
 
-	/* Hand back the result and return. */
+	/*
+	 * Hand back the block
+	 */
 	if (block != 0 && !sfs_bused(sfs, block)) {
 		panic("sfs: Data block %u (block %u of file %u) marked free\n",
 		      block, fileblock, sv->sv_ino);
@@ -309,16 +592,9 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuffer;
+	char *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -340,40 +616,33 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * It reads as zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sfs->sfs_device, diskblock, &iobuffer);
 	if (result) {
 		return result;
 	}
+	iobuf = buffer_map(iobuffer);
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * If it was a write, the buffer is dirty even if uiomove only
+	 * got partway.
 	 */
+	result = uiomove(iobuf+skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(iobuffer);
 	}
+	buffer_release(iobuffer);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -384,14 +653,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuffer;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -414,29 +680,26 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
+	 * Go through the buffer cache so the data can't be out of step
+	 * with a cached copy of the block. When writing, the whole block
+	 * gets overwritten, so there's no need to read it first.
 	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(sfs->sfs_device, diskblock, &iobuffer);
+	}
+	else {
+		result = buffer_get(sfs->sfs_device, diskblock, &iobuffer);
+	}
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = uiomove(buffer_map(iobuffer), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		buffer_mark_dirty(iobuffer);
+	}
+	buffer_release(iobuffer);
 
 	return result;
 }
@@ -563,14 +826,14 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	// If inode was altered, regardless of the lack of increase in file size
         // it is marked as dirty.
         if (uio->uio_rw == UIO_WRITE && inodealtered)
-            sv->sv_dirty = true;
+            sfs_dirty_inode(sv);
         /* If writing, adjust file length */
 	if (uio->uio_rw == UIO_WRITE && in_inode)
-		sv->sv_dirty = true;
+		sfs_dirty_inode(sv);
 	if (uio->uio_rw == UIO_WRITE && 
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
 		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+		sfs_dirty_inode(sv);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -739,6 +1002,8 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	int result;
 	struct sfs_dir sd;
 
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
 	if (result!=0 && result!=ENOENT) {
@@ -781,6 +1046,8 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_dir sd;
 
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
+
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
@@ -791,7 +1058,8 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 
 /*
  * Look for a name in a directory and hand back a vnode for the
- * file, if there is one.
+ * file, if there is one. The caller must hold the directory's lock
+ * (shared is enough).
  */
 static
 int
@@ -914,8 +1182,18 @@ static
 int
 sfs_lastclose(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	/*
+	 * Push the inode into the buffer cache. Unlike fsync, don't
+	 * force anything to disk; that waits for sfs_sync.
+	 */
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_sync_inode(sv);
+	rwlock_release_write(sv->sv_lock);
+
+	return result;
 }
 
 /*
@@ -929,31 +1207,45 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+
+	/*
+	 * Mark it busy, so sfs_loadvnode and sfs_sync_vnodes wait
+	 * instead of picking it up again, and do the I/O without
+	 * sfs_vnlock. Nobody else can get at the vnode now, so nobody
+	 * else holds or is waiting for its lock either.
+	 */
+	KASSERT(!sv->sv_busy);
+	sv->sv_busy = true;
+	lock_release(sfs->sfs_vnlock);
+
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_dotruncate(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			rwlock_release_write(sv->sv_lock);
+			sfs_unbusy(sfs, sv);
 			return result;
 		}
 	}
@@ -961,7 +1253,8 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
+		sfs_unbusy(sfs, sv);
 		return result;
 	}
 
@@ -970,29 +1263,23 @@ sfs_reclaim(struct vnode *v)
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
+	/* It was just synced, so it's not on the dirty list. */
+	KASSERT(!sv->sv_dirty);
+
+	rwlock_release_write(sv->sv_lock);
+
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_vnhash_remove(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
 
+	/* Nobody can find it now, so the rest can be done unlocked. */
+	rwlock_destroy(sv->sv_lock);
+	spinlock_cleanup(&sv->sv_leaflock);
 	VOP_CLEANUP(&sv->sv_v);
 
-	vfs_biglock_release();
-
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	kmem_cache_free(sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -1010,9 +1297,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	rwlock_acquire_read(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_read(sv->sv_lock);
 
 	return result;
 }
@@ -1029,9 +1316,9 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 
 	return result;
 }
@@ -1072,7 +1359,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	rwlock_acquire_read(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	rwlock_release_read(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1085,6 +1374,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 /*
  * Return the type of the file (types as per kern/stat.h)
+ *
+ * The type never changes once the vnode is loaded, so this doesn't
+ * need the vnode's lock.
  */
 static
 int
@@ -1092,16 +1384,12 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1139,69 +1427,156 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
+	if (result) {
+		return result;
+	}
 
-	return result;
+	/*
+	 * The buffer cache doesn't know which blocks belong to which
+	 * file, so flush everything on the volume. It does its own
+	 * locking, so we don't hold the vnode locked while waiting.
+	 */
+	return buffer_sync(sfs->sfs_device);
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Plain files can always be mapped; the VM system
+ * pages them in and out with sfs_read and sfs_write, which go through
+ * the buffer cache like any other I/O.
  */
 static
 int
 sfs_mmap(struct vnode *v   /* add stuff as needed */)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Discard the blocks at or past file block BLOCKLEN that are under the
+ * indirect block IDBLOCK. IDBLOCK is at indirection LEVEL and its first
+ * entry maps file block BASEBLOCK. Sets *ISEMPTY if nothing is left
+ * in the indirect block afterwards, in which case the caller should
+ * free it.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_truncate_indirect(struct sfs_fs *sfs, uint32_t idblock, uint32_t level,
+		      uint32_t baseblock, uint32_t blocklen, bool *isempty)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuffer;
+	uint32_t *idbuf;
+	uint32_t j, span, entrybase;
+	bool hasnonzero, iddirty, childempty;
+	int result;
 
-	struct sfs_vnode *sv = v->vn_data;
+	/* Number of file blocks each entry covers */
+	span = 1;
+	for (j=1; j<level; j++) {
+		span *= SFS_DBPERIDB;
+	}
+
+	/* Get the indirect block */
+	result = buffer_read(sfs->sfs_device, idblock, &idbuffer);
+	if (result) {
+		return result;
+	}
+	idbuf = buffer_map(idbuffer);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		entrybase = baseblock + j*span;
+		if (idbuf[j] != 0 && entrybase + span > blocklen) {
+			if (level == 1) {
+				/* It's a data block past the new EOF */
+				childempty = true;
+			}
+			else {
+				result = sfs_truncate_indirect(sfs, idbuf[j],
+							       level-1,
+							       entrybase,
+							       blocklen,
+							       &childempty);
+				if (result) {
+					if (iddirty) {
+						buffer_mark_dirty(idbuffer);
+					}
+					buffer_release(idbuffer);
+					return result;
+				}
+			}
+			if (childempty) {
+				sfs_bfree(sfs, idbuf[j]);
+				idbuf[j] = 0;
+				iddirty = true;
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (iddirty) {
+		buffer_mark_dirty(idbuffer);
+	}
+	buffer_release(idbuffer);
+
+	*isempty = !hasnonzero;
+	return 0;
+}
+
+/*
+ * Truncate a file; used by sfs_truncate and sfs_reclaim. The caller
+ * must hold the vnode's lock exclusively.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
-	/* Length in blocks (divide rounding up) */
-	//original: uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
-	uint32_t blocklen = DIVROUNDUP(len - SFS_INLINED_BYTES, SFS_BLOCKSIZE);
+	/*
+	 * Length in blocks (divide rounding up). The first
+	 * SFS_INLINED_BYTES of the file live in the inode.
+	 */
+	uint32_t blocklen;
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	uint32_t i, block, level;
+	uint32_t *idptr;
+	uint32_t baseblock, span;
+	bool isempty;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
 
-	vfs_biglock_acquire();
+	KASSERT(rwlock_do_i_hold_write(sv->sv_lock));
 
-	// Loop through inline bytes and set all bytes after len to 0. Mark it as dirty.
-	if (len < SFS_INLINED_BYTES) {
-	 	blocklen = DIVROUNDUP(0, SFS_BLOCKSIZE);
-	 	for (i=SFS_INLINED_BYTES; i > len; i--) {
-	 		sv->sv_i.sfi_inlinedata[i] = 0;
-	 	}
-	 	if (len == 0)
-	 		sv->sv_i.sfi_inlinedata[0] = 0;
-	 	sv->sv_dirty = true;
+	if (len > SFS_INLINED_BYTES) {
+		blocklen = DIVROUNDUP(len - SFS_INLINED_BYTES, SFS_BLOCKSIZE);
+	}
+	else {
+		/* Zero the inline bytes past len. */
+		blocklen = 0;
+		for (i=len; i<SFS_INLINED_BYTES; i++) {
+			sv->sv_i.sfi_inlinedata[i] = 0;
+		}
+		sfs_dirty_inode(sv);
 	}
 
+	/*
+	 * The leaf indirect block sfs_bmap remembers might be about
+	 * to go away.
+	 */
+	spinlock_acquire(&sv->sv_leaflock);
+	sv->sv_leafblock = 0;
+	spinlock_release(&sv->sv_leaflock);
+
 	/*
 	 * Go through the direct blocks. Discard any that are
 	 * past the limit we're truncating to.
@@ -1211,70 +1586,64 @@ sfs_truncate(struct vnode *v, off_t len)
 		if (i >= blocklen && block != 0) {
 			sfs_bfree(sfs, block);
 			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
+			sfs_dirty_inode(sv);
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/*
+	 * Now the indirect, double indirect and triple indirect
+	 * blocks, each of which covers SPAN blocks starting at
+	 * BASEBLOCK.
+	 */
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
+	span = SFS_DBPERIDB;
+	for (level=1; level<=SFS_NINDIRLEVELS; level++) {
+		idptr = sfs_indirptr(sv, level);
+		if (*idptr != 0 && baseblock + span > blocklen) {
+			/* We're past the proposed EOF; may need to free stuff */
+			result = sfs_truncate_indirect(sfs, *idptr, level,
+						       baseblock, blocklen,
+						       &isempty);
 			if (result) {
-				vfs_biglock_release();
 				return result;
 			}
+			if (isempty) {
+				/* The whole indirect block is empty now; free it */
+				sfs_bfree(sfs, *idptr);
+				*idptr = 0;
+				sfs_dirty_inode(sv);
+			}
 		}
+		baseblock += span;
+		span *= SFS_DBPERIDB;
 	}
 
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
 	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	sfs_dirty_inode(sv);
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	rwlock_release_write(sv->sv_lock);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1310,37 +1679,36 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return EEXIST;
 	}
 
 	if (result==0) {
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		rwlock_release_write(sv->sv_lock);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -1350,20 +1718,22 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		rwlock_release_write(sv->sv_lock);
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	rwlock_acquire_write(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
-	newguy->sv_dirty = true;
+	sfs_dirty_inode(newguy);
+	rwlock_release_write(newguy->sv_lock);
+
+	rwlock_release_write(sv->sv_lock);
 
 	*ret = &newguy->sv_v;
-	
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1382,20 +1752,30 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
-	/* and update the link count, marking the inode dirty */
+	/*
+	 * and update the link count, marking the inode dirty. (If
+	 * someone links the directory into itself, we already hold
+	 * its lock.)
+	 */
+	if (f != sv) {
+		rwlock_acquire_write(f->sv_lock);
+	}
 	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
+	sfs_dirty_inode(f);
+	if (f != sv) {
+		rwlock_release_write(f->sv_lock);
+	}
 
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return 0;
 }
 
@@ -1411,12 +1791,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -1424,18 +1804,64 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		if (victim != sv) {
+			rwlock_acquire_write(victim->sv_lock);
+		}
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
-		victim->sv_dirty = true;
+		sfs_dirty_inode(victim);
+		if (victim != sv) {
+			rwlock_release_write(victim->sv_lock);
+		}
 	}
 
-	/* Discard the reference that sfs_lookonce got us */
+	rwlock_release_write(sv->sv_lock);
+
+	/*
+	 * Discard the reference that sfs_lookonce got us. This may
+	 * reclaim the file, so do it without the directory locked.
+	 */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
+/*
+ * Lock the two directories involved in a rename. To avoid deadlock
+ * with a rename going the other way, they're always taken in order
+ * of inode number; if they're the same directory it's only locked
+ * once.
+ */
+static
+void
+sfs_lock_dirpair(struct sfs_vnode *a, struct sfs_vnode *b)
+{
+	if (a == b) {
+		rwlock_acquire_write(a->sv_lock);
+	}
+	else if (a->sv_ino < b->sv_ino) {
+		rwlock_acquire_write(a->sv_lock);
+		rwlock_acquire_write(b->sv_lock);
+	}
+	else {
+		rwlock_acquire_write(b->sv_lock);
+		rwlock_acquire_write(a->sv_lock);
+	}
+}
+
+/*
+ * Unlock the directories locked by sfs_lock_dirpair.
+ */
+static
+void
+sfs_unlock_dirpair(struct sfs_vnode *a, struct sfs_vnode *b)
+{
+	rwlock_release_write(a->sv_lock);
+	if (a != b) {
+		rwlock_release_write(b->sv_lock);
+	}
+}
+
 /*
  * Rename a file.
  *
@@ -1448,25 +1874,29 @@ sfs_rename(struct vnode *d1, const char *n1,
 	   struct vnode *d2, const char *n2)
 {
 	struct sfs_vnode *sv = d1->vn_data;
+	struct sfs_vnode *sv2 = d2->vn_data;
 	struct sfs_vnode *g1;
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	sfs_lock_dirpair(sv, sv2);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		sfs_unlock_dirpair(sv, sv2);
 		return result;
 	}
 
 	/* We don't support subdirectories */
 	KASSERT(g1->sv_i.sfi_type == SFS_TYPE_FILE);
 
+	/* The file is locked after the directories. */
+	rwlock_acquire_write(g1->sv_lock);
+
 	/*
 	 * Link it under the new name.
 	 *
@@ -1482,7 +1912,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	
 	/* Increment the link count, and mark inode dirty */
 	g1->sv_i.sfi_linkcount++;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1496,12 +1926,14 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 */
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
-	g1->sv_dirty = true;
+	sfs_dirty_inode(g1);
+
+	rwlock_release_write(g1->sv_lock);
+	sfs_unlock_dirpair(sv, sv2);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -1517,9 +1949,11 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	g1->sv_i.sfi_linkcount--;
  puke:
+	rwlock_release_write(g1->sv_lock);
+	sfs_unlock_dirpair(sv, sv2);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1537,15 +1971,12 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type doesn't change, so no lock is needed. */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1553,7 +1984,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1571,22 +2001,20 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 	
+	/* Lookups only read the directory, so they can run in parallel. */
+	rwlock_acquire_read(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	rwlock_release_read(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1702,33 +2130,40 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
+	unsigned bucket;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
-		}
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	bucket = ino % SFS_VNHASH_SIZE;
+ again:
+	for (sv = sfs->sfs_vnhash[bucket]; sv != NULL; sv = sv->sv_hashnext) {
 		if (sv->sv_ino==ino) {
 			/* Found */
 
+			/*
+			 * If it's being loaded or reclaimed, wait until
+			 * that's done (or failed) and look again.
+			 */
+			if (sv->sv_busy) {
+				cv_wait(sfs->sfs_vncv, sfs->sfs_vnlock);
+				goto again;
+			}
+
+			/* Every inode in memory must be in an allocated block */
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: Found inode %u in unallocated "
+				      "block\n", sv->sv_ino);
+			}
+
 			/* May only be set when creating new objects */
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
 			VOP_INCREF(&sv->sv_v);
+			lock_release(sfs->sfs_vnlock);
 			*ret = sv;
 			return 0;
 		}
@@ -1736,8 +2171,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = kmem_cache_alloc(sfs_vnode_cache);
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1747,15 +2183,37 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      ino);
 	}
 
+	/*
+	 * Put it in the table, marked busy, so anyone else looking for
+	 * it waits while we read it in without sfs_vnlock.
+	 */
+	sv->sv_ino = ino;
+	sv->sv_busy = true;
+	sv->sv_hashnext = sfs->sfs_vnhash[bucket];
+	sfs->sfs_vnhash[bucket] = sv;
+	sfs->sfs_nvnodes++;
+	lock_release(sfs->sfs_vnlock);
+
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
-		return result;
+		goto fail;
+	}
+
+	sv->sv_lock = rwlock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		result = ENOMEM;
+		goto fail;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
+	sv->sv_dirtynext = sv->sv_dirtyprev = NULL;
+
+	/* No indirect block looked up yet */
+	spinlock_init(&sv->sv_leaflock);
+	sv->sv_leafbase = 0;
+	sv->sv_leafblock = 0;
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
@@ -1765,7 +2223,6 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
-		sv->sv_dirty = true;
 	}
 
 	/*
@@ -1787,24 +2244,34 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
-		return result;
+		spinlock_cleanup(&sv->sv_leaflock);
+		rwlock_destroy(sv->sv_lock);
+		goto fail;
 	}
 
-	/* Set the other fields in our vnode structure */
-	sv->sv_ino = ino;
-
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
+	/*
+	 * If it's a new object, the type we set needs writing out.
+	 * Nobody else has the vnode yet, so its lock is uncontended.
+	 */
+	if (forcetype != SFS_TYPE_INVAL) {
+		rwlock_acquire_write(sv->sv_lock);
+		sfs_dirty_inode(sv);
+		rwlock_release_write(sv->sv_lock);
 	}
 
+	/* Let everyone else at it */
+	sfs_unbusy(sfs, sv);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
+
+ fail:
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_vnhash_remove(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
+	kmem_cache_free(sfs_vnode_cache, sv);
+	return result;
 }
 
 /*
@@ -1818,15 +2285,11 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
 
@@ -1844,22 +2307,30 @@ sfs_getdirentry(struct vnode *v, struct uio *uio)
 	if(sv->sv_i.sfi_type != SFS_TYPE_DIR)
 		return ENOTDIR;
 
+	/* Readers of the directory can share it. */
+	rwlock_acquire_read(sv->sv_lock);
+
 	int numentries = sfs_dir_nentries(sv);
 
 	int error;
 	int slot = (int)uio->uio_offset / (int)(sizeof(struct sfs_dir));
 	for (;;slot ++) {
 	    /* Check to see if slot requested is out of range */
-	    if(slot >= numentries)
+	    if(slot >= numentries) {
+		rwlock_release_read(sv->sv_lock);
 	    	return 0;
+	    }
 		/* Try to read it. */
 	    error = sfs_readdir(sv, &dir, slot);
-	    if(error)
+	    if(error) {
+		rwlock_release_read(sv->sv_lock);
 	    	return error;
+	    }
 
 	    if(dir.sfd_ino != SFS_NOINO)
 	    	break;
 	}
+	rwlock_release_read(sv->sv_lock);
 
   	error = uiomove(dir.sfd_name, SFS_NAMELEN, uio);
   	if(error)
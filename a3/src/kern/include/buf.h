@@ -0,0 +1,78 @@
+/*
+ * Declarations for the disk buffer cache.
+ */
+
+#ifndef _BUF_H_
+#define _BUF_H_
+
+struct device;
+struct buf;  /* Opaque. */
+
+/*
+ * Size of a cached block. Every device that goes through the buffer
+ * cache must have this block size. (SFS_BLOCKSIZE is the same value.)
+ */
+#define BUFFER_SIZE	512
+
+/*
+ * Buffer cache.
+ *
+ * Buffers are keyed by (device, block number) and hashed on that
+ * pair. A buffer handed out by buffer_read or buffer_get is marked
+ * busy and belongs to the caller until buffer_release; nobody else
+ * can see it in the meantime. Released buffers go on an LRU list and
+ * the least recently used one is recycled when the cache is full.
+ *
+ * Writes are delayed: buffer_mark_dirty only marks the buffer, and
+ * the data goes to disk when the buffer is recycled or when
+ * buffer_sync is called for its device.
+ *
+ * Functions:
+ *     buffer_bootstrap   - initialize the buffer cache at boot.
+ *     buffer_read        - get a busy buffer for a block, reading it
+ *                          from disk if it isn't already cached.
+ *     buffer_get         - get a busy buffer for a block that is about
+ *                          to be completely overwritten; does no I/O.
+ *                          If the block wasn't cached the buffer is
+ *                          zero-filled.
+ *     buffer_map         - return a pointer to the buffer's data.
+ *     buffer_mark_dirty  - note that the buffer's data was modified.
+ *     buffer_release     - give up a busy buffer.
+ *     buffer_drop        - discard any cached copy of a block, without
+ *                          writing it back. For blocks being freed.
+ *     buffer_sync        - write back all dirty buffers for a device.
+ *     buffer_drop_device - discard all (clean) buffers for a device,
+ *                          as at unmount time.
+ *     buffer_printstats  - print cache counters.
+ *     buffer_getstats    - copy out the cache counters (for tests).
+ */
+
+void buffer_bootstrap(void);
+
+int   buffer_read(struct device *dev, uint32_t block, struct buf **ret);
+int   buffer_get(struct device *dev, uint32_t block, struct buf **ret);
+void *buffer_map(struct buf *b);
+void  buffer_mark_dirty(struct buf *b);
+void  buffer_release(struct buf *b);
+
+void buffer_drop(struct device *dev, uint32_t block);
+int  buffer_sync(struct device *dev);
+void buffer_drop_device(struct device *dev);
+
+void buffer_printstats(void);
+
+/* Cache counters, as handed back by buffer_getstats. */
+struct bufstats {
+	unsigned bs_bufs;		/* buffers allocated */
+	unsigned bs_maxbufs;		/* max buffers to allocate */
+	uint32_t bs_hits;		/* lookups that found the block */
+	uint32_t bs_misses;		/* lookups that didn't */
+	uint32_t bs_reads;		/* disk reads */
+	uint32_t bs_writes;		/* disk writes */
+	uint32_t bs_recycles;		/* buffers taken from other blocks */
+};
+
+void buffer_getstats(struct bufstats *bs);
+
+
+#endif /* _BUF_H_ */
@@ -60,6 +60,7 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_lastboost;		/* c_hardclocks at last priority boost */
 	struct cpu_vm_machdep c_vm;	/* Machine-dependent VM bits */
 
 	/*
@@ -70,6 +71,12 @@ struct cpu {
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Read by other cpus without locking, as a hint only.
+	 * Written under the runqueue lock.
+	 */
+	volatile unsigned c_loadhint;	/* Number of threads in c_runqueue */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -40,12 +40,14 @@ struct uio;  /* in <uio.h> */
 /*
  * Filesystem-namespace-accessible device.
  * d_io is for both reads and writes; the uio indicates the direction.
+ * d_printstats, if not NULL, prints usage statistics for the device.
  */
 struct device {
 	int (*d_open)(struct device *, int flags_from_open);
 	int (*d_close)(struct device *);
 	int (*d_io)(struct device *, struct uio *);
 	int (*d_ioctl)(struct device *, int op, userptr_t data);
+	void (*d_printstats)(struct device *);
 
 	blkcnt_t d_blocks;
 	blksize_t d_blocksize;
@@ -39,8 +39,10 @@
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
 #define SFS_BLOCKSIZE     512           /* size of our blocks */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
-#define SFS_NDIRECT       12            /* # of direct blocks in inode */
+#define SFS_NDIRECT       10            /* # of direct blocks in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define HAS_DIDIRECT                    /* inode has a double indirect blk */
+#define HAS_TIDIRECT                    /* inode has a triple indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SB_LOCATION    0            /* block the superblock lives in */
 #define SFS_ROOT_LOCATION  1            /* loc'n of the root dir inode */
@@ -93,6 +95,8 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
 	char sfi_inlinedata[SFS_INLINED_BYTES];
 	uint32_t sfi_waste[1];	/* unused space, set to 0 */
 	
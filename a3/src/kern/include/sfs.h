@@ -48,11 +48,26 @@
  */
 #include <kern/sfs.h>
 
+struct lock;
+struct rwlock;
+struct cv;
+
+/* Number of buckets in the hash table of loaded vnodes */
+#define SFS_VNHASH_SIZE 256
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
+	bool sv_busy;                   /* being loaded or reclaimed */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_vnode *sv_hashnext;  /* next in sfs_vnhash bucket */
+	struct sfs_vnode *sv_dirtynext; /* next on sfs_dirtyvnodes */
+	struct sfs_vnode *sv_dirtyprev; /* previous on sfs_dirtyvnodes */
+	uint32_t sv_leafbase;           /* 1st file block of sv_leafblock */
+	uint32_t sv_leafblock;          /* last indirect blk used by bmap */
+	struct rwlock *sv_lock;         /* protects sv_i, sv_dirty, contents */
+	struct spinlock sv_leaflock;    /* protects sv_leafbase/sv_leafblock */
 };
 
 struct sfs_fs {
@@ -60,11 +75,43 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	/* vnodes loaded into memory, hashed by inode number */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH_SIZE];
+	unsigned sfs_nvnodes;           /* number of vnodes loaded */
+	struct sfs_vnode *sfs_dirtyvnodes; /* loaded vnodes with sv_dirty */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct lock *sfs_vnlock;        /* protects sfs_vnhash, sfs_nvnodes */
+	struct cv *sfs_vncv;            /* for waiting on sv_busy vnodes */
+	struct spinlock sfs_dirtylock;  /* protects sfs_dirtyvnodes list */
+	struct lock *sfs_freemaplock;   /* protects sfs_freemap(dirty) */
 };
 
+/*
+ * Locking.
+ *
+ * Each vnode's sv_lock covers its inode and the file or directory
+ * contents. Reads, lookups, and stat take it shared; anything that
+ * changes the inode or the contents takes it exclusive. Because
+ * shared holders may still move the bmap's cached indirect block
+ * along, that cache has its own spinlock.
+ *
+ * The lock order is:
+ *    directory sv_locks (two at once in increasing inode number order)
+ *    file sv_locks
+ *    sfs_vnlock
+ *    sfs_freemaplock
+ *    the buffer cache
+ * with sv_leaflock, sfs_dirtylock, and vn_countlock as leaves.
+ *
+ * sfs_vnlock also protects each vnode's sv_busy flag. A vnode being
+ * loaded or reclaimed sits in sfs_vnhash (and counts in sfs_nvnodes)
+ * with sv_busy set while the disk I/O is done without sfs_vnlock.
+ * Anyone who finds a busy vnode, by hash or on the dirty list, waits
+ * on sfs_vncv and looks again. Since nobody else can get a reference
+ * to a busy vnode, the loader or reclaimer has it to itself.
+ */
+
 /*
  * Function for mounting a sfs (calls vfs_mount)
  */
@@ -75,15 +122,16 @@ int sfs_mount(const char *device);
  * Internal functions
  */
 
-/* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
-
-/* Convenience functions for block I/O */
-int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
+/* Convenience functions for block I/O (through the buffer cache) */
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/* Write all dirty inodes back to disk (through the buffer cache) */
+int sfs_sync_vnodes(struct sfs_fs *sfs);
+
+/* Object cache for struct sfs_vnode (made at the first mount) */
+extern struct kmem_cache *sfs_vnode_cache;
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
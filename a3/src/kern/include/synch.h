@@ -71,12 +71,19 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * The lock is adaptive: a thread that finds it held spins for a while
+ * if the holder is running on another cpu, and sleeps otherwise. When
+ * a thread is sleeping, lock_release hands the lock straight to it
+ * (lk_handoff) rather than letting it race other threads for it.
  */
 struct lock {
         char *lk_name;
 	struct wchan *lk_wchan;
 	struct spinlock lk_lock;
 	struct thread *volatile lk_holder;
+	unsigned lk_nsleepers;		/* threads asleep on lk_wchan */
+	bool lk_handoff;		/* reserved for a thread being woken */
 };
 
 struct lock *lock_create(const char *name);
@@ -138,4 +145,68 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of threads can hold the lock for reading at once, or one
+ * thread for writing. Writers are preferred: once a writer is waiting,
+ * new readers wait behind it, so a steady stream of readers can't
+ * starve writers out. (Readers can be starved instead; the lock is
+ * meant for things that are read much more often than written.)
+ *
+ * Read holds are not recursive: a thread that already holds the lock
+ * for reading and asks for it again can deadlock behind a waiting
+ * writer.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+	char *rw_name;
+	struct wchan *rw_rwchan;	/* readers wait here */
+	struct wchan *rw_wwchan;	/* writers wait here */
+	struct wchan *rw_uwchan;	/* an upgrading reader waits here */
+	struct spinlock rw_lock;
+	unsigned rw_readers;		/* number of read holders */
+	struct thread *rw_writer;	/* write holder, if any */
+	unsigned rw_writerswaiting;	/* writers waiting to get in */
+	bool rw_upgrading;		/* a reader is waiting to upgrade */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read   - Get the lock for reading.
+ *    rwlock_release_read   - Release a read hold.
+ *    rwlock_acquire_write  - Get the lock for writing.
+ *    rwlock_release_write  - Release a write hold.
+ *    rwlock_upgrade        - Turn our read hold into a write hold, once
+ *                            the other readers have left. Only one
+ *                            reader can be upgrading at a time; if
+ *                            another already is, fails and returns
+ *                            false, still holding the lock for
+ *                            reading. The caller should then release
+ *                            it, acquire it for writing, and recheck
+ *                            whatever it looked at.
+ *    rwlock_downgrade      - Turn our write hold into a read hold,
+ *                            without letting any writer in between.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                            the lock for writing.
+ *    rwlock_is_held        - Return true if anyone holds the lock in
+ *                            either mode. (Read holders aren't
+ *                            tracked, so this is the best assertion
+ *                            available for them.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_upgrade(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+bool rwlock_is_held(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
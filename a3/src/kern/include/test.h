@@ -58,6 +58,7 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int rwtest(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -67,6 +68,8 @@ int writestress2(int, char **);
 int longstress(int, char **);
 int printfile(int, char **);
 int inlinetest(int, char **);
+int indirtest(int, char **);
+int buftest(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
@@ -87,6 +87,8 @@ struct thread {
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
+	unsigned t_priority;		/* Scheduling level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
 
 	/*
 	 * Interrupt state fields.
@@ -164,6 +166,19 @@ void thread_exit(int status);
  */
 void thread_yield(void);
 
+/*
+ * Return true if thread T is running on some cpu right now. This is
+ * only a hint, as it can change at any moment. T is only compared
+ * against, never dereferenced, so it may be a thread that has exited.
+ */
+bool thread_isrunning(const struct thread *t);
+
+/*
+ * Charge a hardclock to the current thread and yield if its time
+ * slice is used up. Called from the timer interrupt.
+ */
+void thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
@@ -101,6 +101,7 @@ struct lpage {
 /*
  * Functions in lpage.c
  *
+ *    lpage_bootstrap - set up lpage storage at boot.
  *    lpage_create - create a blank, non-materialized lpage structure.
  *    lpage_destroy - destroy an lpage
  *    lpage_lock/unlock - for exclusive access to an lpage
@@ -111,6 +112,7 @@ struct lpage {
  *    lpage_fault - handle a fault on an lpage
  *    lpage_evict - evict an lpage
  */
+void              lpage_bootstrap(void);
 struct lpage     *lpage_create(void);
 void              lpage_destroy(struct lpage *lp);
 void              lpage_lock(struct lpage *lp);
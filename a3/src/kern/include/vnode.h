@@ -30,6 +30,7 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
 struct stat;
@@ -50,10 +51,15 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * vn_countlock protects vn_refcount and vn_opencount. It is a
+ * spinlock so reference counting doesn't need any filesystem lock;
+ * VOP_RECLAIM and VOP_LASTCLOSE are called with no locks held.
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
+	struct spinlock vn_countlock;   /* Lock for vn_refcount/vn_opencount */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -91,6 +97,14 @@ struct vnode {
  *                      this may be substantially after vop_lastclose is
  *                      called.
  *
+ *                      Called with no locks held, so the refcount may
+ *                      have gone up again in the meantime (e.g., the
+ *                      filesystem handed the vnode out again). The
+ *                      filesystem must check this, under vn_countlock
+ *                      and whatever lock it uses to find vnodes; if
+ *                      the refcount is not 1 it should drop the
+ *                      caller's reference and return EBUSY.
+ *
  *****************************************
  *
  *    vop_read        - Read data from file to uio, at offset specified
@@ -135,9 +149,11 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check whether the file can be mapped into
+ *                      memory. The VM system does the mapping itself,
+ *                      through vop_read and vop_write; this just
+ *                      returns 0 if that's ok, or an error (e.g.
+ *                      ENODEV for devices that can't be mapped).
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
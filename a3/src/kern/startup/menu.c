@@ -38,6 +38,7 @@
 #include <clock.h>
 #include <thread.h>
 #include <vfs.h>
+#include <buf.h>
 #include <syscall.h>
 #include <test.h>
 
@@ -533,6 +534,30 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_diskstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_printdevstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -603,6 +628,7 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] RW lock test          (1)     ",
 	"[cm] Coremap test           (3)     ",
 	"[cm2] Coremap stress test   (3)     ",
 	"[fs1] Filesystem test               ",
@@ -610,6 +636,8 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS long stress        (4)     ",
+	"[fs7] SFS indirect blocks           ",
+	"[bc1] Buffer cache test     (4)     ",
 	NULL
 };
 
@@ -634,6 +662,8 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[bc] Buffer cache stats             ",
+	"[ds] Disk queue stats               ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -682,6 +712,8 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "bc",		cmd_bufstats },
+	{ "ds",		cmd_diskstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -699,6 +731,7 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwtest },
 
 	/* ASST2 tests */
 	/* For testing the wait implementation. */
@@ -720,6 +753,8 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
         { "fs6",        inlinetest },
+	{ "fs7",	indirtest },
+	{ "bc1",	buftest },
 
 	{ NULL, NULL }
 };
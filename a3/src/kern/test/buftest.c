@@ -0,0 +1,478 @@
+/*
+ * Buffer cache test.
+ *
+ * Takes the name of a disk with an SFS volume on it that isn't
+ * mounted, e.g. "bc1 lhd1". Checks that rereading blocks hits in the
+ * cache, that the cache stays within its size and recycles the least
+ * recently used buffers, that dirty blocks reach the disk on sync and
+ * unmount, and that a failed mount leaves nothing of the device
+ * cached.
+ *
+ * The disk is left as it was, apart from a scratch file that is made
+ * and removed again. Nothing else should be using the buffer cache
+ * while this runs, or the counts it checks will be off.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <device.h>
+#include <buf.h>
+#include <sfs.h>
+#include <test.h>
+
+#define FILENAME	"buftest.tmp"
+#define NHITBLOCKS	16	/* blocks reread by the hit test */
+#define NEXTRA		16	/* blocks read past the cache size */
+#define NFILEBLOCKS	8	/* size of the scratch file, in blocks */
+
+/* Byte in block BLOCK of the scratch file, for pass SEED; never 0. */
+#define FILEBYTE(block, seed) \
+	((unsigned char)(((block) + (seed)) % 255 + 1))
+
+static struct device *buftest_dev;
+
+/*
+ * A mount function that doesn't mount anything. It just gets us the
+ * device, which is what the buffer cache interface wants.
+ */
+static
+int
+buftest_probe(void *data, struct device *dev, struct fs **ret)
+{
+	(void)data;
+	(void)ret;
+
+	buftest_dev = dev;
+	return ENODEV;
+}
+
+/*
+ * Read blocks 0 through NBLOCKS-1 of the raw device through the
+ * cache.
+ */
+static
+int
+buftest_readraw(struct device *dev, uint32_t nblocks)
+{
+	struct buf *b;
+	uint32_t i;
+	int result;
+
+	for (i=0; i<nblocks; i++) {
+		result = buffer_read(dev, i, &b);
+		if (result) {
+			kprintf("bc1: Reading block %u: %s\n", i,
+				strerror(result));
+			return result;
+		}
+		buffer_release(b);
+	}
+	return 0;
+}
+
+/*
+ * Rereading blocks that are cached should take no disk reads.
+ */
+static
+int
+buftest_hits(struct device *dev)
+{
+	struct bufstats before, after;
+	uint32_t hits, misses, reads;
+	int result;
+
+	kprintf("Rereading blocks 0-%u\n", NHITBLOCKS - 1);
+	result = buftest_readraw(dev, NHITBLOCKS);
+	if (result) {
+		return result;
+	}
+	buffer_getstats(&before);
+	result = buftest_readraw(dev, NHITBLOCKS);
+	if (result) {
+		return result;
+	}
+	buffer_getstats(&after);
+
+	hits = after.bs_hits - before.bs_hits;
+	misses = after.bs_misses - before.bs_misses;
+	reads = after.bs_reads - before.bs_reads;
+	if (hits != NHITBLOCKS || misses != 0 || reads != 0) {
+		kprintf("bc1: FAILED: reread got %u hits, %u misses, "
+			"%u disk reads\n", hits, misses, reads);
+		return EIO;
+	}
+	kprintf("bc1: %u hits, no disk reads\n", hits);
+	return 0;
+}
+
+/*
+ * Reading more blocks than the cache holds should recycle buffers
+ * rather than grow the cache, and push out the oldest block.
+ */
+static
+int
+buftest_evict(struct device *dev)
+{
+	struct bufstats before, after;
+	uint32_t nblocks, recycles;
+	int result;
+
+	buffer_getstats(&before);
+	nblocks = before.bs_maxbufs + NEXTRA;
+	if (nblocks > dev->d_blocks) {
+		kprintf("bc1: Disk is smaller than the cache; "
+			"skipping the eviction test\n");
+		return 0;
+	}
+
+	kprintf("Reading blocks 0-%u through %u buffers\n", nblocks - 1,
+		before.bs_maxbufs);
+	result = buftest_readraw(dev, nblocks);
+	if (result) {
+		return result;
+	}
+	buffer_getstats(&after);
+
+	if (after.bs_bufs > after.bs_maxbufs) {
+		kprintf("bc1: FAILED: cache has %u buffers; limit is %u\n",
+			after.bs_bufs, after.bs_maxbufs);
+		return EIO;
+	}
+	recycles = after.bs_recycles - before.bs_recycles;
+	if (recycles < NEXTRA) {
+		kprintf("bc1: FAILED: only %u buffers recycled\n", recycles);
+		return EIO;
+	}
+
+	/* Block 0 was used longest ago, so it should be gone. */
+	before = after;
+	result = buftest_readraw(dev, 1);
+	if (result) {
+		return result;
+	}
+	buffer_getstats(&after);
+	if (after.bs_misses - before.bs_misses != 1) {
+		kprintf("bc1: FAILED: block 0 still cached\n");
+		return EIO;
+	}
+	kprintf("bc1: %u buffers recycled, oldest block evicted\n",
+		recycles);
+	return 0;
+}
+
+/*
+ * Fill BUF with C.
+ */
+static
+void
+buftest_fillbuf(char *buf, unsigned char c)
+{
+	unsigned i;
+
+	for (i=0; i<BUFFER_SIZE; i++) {
+		buf[i] = c;
+	}
+}
+
+/*
+ * Check that all of BUF holds C.
+ */
+static
+int
+buftest_checkbuf(const char *buf, unsigned char c)
+{
+	unsigned i;
+
+	for (i=0; i<BUFFER_SIZE; i++) {
+		if (buf[i] != (char)c) {
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write (or read back and check) the scratch file on DEVNAME, with
+ * the pattern for SEED.
+ */
+static
+int
+buftest_file(const char *devname, unsigned seed, enum uio_rw rw)
+{
+	char path[64];
+	char *buf;
+	struct iovec iov;
+	struct uio ku;
+	struct vnode *vn;
+	uint32_t i;
+	int result;
+
+	buf = kmalloc(BUFFER_SIZE);
+	if (buf == NULL) {
+		kprintf("bc1: Out of memory\n");
+		return ENOMEM;
+	}
+
+	/* vfs_open destroys the string it's passed */
+	snprintf(path, sizeof(path), "%s:%s", devname, FILENAME);
+	if (rw == UIO_WRITE) {
+		result = vfs_open(path, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	}
+	else {
+		result = vfs_open(path, O_RDONLY, 0, &vn);
+	}
+	if (result) {
+		kprintf("bc1: %s:%s: %s\n", devname, FILENAME,
+			strerror(result));
+		kfree(buf);
+		return result;
+	}
+
+	for (i=0; i<NFILEBLOCKS; i++) {
+		if (rw == UIO_WRITE) {
+			buftest_fillbuf(buf, FILEBYTE(i, seed));
+		}
+		uio_kinit(&iov, &ku, buf, BUFFER_SIZE, i*BUFFER_SIZE, rw);
+		if (rw == UIO_WRITE) {
+			result = VOP_WRITE(vn, &ku);
+		}
+		else {
+			result = VOP_READ(vn, &ku);
+		}
+		if (result) {
+			kprintf("bc1: %s: I/O error: %s\n", FILENAME,
+				strerror(result));
+			break;
+		}
+		if (ku.uio_resid > 0) {
+			kprintf("bc1: %s: Short I/O at block %u\n",
+				FILENAME, i);
+			result = EIO;
+			break;
+		}
+		if (rw == UIO_READ &&
+		    buftest_checkbuf(buf, FILEBYTE(i, seed))) {
+			kprintf("bc1: FAILED: %s block %u has the wrong "
+				"data\n", FILENAME, i);
+			result = EIO;
+			break;
+		}
+	}
+
+	vfs_close(vn);
+	kfree(buf);
+	return result;
+}
+
+/*
+ * Dirty blocks should be written out by sync and by unmount, and be
+ * read back from disk after a remount.
+ */
+static
+int
+buftest_writeback(const char *devname)
+{
+	struct bufstats before, after;
+	char path[64];
+	uint32_t writes, misses;
+	bool mounted;
+	int result;
+
+	result = sfs_mount(devname);
+	if (result) {
+		kprintf("bc1: Mounting %s: %s\n", devname, strerror(result));
+		return result;
+	}
+	mounted = true;
+
+	kprintf("Writing %s and syncing\n", FILENAME);
+	result = buftest_file(devname, 1, UIO_WRITE);
+	if (result) {
+		goto out;
+	}
+	buffer_getstats(&before);
+	result = vfs_sync();
+	if (result) {
+		kprintf("bc1: Sync: %s\n", strerror(result));
+		goto out;
+	}
+	buffer_getstats(&after);
+	writes = after.bs_writes - before.bs_writes;
+	if (writes < NFILEBLOCKS) {
+		kprintf("bc1: FAILED: sync wrote only %u blocks\n", writes);
+		result = EIO;
+		goto out;
+	}
+
+	kprintf("Rewriting %s and unmounting\n", FILENAME);
+	result = buftest_file(devname, 2, UIO_WRITE);
+	if (result) {
+		goto out;
+	}
+	buffer_getstats(&before);
+	result = vfs_unmount(devname);
+	if (result) {
+		kprintf("bc1: Unmounting %s: %s\n", devname,
+			strerror(result));
+		goto out;
+	}
+	mounted = false;
+	buffer_getstats(&after);
+	writes = after.bs_writes - before.bs_writes;
+	if (writes < NFILEBLOCKS) {
+		kprintf("bc1: FAILED: unmount wrote only %u blocks\n", writes);
+		result = EIO;
+		goto out;
+	}
+
+	kprintf("Remounting and checking %s\n", FILENAME);
+	result = sfs_mount(devname);
+	if (result) {
+		kprintf("bc1: Remounting %s: %s\n", devname,
+			strerror(result));
+		goto out;
+	}
+	mounted = true;
+	buffer_getstats(&before);
+	result = buftest_file(devname, 2, UIO_READ);
+	if (result) {
+		goto out;
+	}
+	buffer_getstats(&after);
+	misses = after.bs_misses - before.bs_misses;
+	if (misses < NFILEBLOCKS) {
+		kprintf("bc1: FAILED: only %u misses after remount\n",
+			misses);
+		result = EIO;
+		goto out;
+	}
+	kprintf("bc1: data survived sync, unmount and remount\n");
+
+ out:
+	if (mounted) {
+		snprintf(path, sizeof(path), "%s:%s", devname, FILENAME);
+		vfs_remove(path);
+		vfs_unmount(devname);
+	}
+	return result;
+}
+
+/*
+ * A mount that fails after reading the superblock should drop it
+ * from the cache again. Make it fail by putting a copy of the
+ * superblock with a bad magic number in the cache. That buffer isn't
+ * marked dirty, so it never gets to the disk.
+ */
+static
+int
+buftest_failmount(const char *devname, struct device *dev)
+{
+	struct bufstats before, after;
+	struct buf *b;
+	struct sfs_super *sp;
+	uint32_t magic;
+	int result;
+
+	result = buffer_read(dev, SFS_SB_LOCATION, &b);
+	if (result) {
+		kprintf("bc1: Reading superblock: %s\n", strerror(result));
+		return result;
+	}
+	sp = buffer_map(b);
+	sp->sp_magic = ~(uint32_t)SFS_MAGIC;
+	buffer_release(b);
+
+	kprintf("Mounting with a bad superblock (sfs should complain)\n");
+	result = sfs_mount(devname);
+	if (result == 0) {
+		kprintf("bc1: FAILED: mounted with a bad superblock\n");
+		vfs_unmount(devname);
+		buffer_drop(dev, SFS_SB_LOCATION);
+		return EIO;
+	}
+
+	buffer_getstats(&before);
+	result = buffer_read(dev, SFS_SB_LOCATION, &b);
+	if (result) {
+		kprintf("bc1: Reading superblock: %s\n", strerror(result));
+		return result;
+	}
+	sp = buffer_map(b);
+	magic = sp->sp_magic;
+	buffer_release(b);
+	buffer_getstats(&after);
+
+	if (after.bs_misses - before.bs_misses != 1) {
+		kprintf("bc1: FAILED: superblock still cached after failed "
+			"mount\n");
+		buffer_drop(dev, SFS_SB_LOCATION);
+		return EIO;
+	}
+	if (magic != SFS_MAGIC) {
+		kprintf("bc1: FAILED: bad superblock reached the disk\n");
+		buffer_drop(dev, SFS_SB_LOCATION);
+		return EIO;
+	}
+	buffer_drop(dev, SFS_SB_LOCATION);
+	kprintf("bc1: failed mount left nothing cached\n");
+	return 0;
+}
+
+int
+buftest(int nargs, char **args)
+{
+	char *devname;
+	struct device *dev;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: bc1 device\n");
+		return EINVAL;
+	}
+	devname = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (devname[strlen(devname)-1]==':') {
+		devname[strlen(devname)-1] = 0;
+	}
+
+	buftest_dev = NULL;
+	result = vfs_mount(devname, NULL, buftest_probe);
+	if (buftest_dev == NULL) {
+		kprintf("bc1: %s: %s\n", devname, strerror(result));
+		return result;
+	}
+	dev = buftest_dev;
+	if (dev->d_blocksize != BUFFER_SIZE) {
+		kprintf("bc1: %s: Wrong block size\n", devname);
+		return ENXIO;
+	}
+
+	kprintf("*** Starting buffer cache test on %s\n", devname);
+
+	result = buftest_hits(dev);
+	if (!result) {
+		result = buftest_evict(dev);
+	}
+
+	/* The raw blocks read so far are clean; don't leave them around. */
+	buffer_drop_device(dev);
+
+	if (!result) {
+		result = buftest_writeback(devname);
+	}
+	if (!result) {
+		result = buftest_failmount(devname, dev);
+	}
+
+	if (result) {
+		kprintf("*** buffer cache test FAILED\n");
+		return result;
+	}
+	kprintf("*** buffer cache test done\n");
+	return 0;
+}
@@ -41,6 +41,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <thread.h>
@@ -555,112 +556,143 @@ checkbuf(char *buf, int buflen, unsigned char c) {
 	return 0;
 }
 
+/*
+ * Where things are in an SFS file. The first SFS_INLINED_BYTES live
+ * in the inode; file block 0 starts after them. The direct blocks
+ * come first, then the blocks under the single, double and triple
+ * indirect blocks.
+ */
+#define BLOCKOFFSET(block) \
+	((off_t)SFS_INLINED_BYTES + (off_t)(block)*SFS_BLOCKSIZE)
+#define DINDIRFIRST	(SFS_NDIRECT + SFS_DBPERIDB)
+#define TINDIRFIRST	(DINDIRFIRST + SFS_DBPERIDB*SFS_DBPERIDB)
+#define MAXFILEBLOCKS	(TINDIRFIRST + SFS_DBPERIDB*SFS_DBPERIDB*SFS_DBPERIDB)
+#define MAXFILESIZE	BLOCKOFFSET(MAXFILEBLOCKS)
+
+/* Byte the inline test writes at POS: one value per 512 bytes. */
+#define INLINEBYTE(pos)	((unsigned char)((pos) / 512 + 1))
+
+/*
+ * Write bytes START through END-1 of the file, 32 at a time.
+ */
 static int
-doinlinecreate(struct vnode *vn, char *name, char *buf)
+doinlinecreate(struct vnode *vn, char *name, char *buf,
+	       off_t start, off_t end)
 {
-	int i,j;
 	int err;
-	int blocknum;
-	off_t pos=0;
+	off_t pos=start;
 	size_t bytes=0;
 	struct uio ku;
 	struct iovec iov;
-	unsigned char curchar=1;
-	const int sfs_max_file_size= (SFS_NDIRECT+SFS_DBPERIDB)*SFS_BLOCKSIZE 
-		                    + SFS_INLINED_BYTES;
-
-	blocknum=1;
-	while (i < sfs_max_file_size) {
-		fillbuf(buf, 32, curchar);
-		kprintf("Doing block %d\n",blocknum);
-		for (j=0; j < 16; j++) {
-			uio_kinit(&iov, &ku, buf, 32, pos, UIO_WRITE);
-			err = VOP_WRITE(vn, &ku);
-			if (err) {
-				kprintf("%s: Write error: %s\n", name, strerror(err));
-				return EIO;
-			}
 
-			if (ku.uio_resid > 0) {
-				kprintf("%s: Short write: %lu bytes left over\n",
-					name, (unsigned long) ku.uio_resid);
-				return EIO;
-			}
-			bytes += (ku.uio_offset - pos);
-			pos = ku.uio_offset;
-			i = pos;
-			if (i == sfs_max_file_size) {
-				break;
-			}
+	while (pos < end) {
+		if (pos % 512 == 0) {
+			kprintf("Doing block %lu\n",
+				(unsigned long)(pos / 512 + 1));
+		}
+		fillbuf(buf, 32, INLINEBYTE(pos));
+		uio_kinit(&iov, &ku, buf, 32, pos, UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		if (err) {
+			kprintf("%s: Write error: %s\n", name, strerror(err));
+			return EIO;
 		}
-		curchar++;
-		blocknum++;
+
+		if (ku.uio_resid > 0) {
+			kprintf("%s: Short write: %lu bytes left over\n",
+				name, (unsigned long) ku.uio_resid);
+			return EIO;
+		}
+		bytes += (ku.uio_offset - pos);
+		pos = ku.uio_offset;
 	}
 
-	if ((unsigned long)bytes == (unsigned long)sfs_max_file_size) {
-		kprintf("PASSED %s: %lu bytes written\n", name, (unsigned long)bytes); 
+	if ((unsigned long)bytes == (unsigned long)(end - start)) {
+		kprintf("PASSED %s: %lu bytes written\n", name,
+			(unsigned long)bytes);
 	} else {
-		kprintf("FAILED %s: only %lu bytes written, should be %lu\n",name,(unsigned long)bytes, (unsigned long)sfs_max_file_size);
+		kprintf("FAILED %s: only %lu bytes written, should be %lu\n",
+			name, (unsigned long)bytes,
+			(unsigned long)(end - start));
 	}
 
 	return 0;
 }
 
+/*
+ * Read bytes START through END-1 of the file back, 32 at a time, and
+ * check them. If ZEROS is set they should be a hole, and read as 0.
+ */
 static int
-doinlineread(struct vnode *vn, char *name, char *buf)
+doinlineread(struct vnode *vn, char *name, char *buf,
+	     off_t start, off_t end, bool zeros)
 {
-	int i,j;
 	int err;
-	int blocknum;
-	off_t pos=0;
+	off_t pos=start;
 	size_t bytes=0;
 	struct uio ku;
 	struct iovec iov;
-	unsigned char curchar=1;
-	const int sfs_max_file_size= (SFS_NDIRECT+SFS_DBPERIDB)*SFS_BLOCKSIZE 
-		                    + SFS_INLINED_BYTES;
-
-	blocknum=1;
-	while (i < sfs_max_file_size) {
-		for (j=0; j < 16; j++) {
-			uio_kinit(&iov, &ku, buf, 32, pos, UIO_READ);
-			err = VOP_READ(vn, &ku);
-			if (err) {
-				kprintf("%s: Read error: %s\n", name, strerror(err));
-				return EIO;
-			}
 
-			if (ku.uio_resid > 0) {
-				kprintf("%s: Short read: %lu bytes left over\n",
-					name, (unsigned long) ku.uio_resid);
-				return EIO;
-			}
+	while (pos < end) {
+		uio_kinit(&iov, &ku, buf, 32, pos, UIO_READ);
+		err = VOP_READ(vn, &ku);
+		if (err) {
+			kprintf("%s: Read error: %s\n", name, strerror(err));
+			return EIO;
+		}
 
-			if (checkbuf(buf, 32, curchar)) {
-				kprintf("%s: bytes read contained unexpected values\n", name);
-				return EIO;
-			}
+		if (ku.uio_resid > 0) {
+			kprintf("%s: Short read: %lu bytes left over\n",
+				name, (unsigned long) ku.uio_resid);
+			return EIO;
+		}
 
-			bytes += (ku.uio_offset - pos);
-			pos = ku.uio_offset;
-			i = pos;
-			if (i == sfs_max_file_size) {
-				break;
-			}
+		if (checkbuf(buf, 32, zeros ? 0 : INLINEBYTE(pos))) {
+			kprintf("%s: bytes read contained unexpected "
+				"values\n", name);
+			return EIO;
 		}
-		curchar++;
-		blocknum++;
+
+		bytes += (ku.uio_offset - pos);
+		pos = ku.uio_offset;
 	}
 
-	if ((unsigned long)bytes == (unsigned long)sfs_max_file_size) {
-		kprintf("PASSED %s: %lu bytes read\n", name, (unsigned long)bytes); 
+	if ((unsigned long)bytes == (unsigned long)(end - start)) {
+		kprintf("PASSED %s: %lu bytes read\n", name,
+			(unsigned long)bytes);
 	} else {
-		kprintf("FAILED %s: only %lu bytes read, should be %lu\n",name,(unsigned long)bytes, (unsigned long)sfs_max_file_size);
+		kprintf("FAILED %s: only %lu bytes read, should be %lu\n",
+			name, (unsigned long)bytes,
+			(unsigned long)(end - start));
 	}
 
 	return 0;
 }
 
+/*
+ * Check that the file can't be written at or past MAXFILESIZE.
+ */
+static int
+doinlinetoobig(struct vnode *vn, char *name, char *buf)
+{
+	int err;
+	struct uio ku;
+	struct iovec iov;
+
+	fillbuf(buf, 32, 0xff);
+	uio_kinit(&iov, &ku, buf, 32, MAXFILESIZE, UIO_WRITE);
+	err = VOP_WRITE(vn, &ku);
+	if (err != EFBIG) {
+		kprintf("FAILED %s: write at %lu gave %s, should be %s\n",
+			name, (unsigned long)MAXFILESIZE, strerror(err),
+			strerror(EFBIG));
+		return EIO;
+	}
+	kprintf("PASSED %s: no writing past %lu bytes\n", name,
+		(unsigned long)MAXFILESIZE);
+	return 0;
+}
+
 static
 void
 doinlinetest(const char *filesys)
@@ -672,6 +704,10 @@ doinlinetest(const char *filesys)
 	const char *fs=filesys;
 	const char *namesuffix="";
 	struct vnode *vn;
+	/* Dense part: the inline data, direct blocks and single indirect */
+	const off_t densesize = BLOCKOFFSET(DINDIRFIRST);
+	/* Sparse last block, under the triple indirect block */
+	const off_t tailstart = MAXFILESIZE - 512;
 
 	kprintf("*** Starting filesystem inline data test on %s:\n", filesys);
 	kprintf("*** This is only expected to work on an SFS file system with the A3 inlining optimization\n");
@@ -679,7 +715,9 @@ doinlinetest(const char *filesys)
 	MAKENAME();
 
 	/* Create large file - will only succeed if extra space in SFS
-	 * inode is available to store file data.
+	 * inode is available to store file data. Fill in everything up
+	 * to the double indirect block, then the very end of the
+	 * largest possible file, leaving a hole in between.
 	 */
 	flags = O_WRONLY|O_CREAT|O_TRUNC;
 	/* vfs_open destroys the string it's passed */
@@ -690,7 +728,13 @@ doinlinetest(const char *filesys)
 			name, strerror(err));
 		return;
 	}
-	err = doinlinecreate(vn, name, buf);
+	err = doinlinecreate(vn, name, buf, 0, densesize);
+	if (!err) {
+		err = doinlinecreate(vn, name, buf, tailstart, MAXFILESIZE);
+	}
+	if (!err) {
+		err = doinlinetoobig(vn, name, buf);
+	}
 	vfs_close(vn);
 
 	if (err) {
@@ -708,10 +752,19 @@ doinlinetest(const char *filesys)
 			name, strerror(err));
 		return;
 	}
-	err = doinlineread(vn, name, buf);
+	err = doinlineread(vn, name, buf, 0, densesize, false);
+	if (!err) {
+		/* a bit of the hole, under the double indirect block */
+		err = doinlineread(vn, name, buf, densesize, densesize + 512,
+				   true);
+	}
+	if (!err) {
+		err = doinlineread(vn, name, buf, tailstart, MAXFILESIZE,
+				   false);
+	}
 	vfs_close(vn);
 
-	/* It would be sensible to add some tests of VOP_TRUNCATE here ... */
+	/* VOP_TRUNCATE is tested by doindirtest, below. */
 
 	vfs_remove(name);	
 	return;
@@ -720,6 +773,276 @@ doinlinetest(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/* Byte the indirect block test fills file block BLOCK with; never 0. */
+#define INDIRBYTE(block)	((unsigned char)((block) % 255 + 1))
+
+/*
+ * Write all of file block BLOCK.
+ */
+static
+int
+indirwrite(struct vnode *vn, const char *name, char *buf, uint32_t block)
+{
+	struct iovec iov;
+	struct uio ku;
+	int err;
+
+	fillbuf(buf, SFS_BLOCKSIZE, INDIRBYTE(block));
+	uio_kinit(&iov, &ku, buf, SFS_BLOCKSIZE, BLOCKOFFSET(block),
+		  UIO_WRITE);
+	err = VOP_WRITE(vn, &ku);
+	if (err) {
+		kprintf("%s: Write error at block %u: %s\n", name, block,
+			strerror(err));
+		return err;
+	}
+	if (ku.uio_resid > 0) {
+		kprintf("%s: Short write at block %u: %lu bytes left over\n",
+			name, block, (unsigned long) ku.uio_resid);
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Read the first LEN bytes of file block BLOCK and check that they
+ * were what indirwrite wrote there, or zeros if HOLE is set.
+ */
+static
+int
+indirread(struct vnode *vn, const char *name, char *buf, uint32_t block,
+	  size_t len, bool hole)
+{
+	struct iovec iov;
+	struct uio ku;
+	int err;
+
+	uio_kinit(&iov, &ku, buf, len, BLOCKOFFSET(block), UIO_READ);
+	err = VOP_READ(vn, &ku);
+	if (err) {
+		kprintf("%s: Read error at block %u: %s\n", name, block,
+			strerror(err));
+		return err;
+	}
+	if (ku.uio_resid > 0) {
+		kprintf("%s: Short read at block %u: %lu bytes left over\n",
+			name, block, (unsigned long) ku.uio_resid);
+		return EIO;
+	}
+	if (checkbuf(buf, len, hole ? 0 : INDIRBYTE(block))) {
+		kprintf("%s: Block %u contained unexpected values\n",
+			name, block);
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Check that the file is LEN bytes long.
+ */
+static
+int
+indirchecksize(struct vnode *vn, const char *name, off_t len)
+{
+	struct stat st;
+	int err;
+
+	err = VOP_STAT(vn, &st);
+	if (err) {
+		kprintf("%s: Stat error: %s\n", name, strerror(err));
+		return err;
+	}
+	if (st.st_size != len) {
+		kprintf("%s: File is %lu bytes, should be %lu\n", name,
+			(unsigned long)st.st_size, (unsigned long)len);
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Truncate the file to LEN, then check that blocks FIRST through
+ * LAST-1 are still there, whole.
+ */
+static
+int
+indirtruncate(struct vnode *vn, const char *name, char *buf, off_t len,
+	      uint32_t first, uint32_t last)
+{
+	uint32_t block;
+	int err;
+
+	kprintf("Truncating to %lu bytes\n", (unsigned long)len);
+	err = VOP_TRUNCATE(vn, len);
+	if (err) {
+		kprintf("%s: Truncate error: %s\n", name, strerror(err));
+		return err;
+	}
+	err = indirchecksize(vn, name, len);
+	if (err) {
+		return err;
+	}
+	for (block = first; block < last; block++) {
+		err = indirread(vn, name, buf, block, SFS_BLOCKSIZE, false);
+		if (err) {
+			return err;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The body of the indirect block test. The file is sparse: only the
+ * blocks named are written, and everything else is a hole, so it
+ * takes only a few dozen disk blocks.
+ */
+static
+int
+indirtest_run(struct vnode *vn, const char *name, char *buf)
+{
+	const uint32_t boundaries[2] = { DINDIRFIRST, TINDIRFIRST };
+	uint32_t block;
+	unsigned i;
+	int err;
+
+	/*
+	 * Write two blocks on each side of the single to double and
+	 * the double to triple indirect boundaries, and read them back.
+	 */
+	for (i=0; i<2; i++) {
+		kprintf("Writing blocks %u-%u\n", boundaries[i] - 2,
+			boundaries[i] + 1);
+		for (block = boundaries[i] - 2; block < boundaries[i] + 2;
+		     block++) {
+			err = indirwrite(vn, name, buf, block);
+			if (err) {
+				return err;
+			}
+		}
+	}
+	err = indirchecksize(vn, name, BLOCKOFFSET(TINDIRFIRST + 2));
+	if (err) {
+		return err;
+	}
+	for (i=0; i<2; i++) {
+		for (block = boundaries[i] - 2; block < boundaries[i] + 2;
+		     block++) {
+			err = indirread(vn, name, buf, block, SFS_BLOCKSIZE,
+					false);
+			if (err) {
+				return err;
+			}
+		}
+	}
+
+	/* Holes: under an indirect block that exists, and one that doesn't */
+	err = indirread(vn, name, buf, DINDIRFIRST + 2, SFS_BLOCKSIZE, true);
+	if (err) {
+		return err;
+	}
+	err = indirread(vn, name, buf, DINDIRFIRST + SFS_DBPERIDB,
+			SFS_BLOCKSIZE, true);
+	if (err) {
+		return err;
+	}
+
+	/*
+	 * Cut the file back across each boundary in turn, which frees
+	 * the triple and then the double indirect tree, then into the
+	 * middle of the last block under the single indirect block.
+	 */
+	err = indirtruncate(vn, name, buf, BLOCKOFFSET(TINDIRFIRST),
+			    TINDIRFIRST - 2, TINDIRFIRST);
+	if (err) {
+		return err;
+	}
+	err = indirtruncate(vn, name, buf, BLOCKOFFSET(DINDIRFIRST),
+			    DINDIRFIRST - 2, DINDIRFIRST);
+	if (err) {
+		return err;
+	}
+	err = indirtruncate(vn, name, buf, BLOCKOFFSET(DINDIRFIRST - 1) + 100,
+			    DINDIRFIRST - 2, DINDIRFIRST - 1);
+	if (err) {
+		return err;
+	}
+	err = indirread(vn, name, buf, DINDIRFIRST - 1, 100, false);
+	if (err) {
+		return err;
+	}
+
+	/*
+	 * Grow the file across both boundaries again. The indirect
+	 * blocks the truncates freed have to be made afresh, and the
+	 * blocks in between must read as holes, not as old data.
+	 */
+	err = indirwrite(vn, name, buf, TINDIRFIRST);
+	if (err) {
+		return err;
+	}
+	err = indirread(vn, name, buf, TINDIRFIRST, SFS_BLOCKSIZE, false);
+	if (err) {
+		return err;
+	}
+	err = indirread(vn, name, buf, DINDIRFIRST, SFS_BLOCKSIZE, true);
+	if (err) {
+		return err;
+	}
+	err = indirread(vn, name, buf, TINDIRFIRST - 1, SFS_BLOCKSIZE, true);
+	if (err) {
+		return err;
+	}
+
+	return indirtruncate(vn, name, buf, 0, 0, 0);
+}
+
+/*
+ * Indirect block test: exercises the double and triple indirect
+ * blocks, for reading, writing and truncating.
+ */
+static
+void
+doindirtest(const char *filesys)
+{
+	int err;
+	char name[32];
+	char *buf;
+	const char *fs=filesys;
+	const char *namesuffix="";
+	struct vnode *vn;
+
+	kprintf("*** Starting SFS indirect block test on %s:\n", filesys);
+
+	MAKENAME();
+
+	buf = kmalloc(SFS_BLOCKSIZE);
+	if (buf == NULL) {
+		kprintf("Out of memory\n");
+		return;
+	}
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	err = vfs_open(buf, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s: %s\n", name, strerror(err));
+		kfree(buf);
+		return;
+	}
+	err = indirtest_run(vn, name, buf);
+	vfs_close(vn);
+	vfs_remove(name);
+	kfree(buf);
+
+	if (err) {
+		kprintf("FAILED %s: indirect block test\n", name);
+		return;
+	}
+	kprintf("*** SFS indirect block test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -727,7 +1050,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[123456] filesystem:\n");
+		kprintf("Usage: fs[1234567] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -760,6 +1083,7 @@ DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(longstress);
 DEFTEST(inlinetest);
+DEFTEST(indirtest);
 
 ////////////////////////////////////////////////////////////
 
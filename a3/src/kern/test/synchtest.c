@@ -44,6 +44,8 @@
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
 #define NTHREADS      32
+#define NRWLOOPS      60
+#define NRWREADERS    8
 
 static volatile unsigned long testval1;
 static volatile unsigned long testval2;
@@ -51,7 +53,10 @@ static volatile unsigned long testval3;
 static struct semaphore *testsem;
 static struct lock *testlock;
 static struct cv *testcv;
+static struct rwlock *testrwlock;
 static struct semaphore *donesem;
+static struct semaphore *rwinsem;
+static struct semaphore *rwgosem;
 
 static
 void
@@ -75,12 +80,30 @@ inititems(void)
 			panic("synchtest: cv_create failed\n");
 		}
 	}
+	if (testrwlock==NULL) {
+		testrwlock = rwlock_create("testrwlock");
+		if (testrwlock == NULL) {
+			panic("synchtest: rwlock_create failed\n");
+		}
+	}
 	if (donesem==NULL) {
 		donesem = sem_create("donesem", 0);
 		if (donesem == NULL) {
 			panic("synchtest: sem_create failed\n");
 		}
 	}
+	if (rwinsem==NULL) {
+		rwinsem = sem_create("rwinsem", 0);
+		if (rwinsem == NULL) {
+			panic("synchtest: sem_create failed\n");
+		}
+	}
+	if (rwgosem==NULL) {
+		rwgosem = sem_create("rwgosem", 0);
+		if (rwgosem == NULL) {
+			panic("synchtest: sem_create failed\n");
+		}
+	}
 }
 
 static
@@ -304,3 +327,305 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock test.
+ *
+ * The test looks inside the rwlock (under its spinlock) to tell when
+ * another thread has got as far as waiting for it.
+ */
+
+static
+unsigned
+rwpeek_readers(void)
+{
+	unsigned ret;
+
+	spinlock_acquire(&testrwlock->rw_lock);
+	ret = testrwlock->rw_readers;
+	spinlock_release(&testrwlock->rw_lock);
+	return ret;
+}
+
+static
+void
+rwwait_writerwaiting(void)
+{
+	unsigned waiting;
+
+	do {
+		thread_yield();
+		spinlock_acquire(&testrwlock->rw_lock);
+		waiting = testrwlock->rw_writerswaiting;
+		spinlock_release(&testrwlock->rw_lock);
+	} while (waiting == 0);
+}
+
+static
+void
+rwwait_upgrading(void)
+{
+	bool upgrading;
+
+	do {
+		thread_yield();
+		spinlock_acquire(&testrwlock->rw_lock);
+		upgrading = testrwlock->rw_upgrading;
+		spinlock_release(&testrwlock->rw_lock);
+	} while (!upgrading);
+}
+
+static
+void
+rwfail(unsigned long num, const char *msg, bool writing)
+{
+	kprintf("thread %lu: Mismatch on %s\n", num, msg);
+	kprintf("Test failed\n");
+
+	if (writing) {
+		rwlock_release_write(testrwlock);
+	}
+	else {
+		rwlock_release_read(testrwlock);
+	}
+
+	V(donesem);
+	thread_exit(_MKWAIT_EXIT(EX_SOFTWARE));
+}
+
+/*
+ * Part 1: readers hold the lock at the same time. Each one checks in
+ * while holding it and doesn't let go until all of them have.
+ */
+static
+void
+rwreaderthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	rwlock_acquire_read(testrwlock);
+	V(rwinsem);
+	P(rwgosem);
+	rwlock_release_read(testrwlock);
+	V(donesem);
+}
+
+/*
+ * Part 2: writers exclude each other and readers. Even-numbered
+ * threads write, odd-numbered ones read, as in the lock test.
+ */
+static
+void
+rwmixthread(void *junk, unsigned long num)
+{
+	int i;
+	bool writing = (num % 2 == 0);
+	unsigned long val;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (writing) {
+			rwlock_acquire_write(testrwlock);
+			if (!rwlock_do_i_hold_write(testrwlock)) {
+				rwfail(num, "rwlock_do_i_hold_write", true);
+			}
+			testval1 = num;
+			testval2 = num*num;
+			thread_yield();
+			if (testval1 != num) {
+				rwfail(num, "testval1/num", true);
+			}
+			if (testval2 != num*num) {
+				rwfail(num, "testval2/num", true);
+			}
+			rwlock_release_write(testrwlock);
+		}
+		else {
+			rwlock_acquire_read(testrwlock);
+			val = testval1;
+			thread_yield();
+			if (testval1 != val) {
+				rwfail(num, "testval1 while reading", false);
+			}
+			if (testval2 != val*val) {
+				rwfail(num, "testval2/testval1", false);
+			}
+			rwlock_release_read(testrwlock);
+		}
+	}
+	V(donesem);
+}
+
+/*
+ * Part 3: a waiting writer goes ahead of readers that come later.
+ * The writer takes ticket 1 (testval1); the late reader takes
+ * ticket 2 (testval2).
+ */
+static
+void
+rwprefthread(void *junk, unsigned long num)
+{
+	(void)junk;
+
+	if (num == 0) {
+		rwlock_acquire_write(testrwlock);
+		testval3++;
+		testval1 = testval3;
+		rwlock_release_write(testrwlock);
+	}
+	else {
+		rwlock_acquire_read(testrwlock);
+		lock_acquire(testlock);
+		testval3++;
+		testval2 = testval3;
+		lock_release(testlock);
+		rwlock_release_read(testrwlock);
+	}
+	V(donesem);
+}
+
+/*
+ * Part 4: of two readers trying to upgrade at once, the second is
+ * refused. The first one (this thread) gets in once the other has
+ * let go; testval1 records whether it did.
+ */
+static
+void
+rwupgradethread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	rwlock_acquire_read(testrwlock);
+	V(rwinsem);
+	if (rwlock_upgrade(testrwlock)) {
+		testval1 = rwlock_do_i_hold_write(testrwlock);
+		rwlock_release_write(testrwlock);
+	}
+	else {
+		testval1 = 0;
+		rwlock_release_read(testrwlock);
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+	unsigned readers;
+	bool ok = true;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting rwlock test...\n");
+
+	/* Part 1 */
+	kprintf("Concurrent readers; if this hangs, it's broken: ");
+	for (i=0; i<NRWREADERS; i++) {
+		result = thread_fork("rwtest", rwreaderthread, NULL, i, NULL);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NRWREADERS; i++) {
+		P(rwinsem);
+	}
+	readers = rwpeek_readers();
+	for (i=0; i<NRWREADERS; i++) {
+		V(rwgosem);
+	}
+	for (i=0; i<NRWREADERS; i++) {
+		P(donesem);
+	}
+	if (readers != NRWREADERS) {
+		kprintf("%u readers in, expected %u\n", readers, NRWREADERS);
+		ok = false;
+	}
+	else {
+		kprintf("ok\n");
+	}
+
+	/* Part 2 */
+	kprintf("Writer exclusion...\n");
+	testval1 = 0;
+	testval2 = 0;
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", rwmixthread, NULL, i, NULL);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	/* Part 3 */
+	kprintf("Writer preference: ");
+	testval1 = testval2 = testval3 = 0;
+	rwlock_acquire_read(testrwlock);
+	result = thread_fork("rwtest", rwprefthread, NULL, 0, NULL);
+	if (result) {
+		panic("rwtest: thread_fork failed: %s\n", strerror(result));
+	}
+	rwwait_writerwaiting();
+	result = thread_fork("rwtest", rwprefthread, NULL, 1, NULL);
+	if (result) {
+		panic("rwtest: thread_fork failed: %s\n", strerror(result));
+	}
+	/* give the reader a chance to (wrongly) get in */
+	for (i=0; i<10; i++) {
+		thread_yield();
+	}
+	rwlock_release_read(testrwlock);
+	P(donesem);
+	P(donesem);
+	if (testval1 != 1 || testval2 != 2) {
+		kprintf("reader got in ahead of the waiting writer\n");
+		ok = false;
+	}
+	else {
+		kprintf("ok\n");
+	}
+
+	/* Part 4 */
+	kprintf("Upgrade contention: ");
+	testval1 = 0;
+	rwlock_acquire_read(testrwlock);
+	result = thread_fork("rwtest", rwupgradethread, NULL, 0, NULL);
+	if (result) {
+		panic("rwtest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(rwinsem);
+	rwwait_upgrading();
+	if (rwlock_upgrade(testrwlock)) {
+		/* we'd be deadlocked with the other upgrader by now */
+		kprintf("second upgrade succeeded\n");
+		rwlock_release_write(testrwlock);
+		ok = false;
+	}
+	else {
+		rwlock_release_read(testrwlock);
+	}
+	P(donesem);
+	if (testval1 != 1) {
+		kprintf("first upgrade did not get the lock\n");
+		ok = false;
+	}
+	else {
+		kprintf("ok\n");
+	}
+
+	if (!ok) {
+		kprintf("Test failed\n");
+	}
+	kprintf("RW lock test done.\n");
+
+	return 0;
+}
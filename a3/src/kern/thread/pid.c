@@ -71,6 +71,7 @@ static struct lock *pidlock;		// lock for global exit data
 static struct pidinfo *pidinfo[PROCS_MAX]; // actual pid info
 static pid_t nextpid;			// next candidate pid
 static int nprocs;			// number of allocated pids
+static struct kmem_cache *pidinfo_cache; // for struct pidinfo
 
 
 
@@ -85,14 +86,14 @@ pidinfo_create(pid_t pid, pid_t ppid)
 
 	KASSERT(pid != INVALID_PID);
 
-	pi = kmalloc(sizeof(struct pidinfo));
+	pi = kmem_cache_alloc(pidinfo_cache);
 	if (pi==NULL) {
 		return NULL;
 	}
 
 	pi->pi_cv = cv_create("pidinfo cv");
 	if (pi->pi_cv == NULL) {
-		kfree(pi);
+		kmem_cache_free(pidinfo_cache, pi);
 		return NULL;
 	}
 
@@ -114,7 +115,7 @@ pidinfo_destroy(struct pidinfo *pi)
 	KASSERT(pi->pi_exited == true);
 	KASSERT(pi->pi_ppid == INVALID_PID);
 	cv_destroy(pi->pi_cv);
-	kfree(pi);
+	kmem_cache_free(pidinfo_cache, pi);
 }
 
 ////////////////////////////////////////////////////////////
@@ -132,6 +133,12 @@ pid_bootstrap(void)
 		panic("Out of memory creating pid lock\n");
 	}
 
+	pidinfo_cache = kmem_cache_create("pidinfo", sizeof(struct pidinfo),
+					  NULL);
+	if (pidinfo_cache == NULL) {
+		panic("Out of memory creating pidinfo cache\n");
+	}
+
 	/* not really necessary - should start zeroed */
 	for (i=0; i<PROCS_MAX; i++) {
 		pidinfo[i] = NULL;
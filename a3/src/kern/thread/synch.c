@@ -147,6 +147,13 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Number of times round the loop to spin waiting for a running holder
+ * before giving up and going to sleep. This should be about the cost
+ * of two context switches, which is what sleeping costs.
+ */
+#define LOCK_SPIN_MAX	1000
+
 struct lock *
 lock_create(const char *name)
 {
@@ -171,6 +178,8 @@ lock_create(const char *name)
 	}
 	spinlock_init(&lock->lk_lock);
 	lock->lk_holder = NULL;
+	lock->lk_nsleepers = 0;
+	lock->lk_handoff = false;
         
         return lock;
 }
@@ -181,6 +190,8 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
+	KASSERT(lock->lk_nsleepers == 0);
+	KASSERT(!lock->lk_handoff);
 	spinlock_cleanup(&lock->lk_lock);
 	wchan_destroy(lock->lk_wchan);
         
@@ -191,17 +202,54 @@ lock_destroy(struct lock *lock)
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	unsigned spins;
+
 	DEBUGASSERT(lock != NULL);
         KASSERT(curthread->t_in_interrupt == false);
 
+	spins = 0;
 	spinlock_acquire(&lock->lk_lock);
-	while (lock->lk_holder != NULL) {
-		/* As in the semaphore. */
+	while (lock->lk_holder != NULL || lock->lk_handoff) {
+		KASSERT(lock->lk_holder != curthread);
+
+		/*
+		 * If the holder is running on another cpu it'll
+		 * probably let go soon, so spin (with the spinlock
+		 * released) until it does, stops running, or we've
+		 * spun long enough that sleeping would have been
+		 * cheaper. Never spin on a lock being handed off; the
+		 * thread it's going to hasn't run yet.
+		 */
+		holder = lock->lk_holder;
+		if (holder != NULL && spins < LOCK_SPIN_MAX &&
+		    thread_isrunning(holder)) {
+			spinlock_release(&lock->lk_lock);
+			while (lock->lk_holder == holder &&
+			       spins < LOCK_SPIN_MAX &&
+			       thread_isrunning(holder)) {
+				spins++;
+			}
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
+
+		/*
+		 * Sleep. As in the semaphore, bridge to the wchan
+		 * lock so the wakeup can't get in before we're asleep.
+		 * lock_release only wakes us to hand us the lock, so
+		 * when we wake up it's ours.
+		 */
+		lock->lk_nsleepers++;
 		wchan_lock(lock->lk_wchan);
 		spinlock_release(&lock->lk_lock);
                 wchan_sleep(lock->lk_wchan);
 
 		spinlock_acquire(&lock->lk_lock);
+		KASSERT(lock->lk_handoff);
+		KASSERT(lock->lk_holder == NULL);
+		lock->lk_handoff = false;
+		break;
 	}
 
 	lock->lk_holder = curthread;
@@ -215,8 +263,18 @@ lock_release(struct lock *lock)
 
 	spinlock_acquire(&lock->lk_lock);
 	KASSERT(lock->lk_holder == curthread);
+	KASSERT(!lock->lk_handoff);
 	lock->lk_holder = NULL;
-	wchan_wakeone(lock->lk_wchan);
+	if (lock->lk_nsleepers > 0) {
+		/*
+		 * Hand the lock to the next sleeper. Only it gets
+		 * woken, and nobody else can take the lock in the
+		 * meantime.
+		 */
+		lock->lk_nsleepers--;
+		lock->lk_handoff = true;
+		wchan_wakeone(lock->lk_wchan);
+	}
 	spinlock_release(&lock->lk_lock);
 }
 
@@ -298,3 +356,240 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	(void)lock;
 	wchan_wakeall(cv->cv_wchan);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	/* so the failure path knows what to clean up */
+	rw->rw_wwchan = NULL;
+	rw->rw_rwchan = wchan_create(rw->rw_name);
+	if (rw->rw_rwchan == NULL) {
+		goto fail;
+	}
+	rw->rw_wwchan = wchan_create(rw->rw_name);
+	if (rw->rw_wwchan == NULL) {
+		goto fail;
+	}
+	rw->rw_uwchan = wchan_create(rw->rw_name);
+	if (rw->rw_uwchan == NULL) {
+		goto fail;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writer = NULL;
+	rw->rw_writerswaiting = 0;
+	rw->rw_upgrading = false;
+
+	return rw;
+
+ fail:
+	if (rw->rw_wwchan != NULL) {
+		wchan_destroy(rw->rw_wwchan);
+	}
+	if (rw->rw_rwchan != NULL) {
+		wchan_destroy(rw->rw_rwchan);
+	}
+	kfree(rw->rw_name);
+	kfree(rw);
+	return NULL;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_writerswaiting == 0);
+	KASSERT(!rw->rw_upgrading);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_uwchan);
+	wchan_destroy(rw->rw_wwchan);
+	wchan_destroy(rw->rw_rwchan);
+
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	/* Wait behind writers, including ones only waiting to get in. */
+	while (rw->rw_writer != NULL || rw->rw_writerswaiting > 0 ||
+	       rw->rw_upgrading) {
+		/* As in the semaphore. */
+		wchan_lock(rw->rw_rwchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_rwchan);
+
+		spinlock_acquire(&rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	rw->rw_readers--;
+	if (rw->rw_upgrading) {
+		/* the only one left is the upgrader */
+		if (rw->rw_readers == 1) {
+			wchan_wakeone(rw->rw_uwchan);
+		}
+	}
+	else if (rw->rw_readers == 0 && rw->rw_writerswaiting > 0) {
+		wchan_wakeone(rw->rw_wwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_writerswaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_lock(rw->rw_wwchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_wwchan);
+
+		spinlock_acquire(&rw->rw_lock);
+	}
+	KASSERT(!rw->rw_upgrading);
+	rw->rw_writerswaiting--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	if (rw->rw_writerswaiting > 0) {
+		wchan_wakeone(rw->rw_wwchan);
+	}
+	else {
+		wchan_wakeall(rw->rw_rwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_upgrade(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	if (rw->rw_upgrading) {
+		/* Someone else got there first; we'd deadlock. */
+		spinlock_release(&rw->rw_lock);
+		return false;
+	}
+
+	/*
+	 * Setting rw_upgrading holds off new readers, and waiting
+	 * writers can't get in while we still hold our read lock, so
+	 * we're next.
+	 */
+	rw->rw_upgrading = true;
+	while (rw->rw_readers > 1) {
+		wchan_lock(rw->rw_uwchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_uwchan);
+
+		spinlock_acquire(&rw->rw_lock);
+	}
+	rw->rw_upgrading = false;
+	rw->rw_readers = 0;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+	return true;
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	rw->rw_readers = 1;
+	/* Let other readers in too, unless a writer is waiting. */
+	if (rw->rw_writerswaiting == 0) {
+		wchan_wakeall(rw->rw_rwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	ret = (rw->rw_writer == curthread);
+	spinlock_release(&rw->rw_lock);
+
+	return ret;
+}
+
+bool
+rwlock_is_held(struct rwlock *rw)
+{
+	bool ret;
+
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	ret = (rw->rw_writer != NULL || rw->rw_readers > 0);
+	spinlock_release(&rw->rw_lock);
+
+	return ret;
+}
@@ -46,6 +46,7 @@
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
+#include <clock.h>
 #include <vnode.h>
 #include <kern/sysexits.h>
 #include <kern/wait.h> /* New include of macros to make exit codes for ASST2 */
@@ -67,6 +68,16 @@ extern int progthread_pid;
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Scheduler parameters: the number of priority levels, the time slice
+ * (in hardclocks) at each level, and how often everything gets
+ * boosted back to the top level so nothing starves.
+ */
+#define SCHED_LEVELS		4
+#define SCHED_BOOST_HARDCLOCKS	HZ	/* once a second */
+
+static const unsigned sched_quantum[SCHED_LEVELS] = { 1, 2, 4, 8 };
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -74,6 +85,10 @@ struct wchan {
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
 };
 
+/* Object caches for threads and wait channels. */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -133,14 +148,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -152,6 +167,8 @@ thread_create(const char *name)
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -202,6 +219,7 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_lastboost = 0;
 
         /* BEGIN A3 SETUP */
 #if !OPT_DUMBVM
@@ -212,6 +230,7 @@ cpu_create(unsigned hardware_number)
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_loadhint = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -298,7 +317,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -345,6 +364,7 @@ thread_panic(void)
 	curcpu->c_runqueue.tl_count = 0;
 	curcpu->c_runqueue.tl_head.tln_next = NULL;
 	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	curcpu->c_loadhint = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -390,6 +410,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 NULL);
+	if (thread_cache == NULL) {
+		panic("Out of memory creating thread cache\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -462,6 +488,34 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Put a thread on a cpu's run queue. The run queue is kept sorted by
+ * priority level, highest (numerically lowest) first, and in arrival
+ * order within each level; so the thread goes after everything at its
+ * own level or better. Searching from the tail makes the common case,
+ * where most everything is at the same level, quick.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	struct threadlistnode *tln;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (tln = c->c_runqueue.tl_tail.tln_prev;
+	     tln->tln_prev != NULL; tln = tln->tln_prev) {
+		if (tln->tln_self->t_priority <= t->t_priority) {
+			threadlist_insertafter(&c->c_runqueue,
+					       tln->tln_self, t);
+			c->c_loadhint = c->c_runqueue.tl_count;
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+	c->c_loadhint = c->c_runqueue.tl_count;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -486,7 +540,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -500,6 +554,98 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * Work stealing.
+ *
+ * This is called by a cpu that has run out of things to do, from the
+ * idle loop in thread_switch, without its own run queue locked. It
+ * takes a thread from the tail of the busiest other cpu's run queue
+ * (that is, the newest one at the lowest level, which is the one
+ * likely to wait longest there) and returns it, already moved to this
+ * cpu, to be run next. It returns NULL if there's nothing worth
+ * taking.
+ *
+ * The load hints pick the victim without locking anything; then only
+ * the victim's run queue is locked. We must not hold our own run
+ * queue lock while doing this, or two idle cpus stealing from each
+ * other would deadlock.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	unsigned i, numcpus, load, maxload;
+	struct cpu *c, *victim;
+	struct thread *t;
+
+	KASSERT(!spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	victim = NULL;
+	maxload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		load = c->c_loadhint;
+		if (load > maxload) {
+			maxload = load;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	if (victim->c_isidle && victim->c_runqueue.tl_count <= 1) {
+		/* It's about to run that one itself. */
+		spinlock_release(&victim->c_runqueue_lock);
+		return NULL;
+	}
+	t = threadlist_remtail(&victim->c_runqueue);
+	if (t != NULL && t == victim->c_curthread) {
+		/*
+		 * This is the case described in thread_consider_migration:
+		 * the thread is on the run queue but the victim is still
+		 * idling on its stack. Leave it be.
+		 */
+		threadlist_addtail(&victim->c_runqueue, t);
+		t = NULL;
+	}
+	victim->c_loadhint = victim->c_runqueue.tl_count;
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t == NULL) {
+		return NULL;
+	}
+
+	t->t_cpu = curcpu->c_self;
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return t;
+}
+
+/*
+ * Check if a thread is running on some cpu. See thread.h.
+ */
+bool
+thread_isrunning(const struct thread *t)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c->c_curthread == t && !c->c_isidle) {
+			return true;
+		}
+	}
+	return false;
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -707,9 +853,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	curcpu->c_isidle = true;
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
+		curcpu->c_loadhint = curcpu->c_runqueue.tl_count;
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* Try taking work from another cpu before idling. */
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -921,17 +1072,116 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each thread has a priority
+ * level, t_priority, from 0 (highest) to SCHED_LEVELS-1, and the run
+ * queue is kept sorted by level (see runqueue_add), so the thread
+ * picked next is always the longest-waiting one at the best level.
+ *
+ *    - New threads start at level 0.
+ *    - A thread that uses up the whole time slice for its level
+ *      drops a level; the slices get longer further down, so
+ *      compute-bound jobs end up running less often but for longer.
+ *    - A thread woken up from a wait channel goes up a level, so
+ *      threads doing I/O get the cpu back promptly and keep the
+ *      devices busy.
+ *    - A thread is preempted at the next hardclock if something at
+ *      a better level is waiting.
+ *    - Every SCHED_BOOST_HARDCLOCKS everything on the cpu goes back
+ *      to level 0, so compute-bound jobs can't be starved and jobs
+ *      that change behavior get reclassified.
+ *
+ * A thread's level is changed only by the thread itself, while it's
+ * running; by whoever wakes it up, after taking it off the wait
+ * channel; or by schedule(), under the run queue lock. Each of those
+ * has it exclusively.
  */
 
+/*
+ * Go up a level on being woken up.
+ */
+static
+void
+thread_wakeup_boost(struct thread *t)
+{
+	if (t->t_priority > 0) {
+		t->t_priority--;
+		t->t_ticks = 0;
+	}
+}
+
+/*
+ * Charge the current hardclock to the current thread. This is called
+ * from hardclock(), on every tick. If the thread has used up its time
+ * slice, drop it a level and yield; otherwise yield only if a thread at
+ * a better level is waiting.
+ */
+void
+thread_tick(void)
+{
+	struct thread *cur, *next;
+	bool preempt;
+
+	/* Don't charge the thread sitting in the idle loop. */
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	cur = curthread;
+	KASSERT(cur->t_priority < SCHED_LEVELS);
+
+	cur->t_ticks++;
+	if (cur->t_ticks >= sched_quantum[cur->t_priority]) {
+		if (cur->t_priority < SCHED_LEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		thread_yield();
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	preempt = false;
+	if (!threadlist_isempty(&curcpu->c_runqueue)) {
+		next = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+		preempt = next->t_priority < cur->t_priority;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * This is called periodically from hardclock(). It does the
+ * anti-starvation boost: once every SCHED_BOOST_HARDCLOCKS, move all
+ * the threads on this cpu back up to level 0. Since they all end up
+ * at the same level, the run queue stays in order.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct threadlistnode *tln;
+	struct thread *t;
+
+	if (curcpu->c_hardclocks - curcpu->c_lastboost <
+	    SCHED_BOOST_HARDCLOCKS) {
+		return;
+	}
+	curcpu->c_lastboost = curcpu->c_hardclocks;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (tln = curcpu->c_runqueue.tl_head.tln_next;
+	     tln->tln_next != NULL; tln = tln->tln_next) {
+		t = tln->tln_self;
+		t->t_priority = 0;
+		t->t_ticks = 0;
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
@@ -960,16 +1210,19 @@ thread_consider_migration(void)
 	struct threadlist victims;
 	struct thread *t;
 
+	/*
+	 * Use the load hints rather than locking every run queue just
+	 * to count; the counts are only a guide anyway, as they can
+	 * change as soon as we've looked.
+	 */
 	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += c->c_loadhint;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = c->c_loadhint;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
@@ -982,8 +1235,14 @@ thread_consider_migration(void)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
 		t = threadlist_remtail(&curcpu->c_runqueue);
+		if (t == NULL) {
+			/* the hint was stale */
+			to_send = i;
+			break;
+		}
 		threadlist_addhead(&victims, t);
 	}
+	curcpu->c_loadhint = curcpu->c_runqueue.tl_count;
 	spinlock_release(&curcpu->c_runqueue_lock);
 
 	for (i=0; i < numcpus && to_send > 0; i++) {
@@ -1023,7 +1282,7 @@ thread_consider_migration(void)
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_add(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -1047,7 +1306,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -1070,31 +1329,54 @@ thread_consider_migration(void)
  * arrangements should be made to free it after the wait channel is
  * destroyed.
  */
+static
+void
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+}
+
 struct wchan *
 wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	/*
+	 * The first wait channels are made in vm_bootstrap, before
+	 * thread_bootstrap, so make the cache on first use. That's
+	 * early in boot while there's only one thread.
+	 */
+	if (wchan_cache == NULL) {
+		wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+						wchan_ctor);
+		if (wchan_cache == NULL) {
+			return NULL;
+		}
+	}
+
+	/* the lock and list are set up by wchan_ctor */
+	wc = kmem_cache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
 
 /*
  * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
+ * (The corresponding cleanup functions require this, and that also
+ * leaves it as wchan_ctor made it, ready for reuse.)
  */
 void
 wchan_destroy(struct wchan *wc)
 {
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	kmem_cache_free(wchan_cache, wc);
 }
 
 /*
@@ -1149,6 +1431,7 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
+	thread_wakeup_boost(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1183,6 +1466,7 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_wakeup_boost(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -0,0 +1,624 @@
+/*
+ * Disk buffer cache.
+ *
+ * Caches disk blocks in memory, keyed by (device, block number), so
+ * filesystems don't go to the disk for every metadata or data access.
+ * See buf.h for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <mainbus.h>
+#include <device.h>
+#include <buf.h>
+
+/*
+ * The cache gets at most 1/BUFFER_RAMFRACTION of physical memory,
+ * but never fewer than BUFFER_MINBUFS buffers.
+ */
+#define BUFFER_RAMFRACTION	16
+#define BUFFER_MINBUFS		32
+
+/* Number of hash buckets. Prime, to spread the block numbers out. */
+#define BUFFER_HASHSIZE		127
+
+/*
+ * One cached block.
+ *
+ * b_dev is NULL if the buffer doesn't currently hold any block; such
+ * buffers are not in the hash table. Every buffer that isn't busy is
+ * on the LRU list, with unused buffers kept at the head so they get
+ * reused first.
+ */
+struct buf {
+	struct device *b_dev;		/* device, or NULL if unused */
+	uint32_t b_block;		/* block number on b_dev */
+	void *b_data;			/* BUFFER_SIZE bytes of data */
+	bool b_busy;			/* handed out to someone, or in I/O */
+	bool b_dirty;			/* modified since last written */
+	struct buf *b_hashnext;		/* next in hash chain */
+	struct buf *b_lruprev;		/* LRU list (head is oldest) */
+	struct buf *b_lrunext;
+};
+
+/*
+ * buffer_lock protects everything below and the identity, busy, and
+ * LRU fields of every buffer. The data and dirty flag of a busy buffer
+ * belong to whoever has it busy. buffer_cv is signalled whenever a
+ * buffer stops being busy.
+ */
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;
+
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buf *buffer_lruhead;
+static struct buf *buffer_lrutail;
+
+static unsigned buffer_num;		/* buffers allocated */
+static unsigned buffer_max;		/* max buffers to allocate */
+
+/* Stats counters */
+static uint32_t ct_hits;
+static uint32_t ct_misses;
+static uint32_t ct_reads;
+static uint32_t ct_writes;
+static uint32_t ct_recycles;
+
+////////////////////////////////////////////////////////////
+//
+// Setup
+
+void
+buffer_bootstrap(void)
+{
+	buffer_max = mainbus_ramsize() / BUFFER_RAMFRACTION / BUFFER_SIZE;
+	if (buffer_max < BUFFER_MINBUFS) {
+		buffer_max = BUFFER_MINBUFS;
+	}
+	buffer_num = 0;
+
+	buffer_lock = lock_create("buffer_lock");
+	if (buffer_lock == NULL) {
+		panic("buffer_bootstrap: Could not create buffer lock\n");
+	}
+	buffer_cv = cv_create("buffer_cv");
+	if (buffer_cv == NULL) {
+		panic("buffer_bootstrap: Could not create buffer cv\n");
+	}
+}
+
+void
+buffer_printstats(void)
+{
+	lock_acquire(buffer_lock);
+	kprintf("buffer cache: %u of %u buffers in use\n",
+		buffer_num, buffer_max);
+	kprintf("buffer cache: %lu hits, %lu misses, %lu recycled\n",
+		(unsigned long) ct_hits, (unsigned long) ct_misses,
+		(unsigned long) ct_recycles);
+	kprintf("buffer cache: %lu disk reads, %lu disk writes\n",
+		(unsigned long) ct_reads, (unsigned long) ct_writes);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_getstats(struct bufstats *bs)
+{
+	lock_acquire(buffer_lock);
+	bs->bs_bufs = buffer_num;
+	bs->bs_maxbufs = buffer_max;
+	bs->bs_hits = ct_hits;
+	bs->bs_misses = ct_misses;
+	bs->bs_reads = ct_reads;
+	bs->bs_writes = ct_writes;
+	bs->bs_recycles = ct_recycles;
+	lock_release(buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Hash table and LRU list
+//
+// All of these assume buffer_lock is held.
+
+static
+unsigned
+buffer_hashfn(struct device *dev, uint32_t block)
+{
+	return (dev->d_devnumber * 31 + block) % BUFFER_HASHSIZE;
+}
+
+static
+struct buf *
+buffer_find(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	for (b = buffer_hash[buffer_hashfn(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buffer_hash_add(struct buf *b)
+{
+	unsigned ix;
+
+	KASSERT(b->b_dev != NULL);
+	ix = buffer_hashfn(b->b_dev, b->b_block);
+	b->b_hashnext = buffer_hash[ix];
+	buffer_hash[ix] = b;
+}
+
+static
+void
+buffer_hash_remove(struct buf *b)
+{
+	struct buf **pp;
+
+	KASSERT(b->b_dev != NULL);
+	pp = &buffer_hash[buffer_hashfn(b->b_dev, b->b_block)];
+	while (*pp != b) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+buffer_lru_remove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		KASSERT(buffer_lruhead == b);
+		buffer_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		KASSERT(buffer_lrutail == b);
+		buffer_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+static
+void
+buffer_lru_addtail(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buffer_lrutail;
+	if (buffer_lrutail != NULL) {
+		buffer_lrutail->b_lrunext = b;
+	}
+	else {
+		buffer_lruhead = b;
+	}
+	buffer_lrutail = b;
+}
+
+static
+void
+buffer_lru_addhead(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buffer_lruhead;
+	if (buffer_lruhead != NULL) {
+		buffer_lruhead->b_lruprev = b;
+	}
+	else {
+		buffer_lrutail = b;
+	}
+	buffer_lruhead = b;
+}
+
+/*
+ * Mark a buffer busy, taking it off the LRU list.
+ */
+static
+void
+buffer_claim(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(!b->b_busy);
+	buffer_lru_remove(b);
+	b->b_busy = true;
+}
+
+/*
+ * Unbusy a buffer. It becomes the most recently used one, unless
+ * ATHEAD is set, in which case it will be the next to be recycled.
+ */
+static
+void
+buffer_unclaim(struct buf *b, bool athead)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	if (athead) {
+		buffer_lru_addhead(b);
+	}
+	else {
+		buffer_lru_addtail(b);
+	}
+	cv_broadcast(buffer_cv, buffer_lock);
+}
+
+/*
+ * Throw away the contents of a busy buffer and unbusy it.
+ */
+static
+void
+buffer_invalidate(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_busy);
+	if (b->b_dev != NULL) {
+		buffer_hash_remove(b);
+	}
+	b->b_dev = NULL;
+	b->b_block = 0;
+	b->b_dirty = false;
+	buffer_unclaim(b, true /* athead */);
+}
+
+////////////////////////////////////////////////////////////
+//
+// I/O
+
+/*
+ * Read or write a busy buffer. Call without holding buffer_lock.
+ */
+static
+int
+buffer_io(struct buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+	int tries=0;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dev != NULL);
+
+	DEBUG(DB_VFS, "buf: %s %u\n", rw == UIO_READ ? "read" : "write",
+	      b->b_block);
+
+ retry:
+	uio_kinit(&iov, &ku, b->b_data, BUFFER_SIZE,
+		  ((off_t)b->b_block)*BUFFER_SIZE, rw);
+	result = b->b_dev->d_io(b->b_dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * This means the sector we requested was out of range,
+		 * or the seek address we gave wasn't sector-aligned,
+		 * or a couple of other things that are our fault.
+		 */
+		panic("buf: d_io returned EINVAL\n");
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buf: block %u I/O error, retrying\n",
+				b->b_block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buf: block %u I/O error, giving up after "
+				"%d retries\n", b->b_block, tries);
+		}
+	}
+	return result;
+}
+
+/*
+ * Write a busy, dirty buffer back to disk. Drops buffer_lock while
+ * doing the I/O; the buffer stays busy (and hashed) so nobody else
+ * can use or reload the block in the meantime.
+ */
+static
+int
+buffer_writeout(struct buf *b)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+
+	ct_writes++;
+	lock_release(buffer_lock);
+	result = buffer_io(b, UIO_WRITE);
+	lock_acquire(buffer_lock);
+	if (result == 0) {
+		b->b_dirty = false;
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Buffer lookup
+
+/*
+ * Allocate a fresh buffer, if we're allowed to have another one.
+ * The new buffer comes back busy and not on any list.
+ */
+static
+struct buf *
+buffer_create(void)
+{
+	struct buf *b;
+
+	if (buffer_num >= buffer_max) {
+		return NULL;
+	}
+
+	b = kmalloc(sizeof(struct buf));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(BUFFER_SIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_dev = NULL;
+	b->b_block = 0;
+	b->b_busy = true;
+	b->b_dirty = false;
+	b->b_hashnext = NULL;
+	b->b_lruprev = b->b_lrunext = NULL;
+
+	buffer_num++;
+	return b;
+}
+
+/*
+ * Find the buffer for a block, or set one up for it, and mark it
+ * busy. If a new buffer had to be set up, *CACHED is set to false
+ * and the caller needs to fill in its contents. If we run out of
+ * buffers, the least recently used one is recycled, writing it back
+ * first if necessary.
+ */
+static
+int
+buffer_lookup(struct device *dev, uint32_t block, struct buf **ret,
+	      bool *cached)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(dev->d_blocksize == BUFFER_SIZE);
+
+	while (1) {
+		b = buffer_find(dev, block);
+		if (b != NULL) {
+			if (b->b_busy) {
+				cv_wait(buffer_cv, buffer_lock);
+				continue;
+			}
+			buffer_claim(b);
+			ct_hits++;
+			*cached = true;
+			*ret = b;
+			return 0;
+		}
+
+		b = buffer_create();
+		if (b == NULL) {
+			b = buffer_lruhead;
+			if (b == NULL) {
+				/* Everything's busy; wait for a release. */
+				cv_wait(buffer_cv, buffer_lock);
+				continue;
+			}
+			buffer_claim(b);
+			if (b->b_dirty) {
+				/*
+				 * Clean it, and since we slept, start
+				 * over. It goes back at the head of the
+				 * LRU list so we'll pick it next time.
+				 */
+				result = buffer_writeout(b);
+				buffer_unclaim(b, result == 0);
+				if (result) {
+					return result;
+				}
+				continue;
+			}
+			if (b->b_dev != NULL) {
+				buffer_hash_remove(b);
+				ct_recycles++;
+			}
+		}
+
+		b->b_dev = dev;
+		b->b_block = block;
+		b->b_dirty = false;
+		buffer_hash_add(b);
+		ct_misses++;
+		*cached = false;
+		*ret = b;
+		return 0;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+int
+buffer_read(struct device *dev, uint32_t block, struct buf **ret)
+{
+	struct buf *b;
+	bool cached;
+	int result;
+
+	lock_acquire(buffer_lock);
+	result = buffer_lookup(dev, block, &b, &cached);
+	if (result) {
+		lock_release(buffer_lock);
+		return result;
+	}
+
+	if (!cached) {
+		ct_reads++;
+		lock_release(buffer_lock);
+		result = buffer_io(b, UIO_READ);
+		lock_acquire(buffer_lock);
+		if (result) {
+			buffer_invalidate(b);
+			lock_release(buffer_lock);
+			return result;
+		}
+	}
+	lock_release(buffer_lock);
+
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_get(struct device *dev, uint32_t block, struct buf **ret)
+{
+	struct buf *b;
+	bool cached;
+	int result;
+
+	lock_acquire(buffer_lock);
+	result = buffer_lookup(dev, block, &b, &cached);
+	lock_release(buffer_lock);
+	if (result) {
+		return result;
+	}
+
+	if (!cached) {
+		/* Don't hand out whatever the buffer held before. */
+		bzero(b->b_data, BUFFER_SIZE);
+	}
+
+	*ret = b;
+	return 0;
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_dirty = true;
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	buffer_unclaim(b, false /* athead */);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_drop(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	while ((b = buffer_find(dev, block)) != NULL && b->b_busy) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	if (b != NULL) {
+		buffer_claim(b);
+		buffer_invalidate(b);
+	}
+	lock_release(buffer_lock);
+}
+
+int
+buffer_sync(struct device *dev)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	lock_acquire(buffer_lock);
+
+	/*
+	 * Writing drops the lock, so the chain we were looking at may
+	 * change under us; rescan the bucket after each write.
+	 */
+	i = 0;
+	while (i < BUFFER_HASHSIZE) {
+		for (b = buffer_hash[i]; b != NULL; b = b->b_hashnext) {
+			if (b->b_dev == dev && b->b_dirty) {
+				break;
+			}
+		}
+		if (b == NULL) {
+			i++;
+			continue;
+		}
+		if (b->b_busy) {
+			cv_wait(buffer_cv, buffer_lock);
+			continue;
+		}
+		buffer_claim(b);
+		result = buffer_writeout(b);
+		buffer_unclaim(b, false /* athead */);
+		if (result) {
+			lock_release(buffer_lock);
+			return result;
+		}
+	}
+
+	lock_release(buffer_lock);
+	return 0;
+}
+
+void
+buffer_drop_device(struct device *dev)
+{
+	struct buf *b, *next;
+	unsigned i;
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<BUFFER_HASHSIZE; i++) {
+		for (b = buffer_hash[i]; b != NULL; b = next) {
+			next = b->b_hashnext;
+			if (b->b_dev != dev) {
+				continue;
+			}
+			/* Should have been synced and released already */
+			KASSERT(!b->b_busy);
+			KASSERT(!b->b_dirty);
+			buffer_claim(b);
+			buffer_invalidate(b);
+		}
+	}
+	lock_release(buffer_lock);
+}
@@ -29,8 +29,12 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>	/* for MAXCPUS */
 
 /*
  * Kernel malloc.
@@ -73,7 +77,9 @@ fill_deadbeef(void *vptr, size_t len)
 //    The free counts and addresses of the pages are maintained in
 //    another list.  Maintaining this table is a nuisance, because it
 //    cannot recursively use the subpage allocator. (We could probably
-//    make that work, but it would be painful.)
+//    make that work, but it would be painful.) The same pagerefs are
+//    also hashed on the page address, so kfree can find the page a
+//    block belongs to without walking the whole list.
 //
 
 #undef  SLOW	/* consistency checks */
@@ -104,6 +110,7 @@ struct freelist {
 struct pageref {
 	struct pageref *next_samesize;
 	struct pageref *next_all;
+	struct pageref *next_hash;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -118,67 +125,59 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pagerefs are kept on a free list (linked through next_all). The
+ * first page's worth lives in the kernel BSS, so we don't need to
+ * allocate anything to get started; that's enough to manage 1M of
+ * kernel heap. When they run out, subpage_kmalloc gets another page
+ * of them with alloc_kpages. Pages of pagerefs are never given back;
+ * the pagerefs in them get reused.
  */
 
 #define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
 static struct pageref pagerefs[NPAGEREFS];
+static bool pagerefs_used;		/* pagerefs[] on the free list */
+static struct pageref *pageref_freelist;
+static unsigned pageref_pages;		/* pages of pagerefs so far */
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static
+void
+addpagerefs(struct pageref *prs, unsigned n)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		prs[i].next_all = pageref_freelist;
+		pageref_freelist = &prs[i];
+	}
+	pageref_pages++;
+}
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *pr;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	if (pageref_freelist == NULL && !pagerefs_used) {
+		addpagerefs(pagerefs, NPAGEREFS);
+		pagerefs_used = true;
 	}
 
-	/* ran out */
-	return NULL;
+	pr = pageref_freelist;
+	if (pr == NULL) {
+		/* ran out */
+		return NULL;
+	}
+	pageref_freelist = pr->next_all;
+	return pr;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	p->next_all = pageref_freelist;
+	pageref_freelist = p;
 }
 
 ////////////////////////////////////////
@@ -186,6 +185,11 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/* Hash of pagerefs on page address, for kfree. */
+#define PRHASH_SIZE	64
+#define PRHASH(va)	(((va) / PAGE_SIZE) % PRHASH_SIZE)
+static struct pageref *prhash[PRHASH_SIZE];
+
 ////////////////////////////////////////
 
 /*
@@ -260,18 +264,28 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < pageref_pages * NPAGEREFS);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < pageref_pages * NPAGEREFS);
 		ac++;
 	}
 
 	KASSERT(sc==ac);
+
+	ac = 0;
+	for (i=0; i<PRHASH_SIZE; i++) {
+		for (pr = prhash[i]; pr != NULL; pr = pr->next_hash) {
+			KASSERT(PRHASH(PR_PAGEADDR(pr)) == (unsigned)i);
+			ac++;
+		}
+	}
+
+	KASSERT(sc==ac);
 }
 #else
 #define checksubpages() 
@@ -345,6 +359,8 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kmem_cache_printstats();
 }
 
 ////////////////////////////////////////
@@ -372,6 +388,14 @@ remove_lists(struct pageref *pr, int blktype)
 			break;
 		}
 	}
+
+	for (guy = &prhash[PRHASH(PR_PAGEADDR(pr))]; *guy;
+	     guy = &(*guy)->next_hash) {
+		if (*guy == pr) {
+			*guy = pr->next_hash;
+			break;
+		}
+	}
 }
 
 static
@@ -399,6 +423,7 @@ subpage_kmalloc(size_t sz)
 	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t refpage;	// new page of pagerefs, if we need one
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
@@ -470,11 +495,20 @@ subpage_kmalloc(size_t sz)
 
 	pr = allocpageref();
 	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+		/* Out of pagerefs; get another page of them. */
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		refpage = alloc_kpages(1);
+		if (refpage==0) {
+			/* Couldn't allocate accounting space either. */
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get "
+				"pageref\n"); 
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		addpagerefs((struct pageref *)refpage, NPAGEREFS);
+		pr = allocpageref();
+		KASSERT(pr != NULL);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -504,6 +538,9 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
+	pr->next_hash = prhash[PRHASH(prpage)];
+	prhash[PRHASH(prpage)] = pr;
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
@@ -526,7 +563,8 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
+	for (pr = prhash[PRHASH(ptraddr & PAGE_FRAME)]; pr;
+	     pr = pr->next_hash) {
 		prpage = PR_PAGEADDR(pr);
 		blktype = PR_BLOCKTYPE(pr);
 
@@ -632,3 +670,473 @@ kfree(void *ptr)
 	}
 }
 
+
+////////////////////////////////////////////////////////////
+//
+// Object caches.
+//
+// For fixed-size objects that are allocated and freed all the time
+// (threads, wait channels, vnodes, ...). It works like this:
+//
+//    Each cache gets whole pages ("slabs") from alloc_kpages and cuts
+//    them into objects of its size. The slab's header is at the end
+//    of the page, so the slab an object belongs to is found by
+//    rounding its address down; no searching. Each slab keeps its
+//    own list of free objects, linked through a word stored after
+//    each object (so as not to disturb the object itself).
+//
+//    If the cache has a constructor, it's called once on each object
+//    when its slab is made, not on every allocation. Objects must be
+//    given back to kmem_cache_free in the same state, so the work
+//    isn't repeated. (Things like spinlocks and threadlists, whose
+//    cleanup functions only check that they're idle, fit this well.)
+//
+//    On top of the slabs, each CPU has a magazine of free objects
+//    for each cache, used with interrupts off and no lock. Only when
+//    it runs dry or fills up does the CPU take the cache's spinlock,
+//    to move half a magazine's worth of objects at once.
+//
+//    Slabs with no objects in use are given back, except that one is
+//    kept per cache so that objects coming and going don't make a
+//    page go back and forth.
+//
+
+/* Per-CPU magazine size. Half of this is moved at a time. */
+#define KMEM_MAGSIZE	8
+
+/* Largest object size, so slabs aren't too wasteful. */
+#define KMEM_MAXSIZE	(PAGE_SIZE / 4)
+
+struct kmem_magazine {
+	unsigned km_num;
+	void *km_objs[KMEM_MAGSIZE];
+};
+
+struct kmem_slab {
+	struct kmem_cache *ks_cache;	/* cache we belong to */
+	struct kmem_slab *ks_next;	/* next on list */
+	struct kmem_slab **ks_prevp;	/* what points to us on list */
+	void *ks_free;			/* free objects */
+	unsigned ks_inuse;		/* objects allocated */
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size */
+	size_t kc_linkoff;		/* offset of free list link */
+	size_t kc_stride;		/* object size, link, and padding */
+	unsigned kc_perslab;		/* objects per slab */
+	void (*kc_ctor)(void *obj);
+
+	struct spinlock kc_lock;	/* for the following */
+	struct kmem_slab *kc_partial;	/* slabs with free objects */
+	struct kmem_slab *kc_full;	/* slabs with none free */
+	struct kmem_slab *kc_empty;	/* a slab with all of them free */
+	unsigned kc_nslabs;		/* slabs on all three lists */
+	unsigned kc_inuse;		/* objects out of the slabs */
+	uint32_t kc_fills;		/* magazine fills */
+	uint32_t kc_drains;		/* objects put back in slabs */
+
+	struct kmem_cache *kc_next;	/* on kmem_caches */
+
+	struct kmem_magazine kc_mags[MAXCPUS];
+};
+
+#define KS_PAGE(ks)	((vaddr_t)(ks) & PAGE_FRAME)
+#define OBJ_SLAB(obj)	((struct kmem_slab *)(((vaddr_t)(obj) & PAGE_FRAME) \
+				+ PAGE_SIZE - sizeof(struct kmem_slab)))
+#define OBJ_LINK(kc, obj) ((void **)((char *)(obj) + (kc)->kc_linkoff))
+
+/* All the caches, for printing stats. */
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Put a slab on a list.
+ */
+static
+void
+kmem_slab_link(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	ks->ks_next = *list;
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prevp = &ks->ks_next;
+	}
+	ks->ks_prevp = list;
+	*list = ks;
+}
+
+/*
+ * Take a slab off whatever list it's on.
+ */
+static
+void
+kmem_slab_unlink(struct kmem_slab *ks)
+{
+	*ks->ks_prevp = ks->ks_next;
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prevp = ks->ks_prevp;
+	}
+	ks->ks_next = NULL;
+	ks->ks_prevp = NULL;
+}
+
+/*
+ * Make a new slab and run the constructor on its objects. Not put on
+ * any list yet.
+ *
+ * Synchronization: called without kc_lock, as alloc_kpages may block.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t page;
+	char *obj;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	ks = OBJ_SLAB(page);
+	ks->ks_cache = kc;
+	ks->ks_next = NULL;
+	ks->ks_prevp = NULL;
+	ks->ks_free = NULL;
+	ks->ks_inuse = 0;
+
+	/* Thread the list backwards so objects come out in order. */
+	for (i=kc->kc_perslab; i-- > 0; ) {
+		obj = (char *)page + i * kc->kc_stride;
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctor(obj);
+		}
+		*OBJ_LINK(kc, obj) = ks->ks_free;
+		ks->ks_free = obj;
+	}
+
+	return ks;
+}
+
+/*
+ * Take up to MAX objects out of the slabs. Returns how many it got;
+ * that's 0 only if there are no free objects in any slab.
+ *
+ * Synchronization: assumes we hold kc_lock.
+ */
+static
+unsigned
+kmem_getobjs(struct kmem_cache *kc, void **objs, unsigned max)
+{
+	struct kmem_slab *ks;
+	void *obj;
+	unsigned n;
+
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	for (n=0; n<max; n++) {
+		ks = kc->kc_partial;
+		if (ks == NULL) {
+			ks = kc->kc_empty;
+			if (ks == NULL) {
+				break;
+			}
+			kmem_slab_unlink(ks);
+			kmem_slab_link(&kc->kc_partial, ks);
+		}
+		KASSERT(ks->ks_cache == kc);
+
+		obj = ks->ks_free;
+		KASSERT(obj != NULL);
+		ks->ks_free = *OBJ_LINK(kc, obj);
+		ks->ks_inuse++;
+		kc->kc_inuse++;
+		if (ks->ks_inuse == kc->kc_perslab) {
+			KASSERT(ks->ks_free == NULL);
+			kmem_slab_unlink(ks);
+			kmem_slab_link(&kc->kc_full, ks);
+		}
+		objs[n] = obj;
+	}
+	return n;
+}
+
+/*
+ * Put N objects back in their slabs, and give back the pages of any
+ * slabs that become unused (beyond the one we keep).
+ *
+ * Synchronization: takes kc_lock, but not while freeing pages.
+ */
+static
+void
+kmem_putobjs(struct kmem_cache *kc, void **objs, unsigned n)
+{
+	struct kmem_slab *ks, *freeslabs;
+	unsigned i;
+
+	freeslabs = NULL;
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_drains++;
+	for (i=0; i<n; i++) {
+		ks = OBJ_SLAB(objs[i]);
+		KASSERT(ks->ks_cache == kc);
+		KASSERT(ks->ks_inuse > 0);
+
+		if (ks->ks_inuse == kc->kc_perslab) {
+			kmem_slab_unlink(ks);
+			kmem_slab_link(&kc->kc_partial, ks);
+		}
+		*OBJ_LINK(kc, objs[i]) = ks->ks_free;
+		ks->ks_free = objs[i];
+		ks->ks_inuse--;
+		kc->kc_inuse--;
+
+		if (ks->ks_inuse == 0) {
+			kmem_slab_unlink(ks);
+			if (kc->kc_empty == NULL) {
+				kmem_slab_link(&kc->kc_empty, ks);
+			}
+			else {
+				kc->kc_nslabs--;
+				ks->ks_next = freeslabs;
+				freeslabs = ks;
+			}
+		}
+	}
+	spinlock_release(&kc->kc_lock);
+
+	while (freeslabs != NULL) {
+		ks = freeslabs;
+		freeslabs = ks->ks_next;
+		free_kpages(KS_PAGE(ks));
+	}
+}
+
+/*
+ * Create an object cache. NAME is for stats printouts and should
+ * generally be a string constant. CTOR, if not NULL, is run on each
+ * object when it's first made.
+ */
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj))
+{
+	struct kmem_cache *kc;
+	unsigned i;
+
+	KASSERT(size > 0 && size <= KMEM_MAXSIZE);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_linkoff = ROUNDUP(size, sizeof(void *));
+	/* keep objects 8-aligned for the sake of 64-bit fields */
+	kc->kc_stride = ROUNDUP(kc->kc_linkoff + sizeof(void *), 8);
+	kc->kc_perslab = (PAGE_SIZE - sizeof(struct kmem_slab)) /
+		kc->kc_stride;
+	kc->kc_ctor = ctor;
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = NULL;
+	kc->kc_full = NULL;
+	kc->kc_empty = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_fills = 0;
+	kc->kc_drains = 0;
+
+	for (i=0; i<MAXCPUS; i++) {
+		kc->kc_mags[i].km_num = 0;
+	}
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+/*
+ * Destroy an object cache. All its objects must have been freed, and
+ * nobody may be using it any more.
+ */
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+	struct kmem_slab *ks;
+	unsigned i;
+
+	/* empty the magazines */
+	for (i=0; i<MAXCPUS; i++) {
+		kmem_putobjs(kc, kc->kc_mags[i].km_objs,
+			     kc->kc_mags[i].km_num);
+		kc->kc_mags[i].km_num = 0;
+	}
+
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_partial == NULL);
+	KASSERT(kc->kc_full == NULL);
+	ks = kc->kc_empty;
+	if (ks != NULL) {
+		kmem_slab_unlink(ks);
+		free_kpages(KS_PAGE(ks));
+	}
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kcp = &kmem_caches; *kcp != kc; kcp = &(*kcp)->kc_next) {
+		KASSERT(*kcp != NULL);
+	}
+	*kcp = kc->kc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+/*
+ * Allocate an object when this CPU's magazine is empty: take half a
+ * magazine's worth out of the slabs (making a new slab if need be),
+ * return one and put the rest in the magazine.
+ */
+static
+void *
+kmem_cache_fill(struct kmem_cache *kc)
+{
+	void *objs[KMEM_MAGSIZE/2];
+	struct kmem_magazine *mag;
+	struct kmem_slab *ks;
+	unsigned n;
+	int spl;
+
+	spinlock_acquire(&kc->kc_lock);
+	n = kmem_getobjs(kc, objs, KMEM_MAGSIZE/2);
+	kc->kc_fills++;
+	spinlock_release(&kc->kc_lock);
+
+	if (n == 0) {
+		ks = kmem_slab_create(kc);
+		if (ks == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kmem_slab_link(&kc->kc_partial, ks);
+		kc->kc_nslabs++;
+		n = kmem_getobjs(kc, objs, KMEM_MAGSIZE/2);
+		spinlock_release(&kc->kc_lock);
+		KASSERT(n > 0);
+	}
+
+	/*
+	 * We may be on another CPU by now, and another thread may have
+	 * filled its magazine; whatever doesn't fit goes back.
+	 */
+	if (n > 1 && CURCPU_EXISTS()) {
+		spl = splhigh();
+		mag = &kc->kc_mags[curcpu->c_number];
+		while (n > 1 && mag->km_num < KMEM_MAGSIZE) {
+			mag->km_objs[mag->km_num++] = objs[--n];
+		}
+		splx(spl);
+	}
+	if (n > 1) {
+		kmem_putobjs(kc, objs + 1, n - 1);
+	}
+
+	return objs[0];
+}
+
+/*
+ * Allocate an object. Returns NULL if out of memory.
+ */
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_magazine *mag;
+	void *obj;
+	int spl;
+
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		mag = &kc->kc_mags[curcpu->c_number];
+		if (mag->km_num > 0) {
+			obj = mag->km_objs[--mag->km_num];
+			splx(spl);
+			return obj;
+		}
+		splx(spl);
+	}
+
+	return kmem_cache_fill(kc);
+}
+
+/*
+ * Free an object. If this CPU's magazine is full, the older half of
+ * it goes back to the slabs first.
+ */
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	void *objs[KMEM_MAGSIZE/2];
+	struct kmem_magazine *mag;
+	unsigned i, n;
+	int spl;
+
+	KASSERT(obj != NULL);
+	KASSERT(OBJ_SLAB(obj)->ks_cache == kc);
+
+	if (!CURCPU_EXISTS()) {
+		kmem_putobjs(kc, &obj, 1);
+		return;
+	}
+
+	n = 0;
+	spl = splhigh();
+	mag = &kc->kc_mags[curcpu->c_number];
+	if (mag->km_num == KMEM_MAGSIZE) {
+		n = KMEM_MAGSIZE/2;
+		for (i=0; i<n; i++) {
+			objs[i] = mag->km_objs[i];
+		}
+		for (i=n; i<KMEM_MAGSIZE; i++) {
+			mag->km_objs[i-n] = mag->km_objs[i];
+		}
+		mag->km_num -= n;
+	}
+	mag->km_objs[mag->km_num++] = obj;
+	splx(spl);
+
+	if (n > 0) {
+		kmem_putobjs(kc, objs, n);
+	}
+}
+
+/*
+ * Print object cache counters.
+ */
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kprintf("Object caches:\n");
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("%-12s %4lu bytes: %u slabs, %u objects out, "
+			"%lu fills, %lu drains\n", kc->kc_name,
+			(unsigned long) kc->kc_size, kc->kc_nslabs,
+			kc->kc_inuse, (unsigned long) kc->kc_fills,
+			(unsigned long) kc->kc_drains);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
@@ -72,8 +72,35 @@ vm_printstats(void)
 	vm_printmdstats();
 }
 
+/* Object cache for lpages. */
+static struct kmem_cache *lpage_cache;
+
+static
+void
+lpage_ctor(void *obj)
+{
+	struct lpage *lp = obj;
+
+	spinlock_init(&lp->lp_spinlock);
+}
+
 /*
- * Create a logical page object.
+ * lpage_bootstrap: set up the lpage cache.
+ * Synchronization: none; runs at boot.
+ */
+void
+lpage_bootstrap(void)
+{
+	lpage_cache = kmem_cache_create("lpage", sizeof(struct lpage),
+					lpage_ctor);
+	if (lpage_cache == NULL) {
+		panic("lpage: Out of memory creating lpage cache\n");
+	}
+}
+
+/*
+ * Create a logical page object. (The spinlock is set up already, by
+ * lpage_ctor.)
  * Synchronization: none.
  */
 struct lpage *
@@ -81,14 +108,13 @@ lpage_create(void)
 {
 	struct lpage *lp;
 
-	lp = kmalloc(sizeof(struct lpage));
+	lp = kmem_cache_alloc(lpage_cache);
 	if (lp==NULL) {
 		return NULL;
 	}
 
 	lp->lp_swapaddr = INVALID_SWAPADDR;
 	lp->lp_paddr = INVALID_PADDR;
-	spinlock_init(&lp->lp_spinlock);
 
 	return lp;
 }
@@ -131,8 +157,9 @@ lpage_destroy(struct lpage *lp)
 		swap_free(lp->lp_swapaddr);
 	}
 
+	/* this leaves the spinlock as lpage_ctor made it */
 	spinlock_cleanup(&lp->lp_spinlock);
-	kfree(lp);
+	kmem_cache_free(lpage_cache, lp);
 }
 
 
@@ -95,12 +95,39 @@ dodirblock(uint32_t block)
 	}
 }
 
+/*
+ * Dump the directory blocks under indirect block IBLOCK, which is at
+ * indirection level INDIRECTION (1 for the plain indirect block).
+ */
+static
+void
+dodirindirect(uint32_t iblock, int indirection, uint32_t *nblocksp)
+{
+	uint32_t ib[SFS_DBPERIDB];
+	uint32_t block;
+	int i;
+
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		block = SWAPL(ib[i]);
+		if (block == 0) {
+			continue;
+		}
+		if (indirection > 1) {
+			dodirindirect(block, indirection-1, nblocksp);
+		}
+		else {
+			dodirblock(block);
+			(*nblocksp)++;
+		}
+	}
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
 	int nentries, i;
 	uint32_t block, nblocks=0;
 
@@ -120,14 +147,13 @@ dumpdir(uint32_t ino)
 		}
 	}
 	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
+		dodirindirect(SWAPL(sfi.sfi_indirect), 1, &nblocks);
+	}
+	if (SWAPL(sfi.sfi_dindirect)) {
+		dodirindirect(SWAPL(sfi.sfi_dindirect), 2, &nblocks);
+	}
+	if (SWAPL(sfi.sfi_tindirect)) {
+		dodirindirect(SWAPL(sfi.sfi_tindirect), 3, &nblocks);
 	}
 	printf("    %u blocks in directory\n", nblocks);
 }